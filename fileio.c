@@ -0,0 +1,113 @@
+/*
+ * Expose mmap(2), sendfile(2) and splice(2) as a program, to test the
+ * file system's paths for them.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <stdio.h>
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s mmap|sendfile|splice <filename>\n", progname);
+	printf("       %s mmapwrite <filename> <offset> <string>\n", progname);
+	printf("Copies the file to standard output with mmap, sendfile or splice;\n");
+	printf("or writes the string into the file through a shared mapping.\n");
+	exit(1);
+}
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void copy_out(int fd, ssize_t n)
+{
+	char buf[4096];
+	ssize_t r;
+
+	while (n > 0)
+	{
+		if ((r = read(fd, buf, n < (ssize_t) sizeof(buf) ? n : (ssize_t) sizeof(buf))) <= 0)
+			fail("read");
+		if (write(1, buf, r) != r)
+			fail("write");
+		n -= r;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	char *map;
+	off_t off = 0;
+	ssize_t n;
+	int fd, fds[2];
+
+	if (argc < 3 || (strcmp(argv[1], "mmapwrite") == 0) != (argc == 5)
+	    || (argc != 3 && argc != 5))
+		usage(argv[0]);
+
+	if ((fd = open(argv[2], argc == 5 ? O_RDWR : O_RDONLY)) < 0
+	    || fstat(fd, &st) < 0)
+		fail(argv[2]);
+
+	if (strcmp(argv[1], "mmap") == 0 || strcmp(argv[1], "mmapwrite") == 0)
+	{
+		if (st.st_size == 0)
+			return 0;
+		map = mmap(NULL, st.st_size, PROT_READ | (argc == 5 ? PROT_WRITE : 0),
+			   MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			fail("mmap");
+		if (argc == 3)
+		{
+			if (write(1, map, st.st_size) != st.st_size)
+				fail("write");
+			return 0;
+		}
+		off = atoi(argv[3]);
+		if (off + strlen(argv[4]) > (size_t) st.st_size)
+		{
+			printf("%s: the string must fit in the file\n", argv[0]);
+			return 1;
+		}
+		memcpy(map + off, argv[4], strlen(argv[4]));
+		if (msync(map, st.st_size, MS_SYNC) < 0)
+			fail("msync");
+		return 0;
+	}
+	else if (strcmp(argv[1], "sendfile") == 0)
+	{
+		// Old kernels can only send a file to a socket
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+			fail("socketpair");
+		while ((n = sendfile(fds[0], fd, &off, 4096)) > 0)
+			copy_out(fds[1], n);
+		if (n < 0)
+			fail("sendfile");
+		return 0;
+	}
+	else if (strcmp(argv[1], "splice") == 0)
+	{
+		if (pipe(fds) < 0)
+			fail("pipe");
+		while ((n = splice(fd, &off, fds[1], NULL, 4096, 0)) > 0)
+			copy_out(fds[0], n);
+		if (n < 0)
+			fail("splice");
+		return 0;
+	}
+
+	usage(argv[0]);
+	return 1;
+}
@@ -3,12 +3,27 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 
 /****************************************************************************
  * fsimgtoc
  *
  *   Reads in a file system image and writes out C code containing that image.
  *
+ *   With -b, the C code doesn't contain the image itself: it has the
+ *   assembler pull the image file in with .incbin, which builds in seconds
+ *   where a multi-megabyte initializer takes the compiler minutes.  The
+ *   image file must then still exist, at the same absolute path, when the
+ *   output is compiled.
+ *
+ *   With -s BLKSIZE, only the blocks of the image that aren't all zero are
+ *   written out, packed together in 'ospfs_data', and 'ospfs_sparse_runs'
+ *   lists where they go: pairs of (first block, number of blocks).  The
+ *   module gives the zero blocks memory only when they are first used.
+ *   BLKSIZE must be the image's block size.  Without -s,
+ *   'ospfs_sparse_blksize' is 0 and 'ospfs_data' is the whole image.
+ *
  ****************************************************************************/
 
 static int designated_initializers = 1;
@@ -39,17 +54,151 @@ print(FILE *f, long size, FILE *out)
 		n++;
 		c = getc(f);
 	}
-	fprintf(out, "};\nuint32_t ospfs_length = %lu;\n", size);
+	fprintf(out, "};\n");
+}
+
+// Writes the start of an .incbin line for 'path', escaped for both C and
+// the assembler.
+static void
+print_incbin_path(const char *path, FILE *out)
+{
+	const char *p;
+
+	fprintf(out, "    \"\t.incbin \\\"");
+	for (p = path; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\\\\\");
+		fputc(*p, out);
+	}
+	fprintf(out, "\\\"");
+}
+
+// Writes the table of runs of nonzero blocks.
+static void
+print_runs(const uint32_t *runs, uint32_t nruns, long blksize, FILE *out)
+{
+	uint32_t r;
+
+	fprintf(out, "uint32_t ospfs_sparse_blksize = %ld;\n\
+uint32_t ospfs_sparse_nruns = %u;\n", blksize, nruns);
+	if (!nruns) {
+		fprintf(out, "uint32_t ospfs_sparse_runs[1];\n");
+		return;
+	}
+	fprintf(out, "uint32_t ospfs_sparse_runs[%u] = {\n", 2 * nruns);
+	for (r = 0; r < nruns; r++)
+		fprintf(out, "%u,%u,%s", runs[2*r], runs[2*r + 1],
+			r % 8 == 7 || r == nruns - 1 ? "\n" : "");
+	fprintf(out, "};\n");
+}
+
+// Reads the 'size'-byte image 'f' in blocks of 'blksize' bytes and finds
+// the runs of blocks that aren't all zero.  If 'packed' is nonnull, those
+// blocks are copied to it.  Returns the runs, as pairs (first block,
+// number of blocks), and sets '*nrunsp' and '*nbytesp' to the number of
+// runs and the number of bytes in them.
+static uint32_t *
+find_runs(FILE *f, long size, long blksize, FILE *packed,
+	  uint32_t *nrunsp, long *nbytesp)
+{
+	unsigned char *buf = malloc(blksize);
+	uint32_t *runs = NULL, nruns = 0, cap = 0, b;
+	long nbytes = 0, i, n;
+
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	for (b = 0; (long) b * blksize < size; b++) {
+		n = fread(buf, 1, blksize, f);
+		if (n <= 0)
+			break;
+		for (i = 0; i < n && buf[i] == 0; i++)
+			/* nada */;
+		if (i == n)
+			continue;
+
+		if (nruns && runs[2*nruns - 2] + runs[2*nruns - 1] == b)
+			runs[2*nruns - 1]++;
+		else {
+			if (nruns == cap) {
+				cap = cap ? 2 * cap : 64;
+				if (!(runs = realloc(runs, 2 * cap * sizeof(uint32_t)))) {
+					perror("realloc");
+					exit(1);
+				}
+			}
+			runs[2*nruns] = b;
+			runs[2*nruns + 1] = 1;
+			nruns++;
+		}
+		// A short last block is padded out with zeros
+		memset(buf + n, 0, blksize - n);
+		if (packed && fwrite(buf, 1, blksize, packed) != (size_t) blksize) {
+			perror("fwrite");
+			exit(1);
+		}
+		nbytes += blksize;
+	}
+
+	free(buf);
+	*nrunsp = nruns;
+	*nbytesp = nbytes;
+	return runs;
+}
+
+// Writes code that embeds the image file 'path' with .incbin: all of it,
+// or with 'nruns' > 0, just the 'nruns' runs of 'blksize'-byte blocks in
+// 'runs'.  'size' is the number of bytes embedded.  The module writes to
+// ospfs_data, so it goes in .data.
+void
+print_incbin(const char *path, long size, const uint32_t *runs, uint32_t nruns,
+	     long blksize, FILE *out)
+{
+	uint32_t r = 0;
+
+	fprintf(out, "asm(\".data\\n\"\n\
+    \"\t.globl ospfs_data\\n\"\n\
+    \"\t.type ospfs_data, @object\\n\"\n\
+    \"\t.balign 32\\n\"\n\
+    \"ospfs_data:\\n\"\n");
+	do {
+		print_incbin_path(path, out);
+		if (nruns)
+			fprintf(out, ", %ld, %ld", runs[2*r] * blksize,
+				runs[2*r + 1] * blksize);
+		fprintf(out, "\\n\"\n");
+	} while (++r < nruns);
+	fprintf(out, "    \"\t.size ospfs_data, %ld\\n\"\n\
+    \".previous\\n\");\n", size);
 }
 
 int
 main(int argc, char *argv[])
 {
-	FILE *in = stdin, *out = stdout;
-	long in_size;
+	FILE *in = stdin, *out = stdout, *packed = NULL;
+	long in_size, blksize = 0, nbytes;
+	int incbin = 0;
+	char path[PATH_MAX], *e;
+	uint32_t *runs = NULL, nruns = 0;
 
-	if (argc > 3) {
-		fprintf(stderr, "Usage: fsimgtoc [IN [OUT]]\n");
+	while (argc > 1) {
+		if (strcmp(argv[1], "-b") == 0)
+			incbin = 1;
+		else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+			blksize = strtol(argv[2], &e, 0);
+			if (*e || blksize <= 0 || (blksize & (blksize - 1))) {
+				fprintf(stderr, "fsimgtoc: bad block size %s\n", argv[2]);
+				exit(1);
+			}
+			argc--, argv++;
+		} else
+			break;
+		argc--, argv++;
+	}
+	if (argc > 3 || (incbin && (argc < 2 || strcmp(argv[1], "-") == 0))) {
+		fprintf(stderr, "Usage: fsimgtoc [-s BLKSIZE] [IN [OUT]]\n\
+       fsimgtoc -b [-s BLKSIZE] IN [OUT]\n");
 		exit(1);
 	}
 	if (argc > 2 && strcmp(argv[2], "-") != 0
@@ -62,6 +211,10 @@ main(int argc, char *argv[])
 		perror(argv[1]);
 		exit(1);
 	}
+	if (incbin && realpath(argv[1], path) == 0) {
+		perror(argv[1]);
+		exit(1);
+	}
 
 	// find file size
 	if (fseek(in, 0, SEEK_END) < 0) {
@@ -73,13 +226,30 @@ main(int argc, char *argv[])
 		perror(argv[1]);
 		exit(1);
 	}
+
+	// find the nonzero blocks; without .incbin, copy them out to print
+	nbytes = in_size;
+	if (blksize) {
+		if (!incbin && (packed = tmpfile()) == 0) {
+			perror("tmpfile");
+			exit(1);
+		}
+		runs = find_runs(in, in_size, blksize, packed, &nruns, &nbytes);
+		if (packed)
+			rewind(packed);
+	}
 	
 	fprintf(out, "#include <linux/autoconf.h>\n\
 #include <linux/version.h>\n\
 #include <linux/module.h>\n\
 #include <linux/types.h>\n\
 \n");
-	print(in, in_size, out);
+	if (incbin)
+		print_incbin(path, nbytes, runs, nruns, blksize, out);
+	else
+		print(packed ? packed : in, nbytes, out);
+	fprintf(out, "uint32_t ospfs_length = %lu;\n", in_size);
+	print_runs(runs, nruns, blksize, out);
 	
 	exit(0);
 }
@@ -91,6 +91,124 @@ close FOO;
       '15'
     ],
 
+    # a write far past the end of a file leaves a hole, which reads as zeros
+    [ 'echo end | dd bs=1 seek=1000000 of=test/sparse.txt conv=notrunc >/dev/null 2>&1 ; ls -l test/sparse.txt | awk \'{ print $5 }\' ; cmp -n 1000000 test/sparse.txt /dev/zero && tail -c 4 test/sparse.txt',
+      '1000004 end'
+    ],
+
+    # the hole takes up no blocks (st_blocks counts 512-byte units)
+    [ 'b=`stat -c %b test/sparse.txt` ; test $b -gt 0 -a $b -lt 64 && du -k test/sparse.txt | awk \'{ print ($1 < 32) ? "small" : $1 }\'',
+      'small'
+    ],
+
+    # but a file of zeros as long does
+    [ 'head -c 1000004 /dev/zero > test/zeros.txt ; test `stat -c %b test/zeros.txt` -ge 1954 && echo full ; rm -f test/zeros.txt',
+      'full'
+    ],
+
+    # filling in part of the hole leaves the rest of it zeros
+    [ 'echo middle | dd bs=1 seek=300000 of=test/sparse.txt conv=notrunc >/dev/null 2>&1 ; dd if=test/sparse.txt bs=1 skip=300000 count=6 2>/dev/null ; echo ; cmp -n 300000 test/sparse.txt /dev/zero && cmp -i 300007:0 -n 699993 test/sparse.txt /dev/zero && echo zeros',
+      'middle zeros'
+    ],
+
+    # truncate into the hole: the blocks past the new end are freed, and
+    # growing the file again shows zeros, not the old data
+    [ 'b=`stat -c %b test/sparse.txt` ; ./truncate test/sparse.txt 500000 ; ls -l test/sparse.txt | awk \'{ print $5 }\' ; test `stat -c %b test/sparse.txt` -lt $b && echo freed ; ./truncate test/sparse.txt 1000004 ; tail -c 500004 test/sparse.txt | cmp -n 500004 - /dev/zero && echo zeros',
+      '500000 freed zeros'
+    ],
+
+    # growing a file with truncate allocates nothing
+    [ './truncate test/sparse.txt 0 ; ./truncate test/sparse.txt 2000000 ; ls -l test/sparse.txt | awk \'{ print $5 }\' ; stat -c %b test/sparse.txt ; cmp -n 2000000 test/sparse.txt /dev/zero && echo zeros ; rm test/sparse.txt',
+      '2000000 0 zeros'
+    ],
+
+    # a small file keeps its data in the inode and takes up no blocks
+    [ 'echo 0123456789012345678901234567890123456789 > test/inline.txt ; cat test/inline.txt ; stat -c %b test/inline.txt',
+      '0123456789012345678901234567890123456789 0'
+    ],
+
+    # past 48 bytes (OSPFS_MAXINLINELEN) its data moves to a block
+    [ 'echo abcdefghij >> test/inline.txt ; cat test/inline.txt ; ls -l test/inline.txt | awk \'{ print $5 }\' ; test `stat -c %b test/inline.txt` -gt 0 && echo spilled',
+      '0123456789012345678901234567890123456789 abcdefghij 52 spilled'
+    ],
+
+    # shrinking keeps what's left; emptying it puts new data back inline
+    [ './truncate test/inline.txt 10 ; cat test/inline.txt ; echo ; echo tiny > test/inline.txt ; cat test/inline.txt ; stat -c %b test/inline.txt',
+      '0123456789 tiny 0'
+    ],
+
+    # mmap, sendfile and splice read inline data
+    [ 'for m in mmap sendfile splice; do ./fileio $m test/inline.txt; done',
+      'tiny tiny tiny'
+    ],
+
+    # a write through a shared mapping lands in the inode
+    [ './fileio mmapwrite test/inline.txt 1 ON ; cat test/inline.txt ; stat -c %b test/inline.txt',
+      'tONy 0'
+    ],
+
+    # and they read the data once it has moved to a block
+    [ 'yes abc | head -n 20 > test/inline.txt ; for m in mmap sendfile splice; do ./fileio $m test/inline.txt | cmp - test/inline.txt && echo same; done ; rm test/inline.txt',
+      'same same same'
+    ],
+
+    # an image made with ospfsformat -d shares identical data blocks
+    # between files (only one OSPFS can be mounted at a time)
+    [ 'umount test ; rm -rf /tmp/dedup ; mkdir /tmp/dedup && cp base/pokercats.gif /tmp/dedup/a.gif && cp base/pokercats.gif /tmp/dedup/b.gif && ./ospfsformat -d /tmp/dedup.img 1024 32 -r /tmp/dedup >/dev/null 2>&1 && ./ospfsck -q /tmp/dedup.img | grep -o "shared=[0-9]*" ; mount -t ospfs -o loop /tmp/dedup.img test && cmp test/a.gif test/b.gif && echo same',
+      'shared=90 same'
+    ],
+
+    # writing to one file copies the shared block first, so the other
+    # file doesn't change
+    [ 'echo XXXX | dd bs=1 count=4 seek=50000 of=test/a.gif conv=notrunc >/dev/null 2>&1 ; dd if=test/a.gif bs=1 skip=50000 count=4 2>/dev/null ; echo ; cmp base/pokercats.gif test/b.gif && echo b same',
+      'XXXX b same'
+    ],
+
+    # so does writing through a shared mapping
+    [ './fileio mmapwrite test/b.gif 100 YY ; dd if=test/b.gif bs=1 skip=100 count=2 2>/dev/null ; echo ; cmp -n 50000 base/pokercats.gif test/a.gif && echo a same',
+      'YY a same'
+    ],
+
+    # the copies leave the other blocks shared, and the reference counts
+    # on the disk agree
+    [ 'umount test && ./ospfsck -q /tmp/dedup.img > /tmp/dedup.txt ; grep -o "errors=[0-9]*" /tmp/dedup.txt ; s=`sed -n "s/.* shared=\([0-9]*\).*/\1/p" /tmp/dedup.txt` ; test $s -gt 80 -a $s -lt 90 && echo still shared ; mount -t ospfs -o loop /tmp/dedup.img test && echo mounted',
+      'errors=0 still shared mounted'
+    ],
+
+    # removing one file only drops the reference counts of the blocks it
+    # shared, and frees the rest
+    [ 'u=`sed -n "s/.* used=\([0-9]*\).*/\1/p" /tmp/dedup.txt` ; rm test/b.gif ; cmp -n 50000 base/pokercats.gif test/a.gif && cmp -i 50004:50004 base/pokercats.gif test/a.gif && echo a intact ; umount test && ./ospfsck -q /tmp/dedup.img > /tmp/dedup.txt ; grep -o "shared=[0-9]*\|errors=[0-9]*" /tmp/dedup.txt ; f=$((u - `sed -n "s/.* used=\([0-9]*\).*/\1/p" /tmp/dedup.txt`)) ; test $f -gt 0 -a $f -lt 10 && echo few freed',
+      'a intact shared=0 errors=0 few freed'
+    ],
+
+    # put the compiled-in image back
+    [ 'mount -t ospfs none test && rm -rf /tmp/dedup /tmp/dedup.img /tmp/dedup.txt && ls test | grep -c pokercats.gif',
+      '1'
+    ],
+
+    # the first mount of an image gives it a journal; a clean unmount
+    # leaves nothing in it to replay
+    [ 'umount test ; ./ospfsformat /tmp/journal.img 1024 32 -r base >/dev/null 2>&1 && mount -t ospfs -o loop /tmp/journal.img test && umount test && ./ospfsck -q /tmp/journal.img | grep -o "journal_pending=[0-9]*\|errors=[0-9]*"',
+      'journal_pending=0 errors=0'
+    ],
+
+    # simulate a crash: commit after every operation, keep the kernel from
+    # writing the home blocks back, and copy the image while it's mounted.
+    # The copy's journal holds committed transactions its home blocks lack.
+    [ 'p=/sys/module/ospfs/parameters/ospfs_commit_ops ; c=`cat $p` ; w=`cat /proc/sys/vm/dirty_writeback_centisecs` ; e=`cat /proc/sys/vm/dirty_expire_centisecs` ; echo 0 > /proc/sys/vm/dirty_writeback_centisecs ; echo 360000 > /proc/sys/vm/dirty_expire_centisecs ; echo 1 > $p ; mount -t ospfs -o loop /tmp/journal.img test && touch test/j1 test/j2 && ln test/j1 test/j3 && rm test/world.txt && cp /tmp/journal.img /tmp/crash.img ; umount test ; echo $c > $p ; echo $w > /proc/sys/vm/dirty_writeback_centisecs ; echo $e > /proc/sys/vm/dirty_expire_centisecs ; ./ospfsck /tmp/crash.img > /tmp/crash.txt 2>/dev/null ; grep -c "path=/j1" /tmp/crash.txt ; test `grep -c "^journal_txn=" /tmp/crash.txt` -ge 4 && grep -o "journal_pending=[0-9]*" /tmp/crash.txt | grep -v "=0" | sed "s/=.*//"',
+      '0 journal_pending'
+    ],
+
+    # mounting the copy replays the journal
+    [ 'mount -t ospfs -o loop /tmp/crash.img test && ls test ; ls -l test/j1 | awk \'{ print $2 }\' ; dmesg | tail -n 20 | grep -q "replayed [0-9]* journal transactions" && echo replayed ; umount test && ./ospfsck -q /tmp/crash.img | grep -o "journal_pending=[0-9]*\|errors=[0-9]*"',
+      'hello.txt j1 j2 j3 pokercats.gif subdir 2 replayed journal_pending=0 errors=0'
+    ],
+
+    # put the compiled-in image back
+    [ 'mount -t ospfs none test && rm -f /tmp/journal.img /tmp/crash.img /tmp/crash.txt && ls test | grep -c pokercats.gif',
+      '1'
+    ],
+
 );
 
 my($ntest) = 0;
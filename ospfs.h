@@ -6,13 +6,24 @@
  * BLOCKS
  *
  *   The OSPFS format divides disk data into a series of blocks,
- *   where each block contains 'OSPFS_BLKSIZE' bytes (1024 bytes)
+ *   where each block contains 'OSPFS_BLKSIZE' bytes (1024 bytes by default)
  *   and 'OSPFS_BLKBITSIZE' bits.
  *
+ *   The block size is chosen when the file system is formatted: 1, 2 or
+ *   4 KB, recorded in the superblock.  Code that handles any block size
+ *   defines OSPFS_BLKSIZE_BITS to a variable before including this file,
+ *   and the macros that depend on the block size follow it.
+ *
  *****************************************************************************/
-#define OSPFS_BLKSIZE_BITS  10
-#define OSPFS_BLKSIZE       (1 << OSPFS_BLKSIZE_BITS) /* == 1024 */
+#define OSPFS_BLKSIZE_BITS_MIN	10
+#define OSPFS_BLKSIZE_BITS_MAX	12
+#ifndef OSPFS_BLKSIZE_BITS
+#define OSPFS_BLKSIZE_BITS  OSPFS_BLKSIZE_BITS_MIN
+#endif
+#define OSPFS_BLKSIZE       (1 << OSPFS_BLKSIZE_BITS) /* == 1024 by default */
 #define OSPFS_BLKBITSIZE    (OSPFS_BLKSIZE * 8)
+#define OSPFS_BLKSIZE_MIN   (1 << OSPFS_BLKSIZE_BITS_MIN)
+#define OSPFS_BLKSIZE_MAX   (1 << OSPFS_BLKSIZE_BITS_MAX)
 
 
 /*****************************************************************************
@@ -53,6 +64,18 @@
  *
  *   where X equals the superblock's "s_firstinob" member.
  *
+ *   The superblock is always in block 1, so its byte offset depends on the
+ *   block size; a reader tries each possible size until it finds one whose
+ *   superblock agrees.
+ *
+ *   An image built with shared data blocks (ospfsformat -d) also has a
+ *   REFERENCE-COUNT MAP between the inode blocks and the data blocks,
+ *   starting at the superblock's "os_refmapb".  It holds one 32-bit count
+ *   per block of the disk: the number of block pointers to that block
+ *   beyond the first.  So an unshared block's count is 0; a shared block
+ *   is freed only when its count is 0, and must be copied before a file
+ *   writes to it.  Only regular files' data blocks are ever shared.
+ *
  *****************************************************************************/
 
 // OSPFS's superblock.
@@ -68,17 +91,23 @@ typedef struct ospfs_super {
 	uint32_t os_nblocks;   // Number of blocks on disk
 	uint32_t os_ninodes;   // Number of inodes on disk
 	uint32_t os_firstinob; // First inode block
+	uint32_t os_blksize_bits; // log2 of the block size; 0 means
+				  // OSPFS_BLKSIZE_BITS_MIN
+	uint32_t os_refmapb;   // First reference-count block, or 0 if none
 } ospfs_super_t;
 
+// Number of reference counts in a reference-count block.
+#define OSPFS_BLKREFS		(OSPFS_BLKSIZE / 4)
+
 
 /*****************************************************************************
  * INODES
  *
  *   Inodes are represented by 'struct ospfs_inode'.
- *   This structure is 64 bytes long, so 16 inodes fit in an inode block.
+ *   This structure is 64 bytes long, so 16 inodes fit in a 1 KB inode block.
  *
  *   Each inode stores the block numbers of the blocks that contain that
- *   file's data.  If the file is less than 10KB big, the block pointers are
+ *   file's data.  If the file is less than 10 blocks big, the block pointers are
  *   stored directly in the inode, using "direct" block pointers.
  *   Larger files use the "indirect block" as well.  This is a block that
  *   contains not data, but more block pointers.  Still larger files also
@@ -101,8 +130,11 @@ typedef struct ospfs_super {
 	(OSPFS_NDIRECT					  /* direct blocks */ \
 	 + OSPFS_NINDIRECT	    /* blocks pointed to by indirect block */ \
 	 + OSPFS_NINDIRECT * OSPFS_NINDIRECT)   /* ... by indirect^2 block */
-// Maximum file size.
-#define OSPFS_MAXFILESIZE	(OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE)
+// Maximum file size.  With 4 KB blocks the block pointers could address
+// more than 'oi_size' can hold.
+#define OSPFS_MAXFILESIZE	\
+	((uint64_t) OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE < 0xFFFFFFFFU	\
+	 ? OSPFS_MAXFILEBLKS * OSPFS_BLKSIZE : 0xFFFFFFFFU)
 
 // File type constants for 'struct ospfs_inode's 'i_ftype' member.
 #define OSPFS_FTYPE_REG		0  // Regular file
@@ -172,6 +204,36 @@ typedef struct ospfs_symlink_inode {
 } ospfs_symlink_inode_t;
 
 
+/*****************************************************************************
+ * INLINE DATA
+ *
+ *   A small regular file may store its data IN THE INODE AREA ITSELF, like
+ *   a symbolic link, instead of in a data block.  Such a file has the
+ *   OSPFS_MODE_INLINE bit set in oi_mode, and its data occupies the space
+ *   of the block pointers, in an array of bytes called "oi_data".  At most
+ *   OSPFS_MAXINLINELEN bytes fit; a file that grows past that moves its
+ *   data to a block and clears the bit.
+ *
+ *   We use a separate type of inode structure to represent this, namely
+ *   'struct ospfs_inline_inode'.
+ *
+ *****************************************************************************/
+#define OSPFS_MODE_INLINE	0x80000000  // Data is in oi_data
+
+// Maximum size of a file with inline data.
+#define OSPFS_MAXINLINELEN	(OSPFS_INODESIZE - 16)
+
+typedef struct ospfs_inline_inode {
+	uint32_t oi_size;		    // File size
+					    // Must be <= OSPFS_MAXINLINELEN
+	uint32_t oi_ftype;		    // == OSPFS_FTYPE_REG
+	uint32_t oi_nlink;		    // Link count (0 means free)
+	uint32_t oi_mode;		    // Includes OSPFS_MODE_INLINE
+
+	uint8_t oi_data[OSPFS_MAXINLINELEN]; // File data
+} ospfs_inline_inode_t;
+
+
 /*****************************************************************************
  * DIRECTORY ENTRIES
  *
@@ -185,14 +247,87 @@ typedef struct ospfs_symlink_inode {
  *   stored is 123 bytes (128 bytes - 4 bytes for the inode - 1 byte for the
  *   terminating null character).
  *
+ *   The last byte of the structure caches the file type of the entry's
+ *   inode, so directory listings needn't read the inode table.  It holds
+ *   OSPFS_DIRENTRY_FTYPE(oi_ftype), or OSPFS_DIRENTRY_FTYPE_UNKNOWN if the
+ *   type is not recorded and must be read from the inode.  A name of
+ *   OSPFS_MAXNAMELEN bytes fills 'od_name', and its null terminator is
+ *   the type byte; so such an entry never records a type, and readers
+ *   ignore the type byte of any entry whose name fills 'od_name'.
+ *
+ *   COMPATIBILITY.  Images written before the type byte existed have 0
+ *   there (the terminator of a 123-byte name, or padding), which reads as
+ *   "unknown", so they need no conversion.  Code from before the type
+ *   byte reads newer images correctly too, since every name shorter than
+ *   OSPFS_MAXNAMELEN is null-terminated before it.
+ *
  *****************************************************************************/
 
 #define OSPFS_DIRENTRY_SIZE	128
 #define OSPFS_MAXNAMELEN	(OSPFS_DIRENTRY_SIZE - 5)
 
+#define OSPFS_DIRENTRY_FTYPE_UNKNOWN	0
+#define OSPFS_DIRENTRY_FTYPE(ftype)	((ftype) + 1)
+
 typedef struct ospfs_direntry {
 	uint32_t od_ino;			// Inode number
-	char od_name[OSPFS_MAXNAMELEN + 1];	// File name
+	char od_name[OSPFS_MAXNAMELEN];		// File name, null-terminated
+						// unless it fills the array
+	uint8_t od_ftype;			// OSPFS_DIRENTRY_FTYPE(), or 0;
+						// see above
 } ospfs_direntry_t;
 
+
+
+/*****************************************************************************
+ * JOURNAL
+ *
+ *   Inode OSPFS_JOURNAL_INODE holds a redo journal of metadata blocks.
+ *   The journal inode is a regular file, but no directory entry links to
+ *   it.  Its first block is the journal superblock.  The rest of the file
+ *   is the log, a sequence of transactions, each laid out as:
+ *
+ *   +------------+-------------------------------------+--------+
+ *   | descriptor | new contents of each logged block   | commit |
+ *   +------------+-------------------------------------+--------+
+ *
+ *   The descriptor lists the home block number of each logged block.  The
+ *   commit block carries a CRC of the logged blocks, so a transaction whose
+ *   commit is missing or torn is ignored.  Transaction sequence numbers
+ *   increase by one; the log starts at journal block 1 with sequence number
+ *   'js_seq', and ends at the first block that doesn't continue the
+ *   sequence.  Replaying copies each committed block to its home.
+ *
+ *****************************************************************************/
+
+#define OSPFS_JOURNAL_MAGIC	0x0131A7CE
+
+#define OSPFS_JOURNAL_DESC	1	// Descriptor block
+#define OSPFS_JOURNAL_COMMIT	2	// Commit block
+
+// Maximum number of blocks logged by one transaction.  Fixed by the
+// smallest block size, so a descriptor fits in any block.
+#define OSPFS_JOURNAL_MAXTAGS	(OSPFS_BLKSIZE_MIN / 4 - 4)
+
+typedef struct ospfs_journal_super {
+	uint32_t js_magic;	// OSPFS_JOURNAL_MAGIC
+	uint32_t js_nblocks;	// Journal size in blocks, including this one
+	uint32_t js_seq;	// Sequence number of the first transaction
+} ospfs_journal_super_t;
+
+typedef struct ospfs_journal_desc {
+	uint32_t jd_magic;	// OSPFS_JOURNAL_MAGIC
+	uint32_t jd_type;	// OSPFS_JOURNAL_DESC
+	uint32_t jd_seq;	// Transaction sequence number
+	uint32_t jd_nblocks;	// Number of logged blocks that follow
+	uint32_t jd_blocknos[OSPFS_JOURNAL_MAXTAGS]; // Their home blocks
+} ospfs_journal_desc_t;
+
+typedef struct ospfs_journal_commit {
+	uint32_t jc_magic;	// OSPFS_JOURNAL_MAGIC
+	uint32_t jc_type;	// OSPFS_JOURNAL_COMMIT
+	uint32_t jc_seq;	// Transaction sequence number
+	uint32_t jc_crc;	// crc32_le of the descriptor and logged blocks
+} ospfs_journal_commit_t;
+
 #endif
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/****************************************************************************
+ * ospfsbench
+ *
+ *   Measures the performance of a mounted OSPFS.  Run it on the mount
+ *   point ("make bench" loads the module, mounts the image on test, and
+ *   runs it there).  Every result is one line of KEY=VALUE fields:
+ *
+ *	bench=seq_write size=1048576 ops=256 secs=0.002113 rate=473.3 unit=MB/s
+ *
+ *   'ops' is the number of operations timed, 'secs' the median time of
+ *   the repetitions, and 'rate' the operations (or megabytes) per second
+ *   at that time.  If /proc/fs/ospfs exists, the line goes on with the
+ *   change in each of its counters over the median run, such as
+ *   'alloc_scanned=12'; those say where the time went.
+ *
+ *   The benchmarks are:
+ *
+ *	seq_write, seq_read	one file of each size, in CHUNK-byte calls
+ *	rand_write, rand_read	RANDOPS CHUNK-byte calls at random aligned
+ *				offsets in a file of each size
+ *	create, stat, unlink	that many entries, in DIR itself (the OSPFS
+ *				has no subdirectories)
+ *	readdir			all entries of DIR, with those in it
+ *	trunc_grow, trunc_shrink  a file's size set to each size and back
+ *				to 0 (a hole, then blocks written first)
+ *
+ *   A benchmark that runs out of space or inodes prints a line with
+ *   'skipped=' and the error instead.  The default image only has room
+ *   for small runs; build a bigger one with, for instance,
+ *	make bench FSSIZE=67108864 FSNINODES=110000
+ *   after removing fs.img.
+ *
+ ****************************************************************************/
+
+#define CHUNK		4096
+#define RANDOPS		1024
+#define MAXREPEAT	15
+#define MAXSTATS	64
+
+static const char *dir = "test";
+static int repeat = 3;
+
+static long io_sizes[] = { 4096, 65536, 262144, 1048576, 0 };
+static long dir_sizes[] = { 10, 100, 1000, 10000, 100000, 0 };
+static long trunc_sizes[] = { 1048576, 16777216, 0 };
+
+static char buf[CHUNK];
+
+
+/*****************************************************************************
+ * TIMING AND STATISTICS
+ */
+
+static double
+now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// The counters in /proc/fs/ospfs.  Histogram lines are skipped.
+typedef struct stats {
+	int n;
+	char name[MAXSTATS][32];
+	unsigned long value[MAXSTATS];
+} stats_t;
+
+static void
+read_stats(stats_t *st)
+{
+	FILE *f = fopen("/proc/fs/ospfs", "r");
+	char line[1024];
+
+	st->n = 0;
+	if (!f)
+		return;
+	while (st->n < MAXSTATS && fgets(line, sizeof(line), f))
+		if (sscanf(line, "%31s %lu", st->name[st->n], &st->value[st->n]) == 2
+		    && !strstr(st->name[st->n], "_hist"))
+			st->n++;
+	fclose(f);
+}
+
+// One run of a benchmark: its time and the counter changes over it.
+typedef struct run {
+	double secs;
+	stats_t delta;
+} run_t;
+
+static void
+run_start(run_t *r, stats_t *before)
+{
+	read_stats(before);
+	r->secs = now();
+}
+
+static void
+run_end(run_t *r, stats_t *before)
+{
+	int i;
+
+	r->secs = now() - r->secs;
+	read_stats(&r->delta);
+	for (i = 0; i < r->delta.n && i < before->n; i++)
+		r->delta.value[i] -= before->value[i];
+}
+
+static int
+run_compare(const void *a, const void *b)
+{
+	double x = ((const run_t *) a)->secs, y = ((const run_t *) b)->secs;
+	return x < y ? -1 : x > y;
+}
+
+// Prints the result line for 'nruns' runs of benchmark 'bench' with
+// parameter 'size', each doing 'ops' operations.  If 'mb' is positive,
+// the rate is 'mb' megabytes per run, else 'ops' per run.
+static void
+report(const char *bench, long size, long ops, run_t *runs, int nruns, double mb)
+{
+	run_t *median;
+	int i;
+
+	qsort(runs, nruns, sizeof(run_t), run_compare);
+	median = &runs[nruns / 2];
+	printf("bench=%s size=%ld ops=%ld secs=%.6f rate=%.1f unit=%s", bench,
+	       size, ops, median->secs,
+	       (mb > 0 ? mb : ops) / (median->secs > 0 ? median->secs : 1e-9),
+	       mb > 0 ? "MB/s" : "ops/s");
+	for (i = 0; i < median->delta.n; i++)
+		if (median->delta.value[i])
+			printf(" %s=%lu", median->delta.name[i], median->delta.value[i]);
+	printf("\n");
+	fflush(stdout);
+}
+
+// Reports a benchmark that couldn't run at 'size'.
+static void
+report_skip(const char *bench, long size, const char *why)
+{
+	printf("bench=%s size=%ld skipped=%s\n", bench, size, why);
+	fflush(stdout);
+}
+
+
+/*****************************************************************************
+ * FILE HELPERS
+ */
+
+static void
+path(char *p, size_t n, const char *name)
+{
+	snprintf(p, n, "%s/%s", dir, name);
+}
+
+// Writes 'size' bytes to 'fd' from offset 0.  Returns 0, or -1 with
+// errno set.
+static int
+fill(int fd, long size)
+{
+	long done = 0;
+	ssize_t w;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -1;
+	while (done < size) {
+		w = write(fd, buf, size - done < CHUNK ? size - done : CHUNK);
+		if (w <= 0) {
+			if (w == 0)
+				errno = ENOSPC;
+			return -1;
+		}
+		done += w;
+	}
+	return 0;
+}
+
+static void
+die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+
+/*****************************************************************************
+ * BENCHMARKS
+ */
+
+static void
+bench_seq(long size)
+{
+	run_t wruns[MAXREPEAT], rruns[MAXREPEAT];
+	stats_t before;
+	char p[4096];
+	int fd, i;
+	long done;
+	ssize_t n;
+
+	path(p, sizeof(p), "bench.seq");
+	for (i = 0; i < repeat; i++) {
+		unlink(p);
+		run_start(&wruns[i], &before);
+		if ((fd = open(p, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+			die(p);
+		if (fill(fd, size) < 0) {
+			close(fd);
+			unlink(p);
+			report_skip("seq_write", size, strerror(errno));
+			return;
+		}
+		close(fd);
+		run_end(&wruns[i], &before);
+
+		run_start(&rruns[i], &before);
+		if ((fd = open(p, O_RDONLY)) < 0)
+			die(p);
+		for (done = 0; (n = read(fd, buf, CHUNK)) > 0; done += n)
+			/* nada */;
+		close(fd);
+		run_end(&rruns[i], &before);
+		if (done != size) {
+			fprintf(stderr, "ospfsbench: %s: read %ld bytes, expected %ld\n", p, done, size);
+			exit(1);
+		}
+	}
+	unlink(p);
+	report("seq_write", size, (size + CHUNK - 1) / CHUNK, wruns, repeat, size / 1048576.0);
+	report("seq_read", size, (size + CHUNK - 1) / CHUNK, rruns, repeat, size / 1048576.0);
+}
+
+static void
+bench_rand(long size)
+{
+	run_t wruns[MAXREPEAT], rruns[MAXREPEAT];
+	stats_t before;
+	char p[4096];
+	long nchunks = size / CHUNK, k;
+	int fd, i;
+
+	if (nchunks == 0)
+		return;
+	path(p, sizeof(p), "bench.rand");
+	if ((fd = open(p, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+		die(p);
+	if (fill(fd, size) < 0) {
+		close(fd);
+		unlink(p);
+		report_skip("rand_write", size, strerror(errno));
+		return;
+	}
+
+	srand(size);
+	for (i = 0; i < repeat; i++) {
+		run_start(&wruns[i], &before);
+		for (k = 0; k < RANDOPS; k++)
+			if (pwrite(fd, buf, CHUNK, (rand() % nchunks) * CHUNK) != CHUNK)
+				die("pwrite");
+		run_end(&wruns[i], &before);
+
+		run_start(&rruns[i], &before);
+		for (k = 0; k < RANDOPS; k++)
+			if (pread(fd, buf, CHUNK, (rand() % nchunks) * CHUNK) != CHUNK)
+				die("pread");
+		run_end(&rruns[i], &before);
+	}
+	close(fd);
+	unlink(p);
+	report("rand_write", size, RANDOPS, wruns, repeat, RANDOPS * (CHUNK / 1048576.0));
+	report("rand_read", size, RANDOPS, rruns, repeat, RANDOPS * (CHUNK / 1048576.0));
+}
+
+// Returns the number of entries in 'd', including "." and "..".
+static long
+count_entries(const char *d)
+{
+	DIR *dp = opendir(d);
+	long n;
+
+	if (!dp)
+		die(d);
+	for (n = 0; readdir(dp); n++)
+		/* nada */;
+	closedir(dp);
+	return n;
+}
+
+// Removes the first 'n' entries made by bench_dir.
+static void
+dir_cleanup(long n)
+{
+	char p[4096];
+	long k;
+
+	for (k = 0; k < n; k++) {
+		snprintf(p, sizeof(p), "%s/bench.%ld", dir, k);
+		unlink(p);
+	}
+}
+
+// Returns 0 on success, -1 if the directory couldn't be filled.
+static int
+bench_dir(long nentries)
+{
+	run_t cruns[MAXREPEAT], sruns[MAXREPEAT], rdruns[MAXREPEAT], uruns[MAXREPEAT];
+	stats_t before;
+	char p[4096];
+	struct stat s;
+	long k, seen, base = count_entries(dir);
+	int fd, i;
+
+	for (i = 0; i < repeat; i++) {
+		run_start(&cruns[i], &before);
+		for (k = 0; k < nentries; k++) {
+			snprintf(p, sizeof(p), "%s/bench.%ld", dir, k);
+			if ((fd = open(p, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0) {
+				int e = errno;
+				dir_cleanup(k);
+				report_skip("create", nentries, strerror(e));
+				return -1;
+			}
+			close(fd);
+		}
+		run_end(&cruns[i], &before);
+
+		run_start(&sruns[i], &before);
+		for (k = 0; k < nentries; k++) {
+			snprintf(p, sizeof(p), "%s/bench.%ld", dir, k);
+			if (stat(p, &s) < 0)
+				die(p);
+		}
+		run_end(&sruns[i], &before);
+
+		run_start(&rdruns[i], &before);
+		seen = count_entries(dir);
+		run_end(&rdruns[i], &before);
+		if (seen != base + nentries) {
+			fprintf(stderr, "ospfsbench: %s: readdir saw %ld entries, expected %ld\n",
+				dir, seen, base + nentries);
+			exit(1);
+		}
+
+		run_start(&uruns[i], &before);
+		for (k = 0; k < nentries; k++) {
+			snprintf(p, sizeof(p), "%s/bench.%ld", dir, k);
+			if (unlink(p) < 0)
+				die(p);
+		}
+		run_end(&uruns[i], &before);
+	}
+	report("create", nentries, nentries, cruns, repeat, 0);
+	report("stat", nentries, nentries, sruns, repeat, 0);
+	report("readdir", nentries, base + nentries, rdruns, repeat, 0);
+	report("unlink", nentries, nentries, uruns, repeat, 0);
+	return 0;
+}
+
+// Returns 0 on success, -1 if the file couldn't be filled.
+static int
+bench_trunc(long size)
+{
+	run_t gruns[MAXREPEAT], sruns[MAXREPEAT];
+	stats_t before;
+	char p[4096];
+	int fd, i;
+
+	path(p, sizeof(p), "bench.trunc");
+	if ((fd = open(p, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+		die(p);
+	for (i = 0; i < repeat; i++) {
+		// Growing leaves a hole; shrinking frees blocks written first
+		run_start(&gruns[i], &before);
+		if (ftruncate(fd, size) < 0 || ftruncate(fd, 0) < 0)
+			die("ftruncate");
+		run_end(&gruns[i], &before);
+
+		if (fill(fd, size) < 0) {
+			int e = errno;
+			close(fd);
+			unlink(p);
+			report_skip("trunc_shrink", size, strerror(e));
+			return -1;
+		}
+		run_start(&sruns[i], &before);
+		if (ftruncate(fd, 0) < 0)
+			die("ftruncate");
+		run_end(&sruns[i], &before);
+	}
+	close(fd);
+	unlink(p);
+	report("trunc_grow", size, 2, gruns, repeat, 0);
+	report("trunc_shrink", size, 1, sruns, repeat, 0);
+	return 0;
+}
+
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsbench [-r REPEAT] [-b BENCHES] [DIR]\n\
+  \"-r REPEAT\" runs each benchmark REPEAT times (default 3, at most %d).\n\
+  \"-b BENCHES\" runs only some benchmarks: any of the letters\n\
+    s (sequential), r (random), d (directory), t (truncate).\n\
+  DIR is the mounted OSPFS (default \"test\").\n", MAXREPEAT);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *benches = "srdt";
+	char *s;
+	int i;
+
+	while (argc > 2 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "-r") == 0) {
+			repeat = strtol(argv[2], &s, 0);
+			if (*s || s == argv[2] || repeat < 1 || repeat > MAXREPEAT)
+				usage();
+		} else if (strcmp(argv[1], "-b") == 0)
+			benches = argv[2];
+		else
+			usage();
+		argc -= 2, argv += 2;
+	}
+	if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+		usage();
+	if (argc == 2)
+		dir = argv[1];
+
+	for (i = 0; i < CHUNK; i++)
+		buf[i] = i * 7 + 3;
+
+	if (strchr(benches, 's'))
+		for (i = 0; io_sizes[i]; i++)
+			bench_seq(io_sizes[i]);
+	if (strchr(benches, 'r'))
+		for (i = 0; io_sizes[i]; i++)
+			bench_rand(io_sizes[i]);
+	if (strchr(benches, 'd'))
+		for (i = 0; dir_sizes[i]; i++)
+			if (bench_dir(dir_sizes[i]) < 0)
+				break;
+	if (strchr(benches, 't'))
+		for (i = 0; trunc_sizes[i]; i++)
+			if (bench_trunc(trunc_sizes[i]) < 0)
+				break;
+	exit(0);
+}
@@ -0,0 +1,797 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+#define OSPFS_BLKSIZE_BITS blksize_bits
+#include "ospfs.h"
+
+/****************************************************************************
+ * ospfsck
+ *
+ *   Checks an OSPFS image offline and reports how fragmented it is.
+ *
+ *   The image is mapped read-only and never changed.  One pass over the
+ *   inode table follows every inode's block pointers and directory
+ *   entries, counting the references to each block and inode; one pass
+ *   over the free block bitmap then compares it, and the reference-count
+ *   map if there is one, with those counts.  Link counts, file sizes,
+ *   directory entries and the journal are checked along the way.
+ *
+ *   Unless -q is given, a line of KEY=VALUE pairs is printed for each
+ *   inode in use, for example
+ *
+ *	inode=3 type=file size=52000 blocks=51 indirect=1 extents=2 holes=0 path=/big.txt
+ *	inode=1 type=dir size=1024 entries=8 blank=2 holeratio=0.250 path=/
+ *
+ *   An extent is a run of a file's data blocks that are consecutive both
+ *   in the file and on the disk, so a file whose data is contiguous has
+ *   one extent; indirect blocks are not counted, but one placed among the
+ *   data splits an extent.  A directory's hole
+ *   ratio is the fraction of its entries that are blank.  A summary of
+ *   the whole image follows: block and inode-table fill, extents per
+ *   file, and the hole ratio over all directories.
+ *
+ *   Each inconsistency is printed to stderr.  The exit status is 0 if the
+ *   image is consistent, 1 if it is not, and 2 if it couldn't be checked.
+ *
+ *   A journal with committed transactions that haven't been replayed
+ *   means the home blocks may be behind the log; the module replays it
+ *   at mount time, which may fix what is reported.  Each such transaction
+ *   gets a line too,
+ *
+ *	journal_txn=7 pos=1 blocks=3
+ *
+ *   and its home block numbers are checked.
+ *
+ ****************************************************************************/
+
+#define nelem(x)	(sizeof(x) / sizeof((x)[0]))
+
+enum {
+	BLOCK_FREE,
+	BLOCK_META,	// Boot sector, superblock, bitmap, inodes, refcounts
+	BLOCK_INDIRECT,
+	BLOCK_FILE,
+	BLOCK_DIR,
+	BLOCK_JOURNAL
+};
+
+static const char *block_kinds[] = {
+	"free", "metadata", "indirect", "file", "directory", "journal"
+};
+
+// What the walk learned about an inode
+struct Inostat {
+	uint32_t nblocks;	// Data blocks
+	uint32_t nindirect;	// Indirect and doubly indirect blocks
+	uint32_t nextents;	// Runs of data blocks contiguous on the disk
+	uint32_t nholes;	// File blocks with no data block
+	uint32_t prev;		// Last data block seen, or 0 after a hole
+	uint32_t nentries;	// Directory entries
+	uint32_t nblank;	// ... of which blank
+	uint32_t nlinks;	// Directory entries referring to this inode
+	uint32_t nsubdirs;	// Subdirectories, if this is a directory
+	uint32_t parent;	// Directory of the first entry referring to it
+	const char *name;	// That entry's name, not necessarily terminated
+};
+
+const char *diskname;
+uint8_t *disk;		// The image, mapped into memory
+uint32_t blksize_bits;
+uint32_t nblocks;
+uint32_t ninodes;
+uint32_t nbitblock;
+uint32_t first_datab;
+uint32_t refmapb;
+uint32_t *blockrefs;	// Number of pointers to each block
+uint8_t *blockkind;	// BLOCK_* constant for each block
+uint32_t *blockowner;	// First inode found pointing at each block
+struct Inostat *inostats;
+int quiet = 0;
+int nerrors = 0;
+
+// Reads a little-endian word of the image.
+static uint32_t
+le32(const uint32_t *x)
+{
+	const uint8_t *z = (const uint8_t *) x;
+	return z[0] | (z[1] << 8) | (z[2] << 16) | ((uint32_t) z[3] << 24);
+}
+
+static void *
+block(uint32_t bno)
+{
+	return disk + ((size_t) bno << blksize_bits);
+}
+
+static ospfs_inode_t *
+inode(uint32_t ino)
+{
+	ospfs_inode_t *oi = block(OSPFS_FREEMAP_BLK + nbitblock + ino / OSPFS_BLKINODES);
+	return oi + ino % OSPFS_BLKINODES;
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+	if (!p) {
+		perror("calloc");
+		exit(2);
+	}
+	return p;
+}
+
+// Reports an inconsistency.
+static void
+error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s: ", diskname);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	nerrors++;
+}
+
+// Same as the kernel's crc32_le: no final inversion.
+static uint32_t
+crc32_le(uint32_t crc, const unsigned char *p, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+	}
+	return crc;
+}
+
+// Finds the superblock and checks that the layout it describes fits the
+// image.  Exits if it doesn't.
+static void
+read_super(size_t size)
+{
+	ospfs_super_t *os = NULL;
+	uint32_t bits, ninodeblock;
+
+	for (bits = OSPFS_BLKSIZE_BITS_MIN; bits <= OSPFS_BLKSIZE_BITS_MAX; bits++) {
+		if (size < (size_t) 2 << bits)
+			break;
+		os = (ospfs_super_t *) (disk + ((size_t) 1 << bits));
+		if (le32(&os->os_magic) == OSPFS_MAGIC
+		    && (le32(&os->os_blksize_bits) ? : OSPFS_BLKSIZE_BITS_MIN) == bits)
+			break;
+		os = NULL;
+	}
+	if (!os) {
+		fprintf(stderr, "%s: no OSPFS superblock\n", diskname);
+		exit(2);
+	}
+
+	blksize_bits = bits;
+	nblocks = le32(&os->os_nblocks);
+	ninodes = le32(&os->os_ninodes);
+	refmapb = le32(&os->os_refmapb);
+	nbitblock = (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
+	ninodeblock = (ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+	first_datab = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock;
+	if (refmapb)
+		first_datab += (nblocks + OSPFS_BLKREFS - 1) / OSPFS_BLKREFS;
+
+	if (nblocks < 2 || nblocks > (0xFFFFFFFFU >> blksize_bits)
+	    || ninodes <= OSPFS_ROOT_INO
+	    || le32(&os->os_firstinob) != OSPFS_FREEMAP_BLK + nbitblock
+	    || (refmapb && refmapb != OSPFS_FREEMAP_BLK + nbitblock + ninodeblock)
+	    || first_datab > nblocks) {
+		fprintf(stderr, "%s: superblock is corrupt\n", diskname);
+		exit(2);
+	}
+	if (size < ((size_t) nblocks << blksize_bits)) {
+		fprintf(stderr, "%s: image has %zu bytes, superblock says %zu\n",
+			diskname, size, (size_t) nblocks << blksize_bits);
+		exit(2);
+	}
+}
+
+// Counts a pointer from inode 'ino' to block 'bno', which holds a block
+// of kind 'kind'.  Returns 0 if the block's contents may be read.
+static int
+use_block(uint32_t ino, uint32_t bno, int kind)
+{
+	if (bno < first_datab || bno >= nblocks) {
+		error("inode %u: block pointer %u is outside the data blocks", ino, bno);
+		return -1;
+	}
+	if (blockrefs[bno]++ == 0) {
+		blockkind[bno] = kind;
+		blockowner[bno] = ino;
+		return 0;
+	}
+	// Only regular files' data blocks are ever shared
+	if (kind != BLOCK_FILE || blockkind[bno] != BLOCK_FILE)
+		error("block %u is %s block of inode %u, and %s block of inode %u",
+		      bno, block_kinds[blockkind[bno]], blockowner[bno],
+		      block_kinds[kind], ino);
+	else if (!refmapb && blockrefs[bno] == 2)
+		error("block %u is shared by inodes %u and %u, but the image has no reference-count map",
+		      bno, blockowner[bno], ino);
+	return blockkind[bno] == kind ? 0 : -1;
+}
+
+// Checks the directory entries in the first 'n' bytes of 'dirino's data
+// block 'bno'.
+static void
+check_direntries(uint32_t dirino, uint32_t bno, uint32_t n)
+{
+	struct Inostat *dst = &inostats[dirino];
+	uint32_t off;
+
+	for (off = 0; off + OSPFS_DIRENTRY_SIZE <= n; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = (ospfs_direntry_t *) ((uint8_t *) block(bno) + off);
+		uint32_t ino = le32(&od->od_ino);
+		const char *end;
+		size_t namelen;
+		ospfs_inode_t *oi;
+
+		dst->nentries++;
+		if (ino == 0) {
+			dst->nblank++;
+			continue;
+		}
+
+		// A name that fills od_name is terminated by the type byte (see
+		// ospfs.h)
+		end = memchr(od->od_name, 0, OSPFS_MAXNAMELEN);
+		namelen = end ? end - od->od_name : OSPFS_MAXNAMELEN;
+		if (namelen == 0
+		    || (namelen == OSPFS_MAXNAMELEN && od->od_ftype != 0)) {
+			error("directory %u: entry in block %u at offset %u has a bad name",
+			      dirino, bno, off);
+			continue;
+		}
+		if (ino >= ninodes || ino == OSPFS_ROOT_INO || ino == OSPFS_JOURNAL_INODE) {
+			error("directory %u: entry %.*s refers to inode %u", dirino,
+			      (int) namelen, od->od_name, ino);
+			continue;
+		}
+		oi = inode(ino);
+		if (le32(&oi->oi_nlink) == 0) {
+			error("directory %u: entry %.*s refers to free inode %u", dirino,
+			      (int) namelen, od->od_name, ino);
+			continue;
+		}
+		if (namelen < OSPFS_MAXNAMELEN
+		    && od->od_ftype != OSPFS_DIRENTRY_FTYPE_UNKNOWN
+		    && od->od_ftype != OSPFS_DIRENTRY_FTYPE(le32(&oi->oi_ftype)))
+			error("directory %u: entry %.*s has file type %u, inode %u has %u",
+			      dirino, (int) namelen, od->od_name,
+			      od->od_ftype - 1, ino, le32(&oi->oi_ftype));
+
+		if (inostats[ino].nlinks++ == 0) {
+			inostats[ino].parent = dirino;
+			inostats[ino].name = od->od_name;
+		}
+		if (le32(&oi->oi_ftype) == OSPFS_FTYPE_DIR)
+			dst->nsubdirs++;
+	}
+}
+
+// Counts the pointer to file block 'n' of inode 'ino', whose data blocks
+// are of kind 'kind' and which has 'nblk' blocks.
+static void
+check_pointer(uint32_t ino, uint32_t n, uint32_t bno, uint32_t nblk, int kind)
+{
+	struct Inostat *st = &inostats[ino];
+	uint32_t size;
+
+	if (n >= nblk) {
+		if (bno)
+			error("inode %u: block pointer %u is past the end of the file", ino, n);
+		return;
+	}
+	if (bno == 0) {
+		st->nholes++;
+		st->prev = 0;
+		return;
+	}
+	if (use_block(ino, bno, kind) < 0)
+		return;
+
+	st->nblocks++;
+	if (!st->prev || bno != st->prev + 1)
+		st->nextents++;
+	st->prev = bno;
+
+	if (kind == BLOCK_DIR) {
+		size = le32(&inode(ino)->oi_size);
+		check_direntries(ino, bno, n + 1 < nblk ? OSPFS_BLKSIZE
+				 : size - (n << blksize_bits));
+	}
+}
+
+// Counts the indirect block 'bno', which holds the pointers to file
+// blocks 'base' and up, and the blocks it points to.
+static void
+check_indirect(uint32_t ino, uint32_t bno, uint32_t base, uint32_t nblk, int kind)
+{
+	uint32_t *ptrs, i;
+
+	if (bno == 0) {
+		// A missing indirect block is a hole for all the blocks it covers
+		if (base < nblk) {
+			inostats[ino].nholes += (nblk - base < OSPFS_NINDIRECT
+						 ? nblk - base : OSPFS_NINDIRECT);
+			inostats[ino].prev = 0;
+		}
+		return;
+	}
+	if (base >= nblk)
+		error("inode %u: indirect block %u is past the end of the file", ino, bno);
+	if (use_block(ino, bno, BLOCK_INDIRECT) < 0)
+		return;
+	inostats[ino].nindirect++;
+
+	ptrs = block(bno);
+	for (i = 0; i < OSPFS_NINDIRECT; i++)
+		check_pointer(ino, base + i, le32(&ptrs[i]), nblk, kind);
+}
+
+// Counts the blocks of inode 'ino', which stores its data in blocks.
+static void
+check_blocks(uint32_t ino, ospfs_inode_t *oi, int kind)
+{
+	uint32_t size = le32(&oi->oi_size);
+	uint32_t nblk = (size + OSPFS_BLKSIZE - 1) >> blksize_bits;
+	uint32_t base = OSPFS_NDIRECT + OSPFS_NINDIRECT;
+	uint32_t bno, *ptrs, i;
+
+	for (i = 0; i < OSPFS_NDIRECT; i++)
+		check_pointer(ino, i, le32(&oi->oi_direct[i]), nblk, kind);
+	check_indirect(ino, le32(&oi->oi_indirect), OSPFS_NDIRECT, nblk, kind);
+
+	bno = le32(&oi->oi_indirect2);
+	if (bno == 0) {
+		if (base < nblk) {
+			inostats[ino].nholes += nblk - base;
+			inostats[ino].prev = 0;
+		}
+	} else {
+		if (base >= nblk)
+			error("inode %u: doubly indirect block %u is past the end of the file",
+			      ino, bno);
+		if (use_block(ino, bno, BLOCK_INDIRECT) == 0) {
+			inostats[ino].nindirect++;
+			ptrs = block(bno);
+			for (i = 0; i < OSPFS_NINDIRECT; i++, base += OSPFS_NINDIRECT)
+				check_indirect(ino, le32(&ptrs[i]), base, nblk, kind);
+		}
+	}
+
+	if (inostats[ino].nholes && kind != BLOCK_FILE)
+		error("inode %u: %s has %u holes", ino, block_kinds[kind],
+		      inostats[ino].nholes);
+}
+
+// Checks inode 'ino' and counts the blocks and inodes it refers to.
+static void
+check_inode(uint32_t ino)
+{
+	ospfs_inode_t *oi = inode(ino);
+	uint32_t size = le32(&oi->oi_size);
+	uint32_t ftype = le32(&oi->oi_ftype);
+	uint32_t mode = le32(&oi->oi_mode);
+
+	switch (ftype) {
+	case OSPFS_FTYPE_REG:
+		if (mode & OSPFS_MODE_INLINE) {
+			if (ino == OSPFS_JOURNAL_INODE || size > OSPFS_MAXINLINELEN)
+				error("inode %u: inline file has size %u", ino, size);
+			break;
+		}
+		if (size > OSPFS_MAXFILESIZE)
+			error("inode %u: file has size %u", ino, size);
+		else
+			check_blocks(ino, oi, ino == OSPFS_JOURNAL_INODE
+				     ? BLOCK_JOURNAL : BLOCK_FILE);
+		break;
+
+	case OSPFS_FTYPE_DIR:
+		if (ino == OSPFS_JOURNAL_INODE || size % OSPFS_DIRENTRY_SIZE != 0
+		    || size > OSPFS_MAXFILESIZE)
+			error("inode %u: directory has size %u", ino, size);
+		else
+			check_blocks(ino, oi, BLOCK_DIR);
+		break;
+
+	case OSPFS_FTYPE_SYMLINK:
+		if (ino == OSPFS_JOURNAL_INODE || size > OSPFS_MAXSYMLINKLEN)
+			error("inode %u: symbolic link has size %u", ino, size);
+		break;
+
+	default:
+		error("inode %u: bad file type %u", ino, ftype);
+		break;
+	}
+}
+
+// Returns physical block of file block 'n' of 'oi', or 0.  The pointers
+// have been checked.
+static uint32_t
+file_block(ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t bno;
+
+	if (n < OSPFS_NDIRECT)
+		return le32(&oi->oi_direct[n]);
+	n -= OSPFS_NDIRECT;
+	if (n < OSPFS_NINDIRECT) {
+		bno = le32(&oi->oi_indirect);
+		return bno ? le32((uint32_t *) block(bno) + n) : 0;
+	}
+	n -= OSPFS_NINDIRECT;
+	bno = le32(&oi->oi_indirect2);
+	if (bno)
+		bno = le32((uint32_t *) block(bno) + n / OSPFS_NINDIRECT);
+	return bno ? le32((uint32_t *) block(bno) + n % OSPFS_NINDIRECT) : 0;
+}
+
+// Checks the journal's superblock and returns the number of committed
+// transactions in the log that haven't been replayed, or -1 if the
+// journal is not valid.  Follows ospfs_journal_replay(), and also checks
+// that each transaction's home blocks are distinct and outside the boot
+// sector, superblock and journal, and that the log doesn't end at a
+// transaction from the future.  Unless -q is given, prints a line for
+// each committed transaction.
+static int
+check_journal(uint32_t *jnblocks, uint32_t *jseq)
+{
+	ospfs_inode_t *joi = inode(OSPFS_JOURNAL_INODE);
+	uint32_t nblk = le32(&joi->oi_size) >> blksize_bits;
+	uint32_t pos = 1, seq, i, j, n, bno;
+	ospfs_journal_super_t *js;
+	ospfs_journal_desc_t *desc;
+	int ntxns = 0;
+
+	if (le32(&joi->oi_ftype) != OSPFS_FTYPE_REG
+	    || (le32(&joi->oi_mode) & OSPFS_MODE_INLINE)
+	    || le32(&joi->oi_size) % OSPFS_BLKSIZE != 0 || nblk < 4
+	    || inostats[OSPFS_JOURNAL_INODE].nblocks != nblk) {
+		error("inode %u is not a journal", OSPFS_JOURNAL_INODE);
+		return -1;
+	}
+	js = block(file_block(joi, 0));
+	if (le32(&js->js_magic) != OSPFS_JOURNAL_MAGIC
+	    || le32(&js->js_nblocks) != nblk) {
+		error("journal superblock is corrupt");
+		return -1;
+	}
+	*jnblocks = nblk;
+	*jseq = le32(&js->js_seq);
+
+	for (seq = *jseq; pos + 2 <= nblk; seq++, ntxns++) {
+		ospfs_journal_commit_t *commit;
+		uint32_t crc;
+
+		desc = block(file_block(joi, pos));
+		n = le32(&desc->jd_nblocks);
+		if (le32(&desc->jd_magic) != OSPFS_JOURNAL_MAGIC
+		    || le32(&desc->jd_type) != OSPFS_JOURNAL_DESC
+		    || le32(&desc->jd_seq) != seq
+		    || n > OSPFS_JOURNAL_MAXTAGS || pos + n + 2 > nblk)
+			break;
+
+		commit = block(file_block(joi, pos + 1 + n));
+		crc = crc32_le(~0, (unsigned char *) desc, OSPFS_BLKSIZE);
+		for (i = 0; i < n; i++)
+			crc = crc32_le(crc, block(file_block(joi, pos + 1 + i)), OSPFS_BLKSIZE);
+		if (le32(&commit->jc_magic) != OSPFS_JOURNAL_MAGIC
+		    || le32(&commit->jc_type) != OSPFS_JOURNAL_COMMIT
+		    || le32(&commit->jc_seq) != seq
+		    || le32(&commit->jc_crc) != crc)
+			break;
+
+		for (i = 0; i < n; i++) {
+			bno = le32(&desc->jd_blocknos[i]);
+			if (bno < OSPFS_FREEMAP_BLK || bno >= nblocks) {
+				error("journal transaction %u is corrupt", seq);
+				return ntxns;
+			}
+			if (blockkind[bno] == BLOCK_JOURNAL)
+				error("journal transaction %u logs journal block %u", seq, bno);
+			for (j = 0; j < i; j++)
+				if (le32(&desc->jd_blocknos[j]) == bno)
+					error("journal transaction %u logs block %u twice", seq, bno);
+		}
+		if (!quiet)
+			printf("journal_txn=%u pos=%u blocks=%u\n", seq, pos, n);
+		pos += n + 2;
+	}
+
+	// Sequence numbers only grow, so a descriptor after the end of the
+	// log is older than the transactions in it
+	desc = pos < nblk ? block(file_block(joi, pos)) : NULL;
+	if (desc && le32(&desc->jd_magic) == OSPFS_JOURNAL_MAGIC
+	    && le32(&desc->jd_type) == OSPFS_JOURNAL_DESC
+	    && le32(&desc->jd_seq) > seq)
+		error("journal transaction %u follows %u", le32(&desc->jd_seq), seq - 1);
+	return ntxns;
+}
+
+// Checks each directory entry count against its inode's link count.
+static void
+check_links(void)
+{
+	uint32_t ino, nlink;
+	ospfs_inode_t *oi;
+	struct Inostat *st;
+
+	oi = inode(OSPFS_ROOT_INO);
+	if (le32(&oi->oi_nlink) == 0 || le32(&oi->oi_ftype) != OSPFS_FTYPE_DIR)
+		error("root inode %u is not a directory", OSPFS_ROOT_INO);
+
+	for (ino = OSPFS_ROOT_INO; ino < ninodes; ino++) {
+		oi = inode(ino);
+		st = &inostats[ino];
+		nlink = le32(&oi->oi_nlink);
+		if (nlink == 0 || ino == OSPFS_JOURNAL_INODE)
+			continue;
+		if (le32(&oi->oi_ftype) == OSPFS_FTYPE_DIR) {
+			// A directory is linked from its parent and its subdirectories
+			if (st->nlinks != (ino == OSPFS_ROOT_INO ? 0 : 1))
+				error("directory %u has %u entries referring to it",
+				      ino, st->nlinks);
+			if (nlink != st->nsubdirs + 1)
+				error("directory %u has link count %u, should be %u",
+				      ino, nlink, st->nsubdirs + 1);
+		} else if (st->nlinks == 0)
+			error("inode %u is in use but no directory entry refers to it", ino);
+		else if (nlink != st->nlinks)
+			error("inode %u has link count %u, but %u entries refer to it",
+			      ino, nlink, st->nlinks);
+	}
+}
+
+// Reports the blocks [from, to), which have the same wrong state.
+static void
+bitmap_error(uint32_t from, uint32_t to, int used)
+{
+	const char *what = used ? "in use but marked free" : "marked in use but unreferenced";
+
+	if (to == from + 1)
+		error("block %u is %s", from, what);
+	else
+		error("blocks %u-%u are %s", from, to - 1, what);
+}
+
+// Compares the free block bitmap, and the reference-count map if any,
+// with the references found.  Returns the number of free blocks.
+static uint32_t
+check_bitmap(void)
+{
+	const uint8_t *bitmap = block(OSPFS_FREEMAP_BLK);
+	uint32_t b, nfree = 0, runstart = 0, expect;
+	int isfree, bad, runkind = 0;	// 1: used but free, 2: unreferenced
+
+	for (b = 0; b < nbitblock * OSPFS_BLKBITSIZE; b++) {
+		isfree = (bitmap[b / 8] >> (b % 8)) & 1;
+		if (b >= nblocks) {
+			if (isfree) {
+				error("bitmap marks blocks past the end of the disk free");
+				break;
+			}
+			continue;
+		}
+		nfree += isfree;
+
+		bad = blockrefs[b] && isfree ? 1 : !blockrefs[b] && !isfree ? 2 : 0;
+		if (bad != runkind) {
+			if (runkind)
+				bitmap_error(runstart, b, runkind == 1);
+			runstart = b;
+			runkind = bad;
+		}
+
+		expect = blockrefs[b] ? blockrefs[b] - 1 : 0;
+		if (refmapb && le32((uint32_t *) block(refmapb + b / OSPFS_BLKREFS)
+				    + b % OSPFS_BLKREFS) != expect)
+			error("block %u has reference count %u, should be %u", b,
+			      le32((uint32_t *) block(refmapb + b / OSPFS_BLKREFS)
+				   + b % OSPFS_BLKREFS), expect);
+	}
+	if (runkind)
+		bitmap_error(runstart, nblocks, runkind == 1);
+	return nfree;
+}
+
+// Prints the path of inode 'ino', as found through the directory entries.
+static void
+print_path(uint32_t ino, int depth)
+{
+	struct Inostat *st = &inostats[ino];
+
+	if (ino == OSPFS_ROOT_INO) {
+		if (depth == 0)
+			printf("/");
+		return;
+	}
+	if (ino == OSPFS_JOURNAL_INODE && !st->nlinks) {
+		printf("(journal)");
+		return;
+	}
+	if (!st->nlinks || depth > ninodes) {
+		printf("?");
+		return;
+	}
+	print_path(st->parent, depth + 1);
+	printf("/%.*s", (int) strnlen(st->name, OSPFS_MAXNAMELEN), st->name);
+}
+
+static void
+report_inode(uint32_t ino)
+{
+	ospfs_inode_t *oi = inode(ino);
+	struct Inostat *st = &inostats[ino];
+	uint32_t ftype = le32(&oi->oi_ftype);
+	uint32_t size = le32(&oi->oi_size);
+
+	printf("inode=%u type=", ino);
+	if (ftype == OSPFS_FTYPE_SYMLINK)
+		printf("symlink size=%u", size);
+	else if (ftype == OSPFS_FTYPE_REG && (le32(&oi->oi_mode) & OSPFS_MODE_INLINE))
+		printf("inline size=%u", size);
+	else {
+		printf("%s size=%u", ftype == OSPFS_FTYPE_DIR ? "dir" : "file", size);
+		if (ftype == OSPFS_FTYPE_DIR)
+			printf(" entries=%u blank=%u holeratio=%.3f", st->nentries,
+			       st->nblank, st->nentries ? (double) st->nblank / st->nentries : 0.);
+		else
+			printf(" blocks=%u indirect=%u extents=%u holes=%u", st->nblocks,
+			       st->nindirect, st->nextents, st->nholes);
+	}
+	printf(" path=");
+	print_path(ino, 0);
+	printf("\n");
+}
+
+static double
+percent(uint64_t n, uint64_t d)
+{
+	return d ? 100. * n / d : 0.;
+}
+
+static void
+report(uint32_t nfree, int ntxns, uint32_t jnblocks, uint32_t jseq)
+{
+	uint32_t ino, b, ninodes_used = 0, nfiles = 0, nfragmented = 0, ninline = 0;
+	uint32_t nsymlinks = 0, ndirs = 0, nentries = 0, nblank = 0;
+	uint32_t nshared = 0, nextrarefs = 0;
+	uint64_t nextents = 0, nfileblocks = 0, nholes = 0;
+	uint32_t kinds[nelem(block_kinds)];
+	ospfs_inode_t *oi;
+
+	memset(kinds, 0, sizeof(kinds));
+	for (b = 0; b < nblocks; b++) {
+		kinds[blockrefs[b] ? blockkind[b] : BLOCK_FREE]++;
+		if (blockrefs[b] > 1) {
+			nshared++;
+			nextrarefs += blockrefs[b] - 1;
+		}
+	}
+
+	for (ino = 0; ino < ninodes; ino++) {
+		struct Inostat *st = &inostats[ino];
+		oi = inode(ino);
+		if (le32(&oi->oi_nlink) == 0)
+			continue;
+		ninodes_used++;
+		// Inode 0 is reserved: it counts as used, but holds nothing
+		if (ino == 0)
+			continue;
+		if (!quiet)
+			report_inode(ino);
+		if (le32(&oi->oi_ftype) == OSPFS_FTYPE_SYMLINK)
+			nsymlinks++;
+		else if (le32(&oi->oi_ftype) == OSPFS_FTYPE_DIR) {
+			ndirs++;
+			nentries += st->nentries;
+			nblank += st->nblank;
+		} else if (le32(&oi->oi_mode) & OSPFS_MODE_INLINE)
+			ninline++;
+		else if (st->nblocks && ino != OSPFS_JOURNAL_INODE) {
+			nfiles++;
+			nfragmented += st->nextents > 1;
+			nextents += st->nextents;
+			nfileblocks += st->nblocks;
+			nholes += st->nholes;
+		}
+	}
+
+	printf("blksize=%u nblocks=%u used=%u free=%u usedpct=%.1f\n",
+	       OSPFS_BLKSIZE, nblocks, nblocks - nfree, nfree,
+	       percent(nblocks - nfree, nblocks));
+	printf("metadata=%u indirect=%u filedata=%u dirdata=%u journal=%u shared=%u sharedrefs=%u\n",
+	       kinds[BLOCK_META], kinds[BLOCK_INDIRECT], kinds[BLOCK_FILE],
+	       kinds[BLOCK_DIR], kinds[BLOCK_JOURNAL], nshared, nextrarefs);
+	printf("ninodes=%u inodes_used=%u inodefillpct=%.1f\n",
+	       ninodes, ninodes_used, percent(ninodes_used, ninodes));
+	printf("files=%u fileblocks=%" PRIu64 " extents=%" PRIu64 " extents_per_file=%.2f fragmented=%u holes=%" PRIu64 " inline=%u symlinks=%u\n",
+	       nfiles, nfileblocks, nextents,
+	       nfiles ? (double) nextents / nfiles : 0., nfragmented, nholes,
+	       ninline, nsymlinks);
+	printf("dirs=%u entries=%u blank=%u holeratio=%.3f\n", ndirs, nentries,
+	       nblank, nentries ? (double) nblank / nentries : 0.);
+	if (ntxns >= 0)
+		printf("journal_blocks=%u journal_seq=%u journal_pending=%d\n",
+		       jnblocks, jseq, ntxns);
+	printf("errors=%d\n", nerrors);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: ospfsck [-q] fs.img\n\
+  \"-q\" means print only the summary, not a line for each inode.\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	int fd, ntxns = -1;
+	off_t size;
+	uint32_t ino, b, nfree, jnblocks = 0, jseq = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-q") == 0)
+		argc--, argv++, quiet = 1;
+	if (argc != 2)
+		usage();
+	diskname = argv[1];
+
+	// Block devices have no st_size, so seek to find the size
+	if ((fd = open(diskname, O_RDONLY)) < 0
+	    || (size = lseek(fd, 0, SEEK_END)) < 0) {
+		perror(diskname);
+		exit(2);
+	}
+	disk = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (size == 0 || disk == MAP_FAILED) {
+		fprintf(stderr, "mmap %s: %s\n", diskname,
+			size ? strerror(errno) : "empty file");
+		exit(2);
+	}
+	read_super(size);
+
+	blockrefs = xcalloc(nblocks, sizeof(uint32_t));
+	blockkind = xcalloc(nblocks, sizeof(uint8_t));
+	blockowner = xcalloc(nblocks, sizeof(uint32_t));
+	inostats = xcalloc(ninodes, sizeof(struct Inostat));
+	for (b = 0; b < first_datab; b++) {
+		blockrefs[b] = 1;
+		blockkind[b] = BLOCK_META;
+	}
+
+	for (ino = OSPFS_ROOT_INO; ino < ninodes; ino++)
+		if (le32(&inode(ino)->oi_nlink) != 0)
+			check_inode(ino);
+	check_links();
+	if (ninodes > OSPFS_JOURNAL_INODE
+	    && le32(&inode(OSPFS_JOURNAL_INODE)->oi_nlink) != 0)
+		ntxns = check_journal(&jnblocks, &jseq);
+	nfree = check_bitmap();
+
+	report(nfree, ntxns, jnblocks, jseq);
+	if (ntxns > 0)
+		fprintf(stderr, "%s: %d journal transactions are waiting to be replayed\n",
+			diskname, ntxns);
+	exit(nerrors ? 1 : 0);
+}
@@ -5,12 +5,15 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 
+#define OSPFS_BLKSIZE_BITS blksize_bits
 #include "ospfs.h"
 #include "md5.h"
 
@@ -25,6 +28,8 @@
 #define nelem(x)	(sizeof(x) / sizeof((x)[0]))
 
 int diskfd;
+uint8_t *disk;		// The image, mapped into memory
+uint32_t blksize_bits = OSPFS_BLKSIZE_BITS_MIN;
 uint32_t nblocks;
 uint32_t ninodes;
 uint32_t nbitblock;
@@ -32,12 +37,16 @@ uint32_t nextb;
 uint32_t nextinode;
 int verbose = 0;
 int link_contents = 0;
+int dedup_blocks = 0;
+uint32_t *blockrefs;	// With -d, each block's references beyond the first
+int nworkers = -1;	// Ingest threads; -1 means one per CPU
 
 struct Hardlink {
-	unsigned long osp_ino;
-	uint32_t host_ino;
+	uint32_t osp_ino;
+	unsigned long host_ino;
 	unsigned char md5_digest[MD5_DIGEST_SIZE];
-	struct Hardlink *next;
+	struct Hardlink *ino_next;	// Next in 'hardlink_ino_hash' chain
+	struct Hardlink *md5_next;	// Next in 'hardlink_md5_hash' chain
 };
 
 enum {
@@ -48,21 +57,47 @@ enum {
 	BLOCK_INODES
 };
 
+// A cached block.  Its data lives in the mapped image; while the block is
+// cached it is in host byte order, and it is swizzled back to disk order
+// when it leaves the cache.
 struct Block {
 	uint32_t bno;
 	uint32_t type;
 	uint32_t busy;
 	uint32_t used;
 	union {
-		uint8_t b[OSPFS_BLKSIZE];
-		uint32_t u[OSPFS_BLKSIZE / 4];
-		ospfs_inode_t ino[OSPFS_BLKINODES];
-	} u;
+		uint8_t b[OSPFS_BLKSIZE_MAX];
+		uint32_t u[OSPFS_BLKSIZE_MAX / 4];
+		ospfs_inode_t ino[OSPFS_BLKSIZE_MAX / OSPFS_INODESIZE];
+	} *u;
+	struct Block *hnext;		// Next in hash chain
+	struct Block *lprev, *lnext;	// LRU list, most recent first
 };
 
-struct Hardlink *hardlinks = NULL;
+// Hardlinks are found by host inode number and, with -c, by MD5 digest
+#define NHARDLINKHASH	65536
 
-struct Block cache[16];
+struct Hardlink *hardlink_ino_hash[NHARDLINKHASH];
+struct Hardlink *hardlink_md5_hash[NHARDLINKHASH];
+
+static unsigned
+hardlink_ino_bucket(unsigned long host_ino)
+{
+	return (host_ino * 2654435761UL) % NHARDLINKHASH;
+}
+
+static unsigned
+hardlink_md5_bucket(const unsigned char *md5_digest)
+{
+	return (md5_digest[0] | (md5_digest[1] << 8)) % NHARDLINKHASH;
+}
+
+#define NCACHE	1024
+#define NHASH	1024
+
+struct Block cache[NCACHE];
+struct Block *hash[NHASH];
+struct Block *lru_head, *lru_tail;
 
 struct ospfs_super super;
 
@@ -72,31 +107,38 @@ uint32_t
 get_hardlink(unsigned long host_ino, unsigned char *md5_digest)
 {
 	struct Hardlink *cur;
-	for (cur = hardlinks; cur; cur = cur->next)
-		if ((host_ino && cur->host_ino == host_ino)
-		    || (link_contents && md5_digest
-			&& memcmp(cur->md5_digest, md5_digest, MD5_DIGEST_SIZE) == 0))
-			return cur->osp_ino;
+	if (host_ino)
+		for (cur = hardlink_ino_hash[hardlink_ino_bucket(host_ino)]; cur; cur = cur->ino_next)
+			if (cur->host_ino == host_ino)
+				return cur->osp_ino;
+	if (link_contents && md5_digest)
+		for (cur = hardlink_md5_hash[hardlink_md5_bucket(md5_digest)]; cur; cur = cur->md5_next)
+			if (memcmp(cur->md5_digest, md5_digest, MD5_DIGEST_SIZE) == 0)
+				return cur->osp_ino;
 	return 0;
 }
 
-// Add a new host->osp inode mapping to 'hardlinks'
+// Add a new host->osp inode mapping to the hardlink hash tables
 void
 add_hardlink(unsigned long host_ino, uint32_t osp_ino, unsigned char *md5_digest)
 {
-	struct Hardlink *prev_head = hardlinks;
-	hardlinks = malloc(sizeof(*hardlinks));
-	if (!hardlinks) {
+	struct Hardlink *h = malloc(sizeof(*h));
+	if (!h) {
 		perror("malloc");
 		abort();
 	}
-	hardlinks->host_ino = host_ino;
-	hardlinks->osp_ino = osp_ino;
-	if (link_contents && md5_digest)
-		memcpy(hardlinks->md5_digest, md5_digest, MD5_DIGEST_SIZE);
-	else
-		memset(hardlinks->md5_digest, '\0', MD5_DIGEST_SIZE);
-	hardlinks->next = prev_head;
+	h->host_ino = host_ino;
+	h->osp_ino = osp_ino;
+	if (host_ino) {
+		h->ino_next = hardlink_ino_hash[hardlink_ino_bucket(host_ino)];
+		hardlink_ino_hash[hardlink_ino_bucket(host_ino)] = h;
+	}
+	if (link_contents && md5_digest) {
+		memcpy(h->md5_digest, md5_digest, MD5_DIGEST_SIZE);
+		h->md5_next = hardlink_md5_hash[hardlink_md5_bucket(md5_digest)];
+		hardlink_md5_hash[hardlink_md5_bucket(md5_digest)] = h;
+	} else
+		memset(h->md5_digest, '\0', MD5_DIGEST_SIZE);
 }
 
 ssize_t
@@ -119,6 +161,313 @@ readn(int f, void *av, size_t n)
 	return t;
 }
 
+// Computes the MD5 digest of the rest of file 'fd'.  Returns 0 on success,
+// -1 on a read error.
+int
+md5fd(int fd, unsigned char *md5_digest)
+{
+	unsigned char buf[BUFSIZ];
+	ssize_t r;
+	MD5_CONTEXT md5;
+	md5_init(&md5);
+	while (1) {
+		r = read(fd, buf, BUFSIZ);
+		if (r < 0 && r == EAGAIN)
+			/* do nothing */;
+		else if (r == 0)
+			break;
+		else if (r < 0)
+			return -1;
+		else
+			md5_update(&md5, buf, r);
+	}
+	md5_final(md5_digest, &md5);
+	return 0;
+}
+
+// Returns nonzero if the directory 'name' should be left out of the image.
+int
+skipdir(const char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+		|| strcmp(name, "CVS") == 0 || strcmp(name, ".svn") == 0
+		|| strcmp(name, ".git") == 0;
+}
+
+
+/****************************************************************************
+ * Parallel ingest
+ *
+ *   Reading and hashing host files dominates the time to build an image
+ *   from a big tree, so a walker thread visits the tree in the same order
+ *   as writedirectory() and queues each regular file, and worker threads
+ *   read the queued files (and MD5 them, with -c) in parallel.  The main
+ *   thread still does all allocation, in walk order, taking each file's
+ *   contents from the queue; so the image is the same as a serial build.
+ *   If the main thread ever meets a file that isn't next in the queue, it
+ *   stops using the queue and reads files itself.
+ *
+ ****************************************************************************/
+
+#define NINGEST		256		// Files queued at once
+#define INGEST_WINDOW	(64 << 20)	// Bytes of file data queued at once
+#define INGEST_MAXHOLD	(8 << 20)	// Larger files are read by the writer
+
+struct Ingest {
+	char *name;
+	size_t size;		// Size from lstat()
+	uint8_t *data;		// Contents, or NULL if the writer must read
+	size_t pos;		// Writer's read position in 'data'
+	int have_md5;
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	int done;		// Set when a worker has finished with it
+};
+
+struct Ingest ingest[NINGEST];
+unsigned ingest_head;		// Next slot the walker fills
+unsigned ingest_next;		// Next slot a worker takes
+unsigned ingest_tail;		// Next slot the writer takes
+size_t ingest_bytes;		// Data held by slots in [tail, head)
+int ingest_eof;			// The walker is finished
+int ingest_on;			// The writer is using the queue
+pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ingest_cond = PTHREAD_COND_INITIALIZER;
+pthread_t ingest_walker, *ingest_workers;
+char *ingest_root;		// Directory to walk, or
+char **ingest_files;		// list of files
+int ingest_nfiles;
+
+static size_t
+ingest_hold(size_t size)
+{
+	return size <= INGEST_MAXHOLD ? size : 0;
+}
+
+// Queues file 'name'.  Returns -1 if the writer has stopped using the queue.
+int
+ingest_put(const char *name, size_t size)
+{
+	struct Ingest *job;
+
+	pthread_mutex_lock(&ingest_lock);
+	while (ingest_on
+	       && (ingest_head - ingest_tail == NINGEST
+		   || (ingest_head != ingest_tail
+		       && ingest_bytes + ingest_hold(size) > INGEST_WINDOW)))
+		pthread_cond_wait(&ingest_cond, &ingest_lock);
+	if (!ingest_on) {
+		pthread_mutex_unlock(&ingest_lock);
+		return -1;
+	}
+	job = &ingest[ingest_head % NINGEST];
+	memset(job, 0, sizeof(*job));
+	job->name = strdup(name);
+	job->size = size;
+	ingest_bytes += ingest_hold(size);
+	ingest_head++;
+	pthread_cond_broadcast(&ingest_cond);
+	pthread_mutex_unlock(&ingest_lock);
+	return 0;
+}
+
+int
+ingest_walk(const char *name)
+{
+	DIR *dir;
+	struct dirent *ent;
+	struct stat s;
+	char pathbuf[PATH_MAX];
+	int namelen, r = 0;
+
+	if ((dir = opendir(name)) == NULL)
+		return 0;
+	strcpy(pathbuf, name);
+	namelen = strlen(pathbuf);
+	if (pathbuf[namelen - 1] != '/') {
+		pathbuf[namelen++] = '/';
+		pathbuf[namelen] = 0;
+	}
+
+	while (r == 0 && (ent = readdir(dir)) != NULL) {
+		strcpy(pathbuf + namelen, ent->d_name);
+		if (lstat(pathbuf, &s) < 0)
+			continue;
+		if (S_ISREG(s.st_mode))
+			r = ingest_put(pathbuf, s.st_size);
+		else if (S_ISDIR(s.st_mode) && !skipdir(ent->d_name))
+			r = ingest_walk(pathbuf);
+	}
+
+	closedir(dir);
+	return r;
+}
+
+void *
+ingest_walker_main(void *arg)
+{
+	struct stat s;
+	int i;
+
+	if (ingest_root)
+		ingest_walk(ingest_root);
+	for (i = 0; i < ingest_nfiles; i++)
+		if (stat(ingest_files[i], &s) < 0
+		    || ingest_put(ingest_files[i], s.st_size) < 0)
+			break;
+
+	pthread_mutex_lock(&ingest_lock);
+	ingest_eof = 1;
+	pthread_cond_broadcast(&ingest_cond);
+	pthread_mutex_unlock(&ingest_lock);
+	return NULL;
+}
+
+void *
+ingest_worker_main(void *arg)
+{
+	struct Ingest *job;
+	int fd;
+
+	while (1) {
+		pthread_mutex_lock(&ingest_lock);
+		while (ingest_next == ingest_head && !ingest_eof)
+			pthread_cond_wait(&ingest_cond, &ingest_lock);
+		if (ingest_next == ingest_head) {
+			pthread_mutex_unlock(&ingest_lock);
+			return NULL;
+		}
+		job = &ingest[ingest_next++ % NINGEST];
+		pthread_mutex_unlock(&ingest_lock);
+
+		// On any error leave the file to the writer, which reports it
+		if ((fd = open(job->name, O_RDONLY)) >= 0) {
+			if (ingest_hold(job->size) == job->size
+			    && (job->data = malloc(job->size + 1))
+			    && readn(fd, job->data, job->size + 1) != job->size) {
+				free(job->data);
+				job->data = NULL;
+			}
+			if (link_contents && job->data) {
+				MD5_CONTEXT md5;
+				md5_init(&md5);
+				md5_update(&md5, job->data, job->size);
+				md5_final(job->md5_digest, &md5);
+				job->have_md5 = 1;
+			} else if (link_contents && lseek(fd, 0, SEEK_SET) == 0)
+				job->have_md5 = (md5fd(fd, job->md5_digest) == 0);
+			close(fd);
+		}
+
+		pthread_mutex_lock(&ingest_lock);
+		job->done = 1;
+		pthread_cond_broadcast(&ingest_cond);
+		pthread_mutex_unlock(&ingest_lock);
+	}
+}
+
+// Starts the walker and 'nworkers' workers.  The walker visits directory
+// 'root' if it is nonnull, then the 'nfiles' files in 'files'.
+void
+ingest_start(char *root, char **files, int nfiles)
+{
+	int i;
+
+	if (nworkers < 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 1)
+		return;
+	ingest_root = root;
+	ingest_files = files;
+	ingest_nfiles = nfiles;
+	ingest_on = 1;
+	if (!(ingest_workers = malloc(nworkers * sizeof(pthread_t)))) {
+		perror("malloc");
+		abort();
+	}
+	if (pthread_create(&ingest_walker, NULL, ingest_walker_main, NULL) != 0) {
+		perror("pthread_create");
+		abort();
+	}
+	for (i = 0; i < nworkers; i++)
+		if (pthread_create(&ingest_workers[i], NULL, ingest_worker_main, NULL) != 0) {
+			perror("pthread_create");
+			abort();
+		}
+}
+
+// Returns the queued copy of file 'name', or NULL if the writer must read
+// the file itself.
+struct Ingest *
+ingest_get(const char *name)
+{
+	struct Ingest *job = NULL;
+
+	pthread_mutex_lock(&ingest_lock);
+	while (ingest_on && ingest_tail == ingest_head && !ingest_eof)
+		pthread_cond_wait(&ingest_cond, &ingest_lock);
+	if (ingest_on && ingest_tail != ingest_head) {
+		job = &ingest[ingest_tail % NINGEST];
+		if (strcmp(job->name, name) == 0)
+			while (!job->done)
+				pthread_cond_wait(&ingest_cond, &ingest_lock);
+		else {
+			fprintf(stderr, "%s: not the next queued file; reading files serially\n", name);
+			job = NULL;
+		}
+	}
+	if (!job) {
+		ingest_on = 0;
+		pthread_cond_broadcast(&ingest_cond);
+	}
+	pthread_mutex_unlock(&ingest_lock);
+	return job;
+}
+
+// Releases the job returned by ingest_get().
+void
+ingest_release(struct Ingest *job)
+{
+	free(job->data);
+	free(job->name);
+	pthread_mutex_lock(&ingest_lock);
+	ingest_bytes -= ingest_hold(job->size);
+	ingest_tail++;
+	pthread_cond_broadcast(&ingest_cond);
+	pthread_mutex_unlock(&ingest_lock);
+}
+
+// Waits for the ingest threads to finish.
+void
+ingest_finish(void)
+{
+	int i;
+
+	if (!ingest_workers)
+		return;
+	pthread_mutex_lock(&ingest_lock);
+	ingest_on = 0;
+	pthread_cond_broadcast(&ingest_cond);
+	pthread_mutex_unlock(&ingest_lock);
+	pthread_join(ingest_walker, NULL);
+	for (i = 0; i < nworkers; i++)
+		pthread_join(ingest_workers[i], NULL);
+}
+
+// Reads up to 'n' bytes of a file being written: from its queued contents
+// if 'job' has them, else from 'fd'.
+ssize_t
+srcread(struct Ingest *job, int fd, void *buf, size_t n)
+{
+	if (job && job->data) {
+		if (n > job->size - job->pos)
+			n = job->size - job->pos;
+		memcpy(buf, job->data + job->pos, n);
+		job->pos += n;
+		return n;
+	}
+	return readn(fd, buf, n);
+}
+
 // make little-endian
 void
 swizzle(uint32_t *x)
@@ -134,17 +483,24 @@ swizzle(uint32_t *x)
 	z[3] = (y >> 24) & 0xFF;
 }
 
+// 'tohost' says which way we are going, so that the OSPFS_MODE_INLINE flag
+// is tested in host byte order: inline data is a byte string and must not
+// be swizzled like block pointers.
 void
-swizzleinode(struct ospfs_inode *inode)
+swizzleinode(struct ospfs_inode *inode, int tohost)
 {
-	int i;
+	int i, inl;
 
 	if (inode->oi_nlink == 0)
 		return;
 	swizzle(&inode->oi_size);
 	swizzle(&inode->oi_ftype);
+	inl = !tohost && (inode->oi_mode & OSPFS_MODE_INLINE);
 	swizzle(&inode->oi_mode);
+	inl = inl || (tohost && (inode->oi_mode & OSPFS_MODE_INLINE));
 	swizzle(&inode->oi_nlink);
+	if (inl)
+		return;
 	for (i = 0; i < OSPFS_NDIRECT; i++)
 		swizzle(&inode->oi_direct[i]);
 	swizzle(&inode->oi_indirect);
@@ -160,7 +516,7 @@ swizzledirentry(struct ospfs_direntry *direntry)
 }
 
 void
-swizzleblock(struct Block *b)
+swizzleblock(struct Block *b, int tohost)
 {
 	int i;
 	struct ospfs_super *s;
@@ -168,47 +524,75 @@ swizzleblock(struct Block *b)
 
 	switch (b->type) {
 	case BLOCK_SUPER:
-		s = (struct ospfs_super*) &b->u;
+		s = (struct ospfs_super*) b->u;
 		swizzle(&s->os_magic);
 		swizzle(&s->os_nblocks);
 		swizzle(&s->os_ninodes);
 		swizzle(&s->os_firstinob);
+		swizzle(&s->os_blksize_bits);
+		swizzle(&s->os_refmapb);
 		break;
 	case BLOCK_DIR:
 		for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
-			od = (struct ospfs_direntry*) (b->u.b + i);
+			od = (struct ospfs_direntry*) (b->u->b + i);
 			swizzledirentry(od);
 		}
 		break;
 	case BLOCK_BITS:
 		for (i = 0; i < OSPFS_BLKSIZE / 4; i++)
-			swizzle(&b->u.u[i]);
+			swizzle(&b->u->u[i]);
 		break;
 	case BLOCK_INODES:
 		for (i = 0; i < OSPFS_BLKINODES; i++)
-			swizzleinode(&b->u.ino[i]);
+			swizzleinode(&b->u->ino[i], tohost);
 		break;
 	}
 }
 
+// Puts 'b' back in disk byte order and takes it out of the hash table.
+// The data is already in the image; the kernel writes it back.
 void
 flushb(struct Block *b)
 {
-	swizzleblock(b);
-	if (lseek(diskfd, b->bno * OSPFS_BLKSIZE, 0) < 0
-	    || write(diskfd, &b->u, OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
-		perror("flushb");
-		fprintf(stderr, "\n");
-		abort();
-	}
-	swizzleblock(b);
+	struct Block **pp;
+
+	swizzleblock(b, 0);
+	for (pp = &hash[b->bno % NHASH]; *pp != b; pp = &(*pp)->hnext)
+		/* do nothing */;
+	*pp = b->hnext;
+	b->used = 0;
 }
 
+void
+lru_unlink(struct Block *b)
+{
+	if (b->lprev)
+		b->lprev->lnext = b->lnext;
+	else
+		lru_head = b->lnext;
+	if (b->lnext)
+		b->lnext->lprev = b->lprev;
+	else
+		lru_tail = b->lprev;
+}
+
+void
+lru_push(struct Block *b)
+{
+	b->lprev = NULL;
+	b->lnext = lru_head;
+	if (lru_head)
+		lru_head->lprev = b;
+	else
+		lru_tail = b;
+	lru_head = b;
+}
+
+// Returns block 'bno'.  If 'clr', the block's old contents are not needed:
+// it is zeroed instead of being swizzled in.
 struct Block*
 getblk(uint32_t bno, int clr, uint32_t type)
 {
-	int i, least;
-	static int t = 1;
 	struct Block *b;
 
 	if (bno >= nblocks) {
@@ -216,43 +600,35 @@ getblk(uint32_t bno, int clr, uint32_t type)
 		abort();
 	}
 
-	least = -1;
-	for (i = 0; i < nelem(cache); i++) {
-		if (cache[i].bno == bno) {
-			b = &cache[i];
+	for (b = hash[bno % NHASH]; b; b = b->hnext)
+		if (b->bno == bno)
 			goto out;
-		}
-		if (!cache[i].busy
-		    && (least == -1 || cache[i].used < cache[least].used))
-			least = i;
-	}
 
-	if (least == -1) {
+	// Reuse the least recently used block that isn't busy
+	for (b = lru_tail; b && b->busy; b = b->lprev)
+		/* do nothing */;
+	if (!b) {
 		fprintf(stderr, "panic: block cache full\n");
 		abort();
 	}
-
-	b = &cache[least];
 	if (b->used)
 		flushb(b);
 
-	if (lseek(diskfd, bno*OSPFS_BLKSIZE, 0) < 0
-	    || readn(diskfd, &b->u, OSPFS_BLKSIZE) != OSPFS_BLKSIZE) {
-		fprintf(stderr, "read block %d: ", bno);
-		perror("");
-		fprintf(stderr, "\n");
-		abort();
-	}
 	b->bno = bno;
+	b->u = (void *) (disk + (size_t) bno * OSPFS_BLKSIZE);
+	b->hnext = hash[bno % NHASH];
+	hash[bno % NHASH] = b;
 	if (!clr)
-		swizzleblock(b);
+		swizzleblock(b, 1);
 	b->busy = 0;
 	b->type = type;
 
 out:
 	if (clr)
-		memset(&b->u, 0, sizeof(b->u));
-	b->used = ++t;
+		memset(b->u, 0, OSPFS_BLKSIZE);
+	lru_unlink(b);
+	lru_push(b);
+	b->used = 1;
 	b->busy++;
 	/* it is important to reset b->type in case we reuse a block for a
 	 * different purpose while it is still in the cache - this can happen
@@ -285,16 +661,26 @@ opendisk(const char *name)
 	}
 
 	if ((r = ftruncate(diskfd, 0)) < 0
-	    || (r = ftruncate(diskfd, nblocks * OSPFS_BLKSIZE)) < 0) {
+	    || (r = ftruncate(diskfd, (off_t) nblocks * OSPFS_BLKSIZE)) < 0) {
 		fprintf(stderr, "truncate %s: ", name);
 		perror("");
 		abort();
 	}
 
+	disk = mmap(NULL, (size_t) nblocks * OSPFS_BLKSIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, diskfd, 0);
+	if (disk == MAP_FAILED) {
+		fprintf(stderr, "mmap %s: ", name);
+		perror("");
+		abort();
+	}
+	for (i = 0; i < NCACHE; i++)
+		lru_push(&cache[i]);
+
 	nbitblock = (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
 	for (i = 0; i < nbitblock; i++){
 		b = getblk(OSPFS_FREEMAP_BLK + i, 0, BLOCK_BITS);
-		memset(&b->u.b, 0xFF, OSPFS_BLKSIZE);
+		memset(&b->u->b, 0xFF, OSPFS_BLKSIZE);
 		putblk(b);
 	}
 
@@ -307,10 +693,21 @@ opendisk(const char *name)
 	nextb = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock;
 	nextinode = 0;
 
+	// The reference-count map is written out by finishfs()
+	if (dedup_blocks) {
+		super.os_refmapb = nextb;
+		nextb += (nblocks + OSPFS_BLKREFS - 1) / OSPFS_BLKREFS;
+		if (!(blockrefs = calloc(nblocks, sizeof(uint32_t)))) {
+			perror("calloc");
+			abort();
+		}
+	}
+
 	super.os_magic = OSPFS_MAGIC;
 	super.os_nblocks = nblocks;
 	super.os_ninodes = ninodes;
 	super.os_firstinob = OSPFS_FREEMAP_BLK + nbitblock;
+	super.os_blksize_bits = blksize_bits;
 	if (verbose)
 		fprintf(stderr, "superblock, free block bitmap %d, first inode block %d, first data block %d\n", OSPFS_FREEMAP_BLK, super.os_firstinob, nextb);
 }
@@ -329,7 +726,7 @@ storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 				fprintf(stderr, "%*sindirect block %d\n", indent, "", nextb - 1);
 		} else
 			bindir = getblk(ino->oi_indirect, 0, BLOCK_BITS);
-		bindir->u.u[nblk - OSPFS_NDIRECT] = b->bno;
+		bindir->u->u[nblk - OSPFS_NDIRECT] = b->bno;
 		putblk(bindir);
 	} else if (nblk < OSPFS_MAXFILEBLKS) {
 		struct Block *bindir2;
@@ -343,14 +740,14 @@ storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 			bindir2 = getblk(ino->oi_indirect2, 0, BLOCK_BITS);
 		// make nblk an offset from the first blk under indirect2
 		nblk -= OSPFS_NDIRECT + OSPFS_NINDIRECT;
-		if (bindir2->u.u[nblk / OSPFS_NINDIRECT] == 0) {
+		if (bindir2->u->u[nblk / OSPFS_NINDIRECT] == 0) {
 			bindir = getblk(nextb++, 1, BLOCK_BITS);
-			bindir2->u.u[nblk / OSPFS_NINDIRECT] = bindir->bno;
+			bindir2->u->u[nblk / OSPFS_NINDIRECT] = bindir->bno;
 			if (verbose)
 				fprintf(stderr, "%*sindirect2-indirect block %d\n", indent, "", nextb - 1);
 		} else
-			bindir = getblk(bindir2->u.u[nblk / OSPFS_NINDIRECT], 0, BLOCK_BITS);
-		bindir->u.u[nblk % OSPFS_NINDIRECT] = b->bno;
+			bindir = getblk(bindir2->u->u[nblk / OSPFS_NINDIRECT], 0, BLOCK_BITS);
+		bindir->u->u[nblk % OSPFS_NINDIRECT] = b->bno;
 		putblk(bindir);
 		putblk(bindir2);
 	} else {
@@ -362,6 +759,9 @@ storeblk(struct ospfs_inode *ino, struct Block *b, int nblk, int indent)
 struct ospfs_inode *
 allocinode(uint32_t *ino, struct Block **ib)
 {
+	// The module creates the journal in its reserved inode
+	if (nextinode == OSPFS_JOURNAL_INODE)
+		nextinode++;
 	if (nextinode == ninodes) {
 		fprintf(stderr, "not enough inodes (exceeded %u inodes)\n", ninodes);
 		abort();
@@ -369,7 +769,7 @@ allocinode(uint32_t *ino, struct Block **ib)
 
 	*ino = nextinode++;
 	*ib = getblk(super.os_firstinob + *ino / OSPFS_BLKINODES, 0, BLOCK_INODES);
-	return &(*ib)->u.ino[*ino % OSPFS_BLKINODES];
+	return &(*ib)->u->ino[*ino % OSPFS_BLKINODES];
 }
 
 struct ospfs_direntry *
@@ -386,13 +786,13 @@ allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb,
 	if (nblk >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		uint32_t nblk_off = nblk - OSPFS_NDIRECT - OSPFS_NINDIRECT;
 		struct Block *bindir2 = getblk(dirino->oi_indirect2, 0, BLOCK_BITS);
-		struct Block *bindir = getblk(bindir2->u.u[nblk_off / OSPFS_NINDIRECT], 0, BLOCK_BITS);
-		*dirb = getblk(bindir->u.u[nblk_off % OSPFS_NINDIRECT], 0, BLOCK_DIR);
+		struct Block *bindir = getblk(bindir2->u->u[nblk_off / OSPFS_NINDIRECT], 0, BLOCK_BITS);
+		*dirb = getblk(bindir->u->u[nblk_off % OSPFS_NINDIRECT], 0, BLOCK_DIR);
 		putblk(bindir);
 		putblk(bindir2);
 	} else if (nblk >= OSPFS_NDIRECT) {
 		struct Block *bindir = getblk(dirino->oi_indirect, 0, BLOCK_BITS);
-		*dirb = getblk(bindir->u.u[nblk - OSPFS_NDIRECT], 0, BLOCK_DIR);
+		*dirb = getblk(bindir->u->u[nblk - OSPFS_NDIRECT], 0, BLOCK_DIR);
 		putblk(bindir);
 	} else if (nblk >= 0)
 		*dirb = getblk(dirino->oi_direct[nblk], 0, BLOCK_DIR);
@@ -400,7 +800,7 @@ allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb,
 		goto new_dirb;
 
 	for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
-		od = (struct ospfs_direntry *) ((*dirb)->u.b + i);
+		od = (struct ospfs_direntry *) ((*dirb)->u->b + i);
 		if (od->od_ino == 0)
 			goto gotit;
 	}
@@ -409,34 +809,97 @@ allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb,
 
 new_dirb:
 	*dirb = getblk(nextb++, 1, BLOCK_DIR);
-	od = (struct ospfs_direntry *) (*dirb)->u.b;
+	od = (struct ospfs_direntry *) (*dirb)->u->b;
 	for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
-		od = (struct ospfs_direntry *) ((*dirb)->u.b + i);
+		od = (struct ospfs_direntry *) ((*dirb)->u->b + i);
 		od->od_ino = 0;
 	}
 	storeblk(dirino, *dirb, ++nblk, indent);
 	dirino->oi_size += OSPFS_BLKSIZE;
 	assert((nblk + 1) * OSPFS_BLKSIZE == dirino->oi_size);
 	
-	od = (struct ospfs_direntry *) (*dirb)->u.b;
+	od = (struct ospfs_direntry *) (*dirb)->u->b;
 	
 gotit:
-	strcpy(od->od_name, name);
+	// A name that fills od_name is terminated by the type byte, and
+	// has no type (see ospfs.h)
+	memcpy(od->od_name, name, namelen);
+	if (namelen < OSPFS_MAXNAMELEN)
+		od->od_name[namelen] = 0;
+	od->od_ftype = OSPFS_DIRENTRY_FTYPE_UNKNOWN;
 	return od;
 }
 
+// setdirentftype(od, ftype)
+//	Records file type 'ftype' in direntry 'od', if its name leaves room.
+
+void
+setdirentftype(struct ospfs_direntry *od, uint32_t ftype)
+{
+	if (strnlen(od->od_name, OSPFS_MAXNAMELEN) < OSPFS_MAXNAMELEN)
+		od->od_ftype = OSPFS_DIRENTRY_FTYPE(ftype);
+}
+
+// With -d, data blocks are found by the MD5 of their contents
+#define NDEDUPHASH	65536
+
+struct Dedup {
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	uint32_t bno;
+	struct Dedup *next;
+};
+
+struct Dedup *dedup_hash[NDEDUPHASH];
+
+// Returns an earlier data block with the same contents as 'b', or 0 if
+// there is none; then 'b' is remembered for later blocks.
+uint32_t
+dedup_block(struct Block *b)
+{
+	MD5_CONTEXT md5;
+	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	struct Dedup *d;
+	unsigned h;
+
+	md5_init(&md5);
+	md5_update(&md5, b->u->b, OSPFS_BLKSIZE);
+	md5_final(md5_digest, &md5);
+	h = (md5_digest[0] | (md5_digest[1] << 8)) % NDEDUPHASH;
+
+	for (d = dedup_hash[h]; d; d = d->next)
+		if (memcmp(d->md5_digest, md5_digest, MD5_DIGEST_SIZE) == 0) {
+			struct Block *o = getblk(d->bno, 0, BLOCK_FILE);
+			int same = (memcmp(o->u->b, b->u->b, OSPFS_BLKSIZE) == 0);
+			putblk(o);
+			if (same)
+				return d->bno;
+		}
+
+	if (!(d = malloc(sizeof(*d)))) {
+		perror("malloc");
+		abort();
+	}
+	memcpy(d->md5_digest, md5_digest, MD5_DIGEST_SIZE);
+	d->bno = b->bno;
+	d->next = dedup_hash[h];
+	dedup_hash[h] = d;
+	return 0;
+}
+
 void
 writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino, int indent, int mode)
 {
-	int fd;
+	int fd = -1;
 	const char *last;
 	struct ospfs_direntry *de;
 	struct ospfs_inode *ino;
 	int i, n, nblk, hardlink_ino;
 	struct Block *dirb, *inob, *b, *bindir;
 	unsigned char md5_digest[MD5_DIGEST_SIZE];
+	unsigned char inl[OSPFS_MAXINLINELEN + 1];
+	struct Ingest *job = ingest_get(name);
 
-	if ((fd = open(name, O_RDONLY)) < 0) {
+	if ((!job || !job->data) && (fd = open(name, O_RDONLY)) < 0) {
 		fprintf(stderr, "open %s:", name);
 		perror("");
 		abort();
@@ -449,25 +912,15 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 		last = name;
 
 	de = allocdirentry(dirino, last, &dirb, indent);
+	setdirentftype(de, OSPFS_FTYPE_REG);
 
-	if (link_contents) {
-		unsigned char buf[BUFSIZ];
-		ssize_t r;
-		MD5_CONTEXT md5;
-		md5_init(&md5);
-		while (1) {
-			r = read(fd, buf, BUFSIZ);
-			if (r < 0 && r == EAGAIN)
-				/* do nothing */;
-			else if (r == 0)
-				break;
-			else if (r < 0) {
-				perror("read");
-				return;
-			} else
-				md5_update(&md5, buf, r);
+	if (link_contents && job && job->have_md5)
+		memcpy(md5_digest, job->md5_digest, MD5_DIGEST_SIZE);
+	else if (link_contents) {
+		if (md5fd(fd, md5_digest) < 0) {
+			perror("read");
+			return;
 		}
-		md5_final(md5_digest, &md5);
 		if (lseek(fd, 0, SEEK_SET) < 0) {
 			perror("seek");
 			return;
@@ -487,7 +940,7 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 	} else {
 		de->od_ino = hardlink_ino;
 		inob = getblk(super.os_firstinob + hardlink_ino / OSPFS_BLKINODES, 0, BLOCK_INODES);
-		ino = &inob->u.ino[hardlink_ino % OSPFS_BLKINODES];
+		ino = &inob->u->ino[hardlink_ino % OSPFS_BLKINODES];
 		ino->oi_nlink++;
 
 		if (verbose)
@@ -500,12 +953,31 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 		if (verbose)
 			fprintf(stderr, "%*s%s, directory block %d, inode %d\n", indent, "", last, dirb->bno, de->od_ino);
 
+		// Files short enough to fit are stored inline in the inode.
+		n = srcread(job, fd, inl, OSPFS_MAXINLINELEN + 1);
+		if (n < 0) {
+			fprintf(stderr, "reading %s: ", name);
+			perror("");
+			abort();
+		}
+		if (n <= OSPFS_MAXINLINELEN) {
+			ino->oi_mode |= OSPFS_MODE_INLINE;
+			memcpy(((struct ospfs_inline_inode *) ino)->oi_data, inl, n);
+			ino->oi_size = n;
+			goto done;
+		}
+		if (job && job->data)
+			job->pos = 0;
+		else if (lseek(fd, 0, SEEK_SET) < 0) {
+			perror("seek");
+			abort();
+		}
+
 		n = 0;
 		for (nblk = 0; ; nblk++) {
+			uint32_t dup;
 			b = getblk(nextb, 1, BLOCK_FILE);
-			n = readn(fd, b->u.b, OSPFS_BLKSIZE);
-			if (verbose)
-				fprintf(stderr, "%*sdata block %d\n", indent, "", nextb);
+			n = srcread(job, fd, b->u->b, OSPFS_BLKSIZE);
 			if (n < 0) {
 				fprintf(stderr, "reading %s: ", name);
 				perror("");
@@ -515,7 +987,19 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 				putblk(b);
 				break;
 			}
-			nextb++;
+			if (dedup_blocks && (dup = dedup_block(b)) != 0) {
+				// Leave the unused block as it was: zero
+				memset(b->u->b, 0, OSPFS_BLKSIZE);
+				putblk(b);
+				b = getblk(dup, 0, BLOCK_FILE);
+				blockrefs[dup]++;
+				if (verbose)
+					fprintf(stderr, "%*sdata block %d [shared]\n", indent, "", dup);
+			} else {
+				if (verbose)
+					fprintf(stderr, "%*sdata block %d\n", indent, "", nextb);
+				nextb++;
+			}
 			storeblk(ino, b, nblk, indent);
 			putblk(b);
 			if (n < OSPFS_BLKSIZE)
@@ -525,6 +1009,11 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 		ino->oi_size = nblk * OSPFS_BLKSIZE + n;
 	}
 
+ done:
+	if (job)
+		ingest_release(job);
+	if (fd >= 0)
+		close(fd);
 	putblk(dirb);
 	putblk(inob);
 }
@@ -545,6 +1034,7 @@ addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, un
 		last = name;
 
 	de = allocdirentry(dirino, last, &dirb, indent);
+	setdirentftype(de, OSPFS_FTYPE_SYMLINK);
 
 	if (host_ino)
 		hardlink_ino = get_hardlink(host_ino, 0);
@@ -559,7 +1049,7 @@ addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, un
 	} else {
 		de->od_ino = hardlink_ino;
 		inob = getblk(super.os_firstinob + hardlink_ino / OSPFS_BLKINODES, 0, BLOCK_INODES);
-		sino = (struct ospfs_symlink_inode *) &inob->u.ino[hardlink_ino % OSPFS_BLKINODES];
+		sino = (struct ospfs_symlink_inode *) &inob->u->ino[hardlink_ino % OSPFS_BLKINODES];
 		sino->oi_nlink++;
 
 		if (verbose)
@@ -625,6 +1115,7 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 			last = name;
 
 		dirod = allocdirentry(parentdirino, last, &dirb, indent);
+		setdirentftype(dirod, OSPFS_FTYPE_DIR);
 		dirino = allocinode(&dirod->od_ino, &inob);
 		parentdirino->oi_nlink++;
 		dirino->oi_ftype = OSPFS_FTYPE_DIR;
@@ -645,7 +1136,6 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 	}
 
 	while ((ent = readdir(dir)) != NULL) {
-		int ent_namlen = strlen(ent->d_name);
 		strcpy(pathbuf + namelen, ent->d_name);
 
 		// don't depend on unreliable parts of the dirent structure
@@ -655,12 +1145,7 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 		if (S_ISREG(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
 			writefile(dirino, pathbuf, host_ino, indent + 2, s.st_mode & 0777);
-		} else if (S_ISDIR(s.st_mode)
-			   && (ent_namlen > 1 || ent->d_name[0] != '.')
-			   && (ent_namlen > 2 || ent->d_name[0] != '.' || ent->d_name[1] != '.')
-			   && (ent_namlen > 3 || ent->d_name[0] != 'C' || ent->d_name[1] != 'V' || ent->d_name[2] != 'S')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 's' || ent->d_name[2] != 'v' || ent->d_name[3] != 'n')
-			   && (ent_namlen > 4 || ent->d_name[0] != '.' || ent->d_name[1] != 'g' || ent->d_name[2] != 'i' || ent->d_name[3] != 't'))
+		} else if (S_ISDIR(s.st_mode) && !skipdir(ent->d_name))
 			writedirectory(dirino, pathbuf, 0, indent + 2, s.st_mode & 0777);
 		else if (S_ISLNK(s.st_mode)) {
 			unsigned long host_ino = (s.st_nlink > 1 ? s.st_ino : 0);
@@ -684,13 +1169,13 @@ finishfs(void)
 	// create free block bitmap
 	for (i = 0; i < nextb; i++) {
 		b = getblk(OSPFS_FREEMAP_BLK + i / OSPFS_BLKBITSIZE, 0, BLOCK_BITS);
-		b->u.u[(i%OSPFS_BLKBITSIZE)/32] &= ~(1<<(i%32));
+		b->u->u[(i%OSPFS_BLKBITSIZE)/32] &= ~(1<<(i%32));
 		putblk(b);
 	}
 	if (nblocks != nbitblock*OSPFS_BLKBITSIZE) {
 		b = getblk(OSPFS_FREEMAP_BLK + nbitblock - 1, 0, BLOCK_BITS);
 		for (i = nblocks % OSPFS_BLKBITSIZE; i < OSPFS_BLKBITSIZE; i++)
-			b->u.u[i/32] &= ~(1<<(i%32));
+			b->u->u[i/32] &= ~(1<<(i%32));
 		putblk(b);
 	}
 
@@ -698,15 +1183,23 @@ finishfs(void)
 	// create linked list of free blocks
 	for (i = nextb; i < nblocks; i++) {
 		b = getblk(i, 1, BLOCK_FILE);
-		b->u.u[0] = (i + 1 < nblocks ? i + 1 : 0);
+		b->u->u[0] = (i + 1 < nblocks ? i + 1 : 0);
 		putblk(b);
 	}
 	super.os_firstfree = (nextb < nblocks ? nextb : 0);
 #endif
 	
+	// write reference-count map
+	for (i = 0; dedup_blocks && i < nblocks; i += OSPFS_BLKREFS) {
+		b = getblk(super.os_refmapb + i / OSPFS_BLKREFS, 1, BLOCK_BITS);
+		memcpy(b->u->u, blockrefs + i,
+		       (nblocks - i < OSPFS_BLKREFS ? nblocks - i : OSPFS_BLKREFS) * sizeof(uint32_t));
+		putblk(b);
+	}
+
 	// write superblock
 	b = getblk(1, 1, BLOCK_SUPER);
-	memmove(&b->u, &super, sizeof(struct ospfs_super));
+	memmove(b->u, &super, sizeof(struct ospfs_super));
 	putblk(b);
 }
 
@@ -718,14 +1211,22 @@ flushdisk(void)
 	for (i = 0; i < nelem(cache); i++)
 		if (cache[i].used)
 			flushb(&cache[i]);
+	if (munmap(disk, (size_t) nblocks * OSPFS_BLKSIZE) < 0
+	    || close(diskfd) < 0) {
+		perror("flushdisk");
+		abort();
+	}
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
-       ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
+	fprintf(stderr, "Usage: ospfsformat [-c] [-d] [-b BLKSIZE] [-j N] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
+       ospfsformat [-c] [-d] [-b BLKSIZE] [-j N] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
   \"-c\" means treat files with identical contents as hard links.\n\
+  \"-d\" means share identical data blocks between files.\n\
+  \"-b BLKSIZE\" sets the block size in bytes: 1024 (the default), 2048 or 4096.\n\
+  \"-j N\" reads host files with N threads (default: one per CPU; 1 means serially).\n\
   \"-l SRC:DST\" means add a symbolic link from SRC to DST.\n");
 	abort();
 }
@@ -753,10 +1254,37 @@ main(int argc, char **argv)
 		argc--, argv++, verbose = 1;
 		goto option;
 	}
+	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+		argc--, argv++, dedup_blocks = 1;
+		goto option;
+	}
 	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
 		argc--, argv++, link_contents = 1;
 		goto option;
 	}
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		unsigned long sz;
+		if (argc < 3)
+			usage();
+		sz = strtoul(argv[2], &s, 0);
+		for (blksize_bits = OSPFS_BLKSIZE_BITS_MIN;
+		     blksize_bits < OSPFS_BLKSIZE_BITS_MAX && (1UL << blksize_bits) != sz;
+		     blksize_bits++)
+			/* do nothing */;
+		if (*s || s == argv[2] || (1UL << blksize_bits) != sz)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
+	if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+		if (argc < 3)
+			usage();
+		nworkers = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || nworkers < 1)
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
 	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
 		struct linkrecord *nl;
 		if (argc < 3 || strchr(argv[2], ':') == 0)
@@ -779,7 +1307,7 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 8192)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > (0xFFFFFFFFU >> blksize_bits))
 		usage();
 
 	ninodes = strtol(argv[3], &s, 0);
@@ -805,11 +1333,14 @@ main(int argc, char **argv)
 	if (strcmp(argv[4], "-r") == 0) {
 		if (argc != 6)
 			usage();
+		ingest_start(argv[5], NULL, 0);
 		writedirectory(rootino, argv[5], 1, 0, 0777);
 	} else {
+		ingest_start(NULL, argv + 4, argc - 4);
 		for (i = 4; i < argc; i++)
 			writefile(rootino, argv[i], 0, 0, 0666);
 	}
+	ingest_finish();
 	while (links) {
 		struct linkrecord *l = links;
 		addsymlink(rootino, l->destination, l->source, 0, 0);
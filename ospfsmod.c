@@ -5,6 +5,7 @@
 #endif
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#define OSPFS_BLKSIZE_BITS ospfs_blksize_bits
 #include "ospfs.h"
 #include <linux/string.h>
 #include <linux/slab.h>
@@ -14,10 +15,17 @@
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
-
-#define DEBUG_CREATE_BLANK_DIRENTRY 0
-#define DEBUG_OSPFS_CREATE 0
-#define DEBUG_OSPFS_WRITE 0
+#include <linux/crc32.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 
 #define DESIGNPROJECT_JOURNAL 1
 
@@ -37,17 +45,80 @@
  * and KERN_EMERG will make sure that you will see messages.) */
 #define eprintk(format, ...) printk(KERN_NOTICE format, ## __VA_ARGS__)
 
-// The actual disk data is just an array of raw memory.
+// By default the disk data is just an array of raw memory.
 // The initial array is defined in fsimg.c, based on your 'base' directory.
 extern uint8_t ospfs_data[];
 extern uint32_t ospfs_length;
 
+// A sparse image (fsimgtoc -s) holds only the blocks that aren't all zero,
+// packed together in 'ospfs_data'; 'ospfs_sparse_runs' says where they go,
+// as pairs (first block, number of blocks).  Dense images have
+// 'ospfs_sparse_blksize' 0.
+extern uint32_t ospfs_sparse_blksize;
+extern uint32_t ospfs_sparse_nruns;
+extern uint32_t ospfs_sparse_runs[];
+
+// For a sparse image, 'ospfs_blockmap[b]' is block b's data: either in
+// 'ospfs_data', or in a page allocated the first time the block is used.
+// 'ospfs_packed_blockno[i]' is the number of the i'th packed block, and
+// 'ospfs_sparse_pages' maps an allocated page back to its group of blocks:
+// an open-addressed hash table, keyed by page address, of group numbers
+// plus one.  Built at the first mount and kept until the module is
+// unloaded, since it holds the file system.  NULL for dense images.
+static uint8_t **ospfs_blockmap;
+static uint32_t *ospfs_packed_blockno;
+static uint32_t ospfs_packed_nblocks;
+static uint32_t *ospfs_sparse_pages;
+static unsigned int ospfs_sparse_pages_bits;
+static uint32_t ospfs_sparse_nblocks;
+static unsigned int ospfs_sparse_bits;
+static DEFINE_SPINLOCK(ospfs_blockmap_lock);
+
+// When the file system is mounted from a block device instead, metadata
+// blocks are read into the buffer cache when first used, and held there
+// while it is mounted: 'ospfs_bhs[b / OSPFS_BHS_PER]', if set, is a page
+// of buffer pointers, and its entry 'b % OSPFS_BHS_PER' is block b's
+// buffer, or NULL if it hasn't been read.  Entries are installed under
+// 'ospfs_bhs_lock' and read without it.  File data is read and released
+// on each access instead (see ospfs_data_get).  'ospfs_bhs' is NULL in
+// array mode.
+#define OSPFS_BHS_PER	(PAGE_SIZE / sizeof(struct buffer_head *))
+static struct buffer_head ***ospfs_bhs;
+static uint32_t ospfs_bhs_nslots;	// Entries in ospfs_bhs
+static struct super_block *ospfs_bdev_sb;
+static DEFINE_SPINLOCK(ospfs_bhs_lock);
+
+// log2 of the mounted file system's block size, read from its superblock.
+// OSPFS_BLKSIZE and the other size macros in ospfs.h are written in terms
+// of it.
+static unsigned int ospfs_blksize_bits = OSPFS_BLKSIZE_BITS_MIN;
+
 // A pointer to the superblock; see ospfs.h for details on the struct.
-static ospfs_super_t * const ospfs_super =
-	(ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
+// Set at mount.
+static ospfs_super_t *ospfs_super;
 
 static int change_size(ospfs_inode_t *oi, uint32_t want_size);
+static int change_size_fill(ospfs_inode_t *oi, uint32_t new_size,
+			    uint32_t fill_start, uint32_t fill_end);
 static ospfs_direntry_t *find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen);
+static int find_direntry_off(ospfs_inode_t *dir_oi, const char *name, int namelen);
+static int ospfs_freemap_init(void);
+static void ospfs_freemap_destroy(void);
+static int ospfs_icache_init(void);
+static void ospfs_icache_destroy(void);
+static int ospfs_inomap_init(void);
+static void ospfs_inomap_destroy(void);
+static void free_inode(uint32_t ino);
+static void *ospfs_big_alloc(size_t size);
+static void ospfs_big_free(void *ptr, size_t size);
+static int ospfs_journal_replay(void);
+static void ospfs_journal_init(struct super_block *sb);
+static void ospfs_journal_flush(void);
+static void ospfs_journal_extend(uint32_t credits);
+static void ospfs_journal_destroy(void);
+static void dir_index_reap(void);
+static inline void *ospfs_freemap(uint32_t k);
+static inline uint32_t ospfs_first_datab(void);
 
 
 /*****************************************************************************
@@ -86,6 +157,7 @@ static struct file_system_type ospfs_fs_type;
 // Inode and file operations for regular files
 static struct inode_operations ospfs_reg_inode_ops;
 static struct file_operations ospfs_reg_file_ops;
+static struct address_space_operations ospfs_aops;
 // Inode and file operations for directories
 static struct inode_operations ospfs_dir_inode_ops;
 static struct file_operations ospfs_dir_file_ops;
@@ -97,6 +169,288 @@ static struct super_operations ospfs_superblock_ops;
 
 
 
+/*****************************************************************************
+ * STATISTICS
+ *
+ *   Counters and histograms for the hot paths, kept per CPU so that
+ *   counting costs no more than an increment, and summed when read from
+ *   /proc/fs/ospfs.  Each line there is a name and its value; a
+ *   histogram's line has OSPFS_STAT_BUCKETS counts, where bucket 0 counts
+ *   zeros and bucket i counts values in [2^(i-1), 2^i).  Times are in
+ *   nanoseconds.
+ */
+
+enum {
+	OSPFS_STAT_READ_CALLS,		// ospfs_read calls
+	OSPFS_STAT_READ_BYTES,		// bytes they returned
+	OSPFS_STAT_WRITE_CALLS,		// ospfs_write calls
+	OSPFS_STAT_WRITE_BYTES,		// bytes they wrote
+	OSPFS_STAT_ALLOC_BLOCKS,	// blocks allocated
+	OSPFS_STAT_FREE_BLOCKS,		// blocks freed (or unshared)
+	OSPFS_STAT_ALLOC_SEARCHES,	// bitmap searches
+	OSPFS_STAT_ALLOC_SCANNED,	// bitmap blocks they examined
+	OSPFS_STAT_LOOKUPS,		// directory entry lookups
+	OSPFS_STAT_LOOKUP_PROBES,	// entries they compared
+	OSPFS_STAT_BLOCKS_ADDED,	// file blocks added by change_size
+	OSPFS_STAT_BLOCKS_REMOVED,	// file blocks removed by change_size
+	OSPFS_STAT_INODE_ALLOCS,	// inode allocations
+	OSPFS_STAT_INODE_PROBES,	// free-stack entries they examined
+	OSPFS_NSTATS
+};
+
+static const char *ospfs_stat_names[OSPFS_NSTATS] = {
+	"read_calls", "read_bytes", "write_calls", "write_bytes",
+	"alloc_blocks", "free_blocks", "alloc_searches", "alloc_scanned",
+	"lookups", "lookup_probes", "blocks_added", "blocks_removed",
+	"inode_allocs", "inode_probes"
+};
+
+enum {
+	OSPFS_HIST_READ_NS,		// ospfs_read latency
+	OSPFS_HIST_WRITE_NS,		// ospfs_write latency
+	OSPFS_HIST_ALLOC_SCAN,		// bitmap blocks examined per search
+	OSPFS_HIST_LOOKUP_PROBES,	// entries compared per lookup
+	OSPFS_HIST_INODE_PROBES,	// entries examined per inode allocation
+	OSPFS_NHISTS
+};
+
+static const char *ospfs_hist_names[OSPFS_NHISTS] = {
+	"read_ns", "write_ns", "alloc_scan", "lookup_probes", "inode_probes"
+};
+
+#define OSPFS_STAT_BUCKETS	32
+
+typedef struct ospfs_stats {
+	unsigned long st_count[OSPFS_NSTATS];
+	unsigned long st_hist[OSPFS_NHISTS][OSPFS_STAT_BUCKETS];
+} ospfs_stats_t;
+
+static DEFINE_PER_CPU(ospfs_stats_t, ospfs_stats);
+
+
+// ospfs_stat_add(i, n)
+//	Adds 'n' to counter 'i'.
+
+static inline void
+ospfs_stat_add(int i, unsigned long n)
+{
+	get_cpu_var(ospfs_stats).st_count[i] += n;
+	put_cpu_var(ospfs_stats);
+}
+
+
+// ospfs_stat_hist(h, v)
+//	Counts value 'v' in histogram 'h'.
+
+static inline void
+ospfs_stat_hist(int h, uint64_t v)
+{
+	int bucket = v > 0xFFFFFFFFULL ? OSPFS_STAT_BUCKETS : fls((uint32_t) v);
+
+	if (bucket >= OSPFS_STAT_BUCKETS)
+		bucket = OSPFS_STAT_BUCKETS - 1;
+	get_cpu_var(ospfs_stats).st_hist[h][bucket]++;
+	put_cpu_var(ospfs_stats);
+}
+
+
+// ospfs_stat_lookup(probes)
+//	Counts a directory lookup that compared 'probes' entries.
+
+static inline void
+ospfs_stat_lookup(uint32_t probes)
+{
+	ospfs_stat_add(OSPFS_STAT_LOOKUPS, 1);
+	ospfs_stat_add(OSPFS_STAT_LOOKUP_PROBES, probes);
+	ospfs_stat_hist(OSPFS_HIST_LOOKUP_PROBES, probes);
+}
+
+
+// ospfs_stat_time(h, start)
+//	Counts the time since 'start', from ktime_get(), in histogram 'h'.
+
+static inline void
+ospfs_stat_time(int h, ktime_t start)
+{
+	ospfs_stat_hist(h, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+
+// ospfs_stats_show(m, v)
+//	Writes the summed statistics to /proc/fs/ospfs.  The per-CPU values
+//	are read without locking, so a sum may miss increments in flight.
+
+static int
+ospfs_stats_show(struct seq_file *m, void *v)
+{
+	unsigned long sum;
+	int i, b, cpu;
+
+	for (i = 0; i < OSPFS_NSTATS; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu(ospfs_stats, cpu).st_count[i];
+		seq_printf(m, "%s %lu\n", ospfs_stat_names[i], sum);
+	}
+	for (i = 0; i < OSPFS_NHISTS; i++) {
+		seq_printf(m, "%s_hist", ospfs_hist_names[i]);
+		for (b = 0; b < OSPFS_STAT_BUCKETS; b++) {
+			sum = 0;
+			for_each_possible_cpu(cpu)
+				sum += per_cpu(ospfs_stats, cpu).st_hist[i][b];
+			seq_printf(m, " %lu", sum);
+		}
+		seq_printf(m, "\n");
+	}
+	return 0;
+}
+
+static int
+ospfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ospfs_stats_show, NULL);
+}
+
+static struct file_operations ospfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ospfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+
+
+/*****************************************************************************
+ * TRACING
+ *
+ *   Trace events on the hot paths.  Setting bit E of the 'ospfs_trace'
+ *   module parameter (/sys/module/ospfs/parameters/ospfs_trace) turns on
+ *   event E; with it 0, as by default, each event point costs one test
+ *   of a global.  A recorded event goes to ospfs_trace_record(), which is
+ *   never inlined, so kprobes and SystemTap can attach there and see the
+ *   event number and arguments.  It also keeps the event in a per-CPU
+ *   ring of the last OSPFS_TRACE_NRECS events, which /proc/fs/ospfs_trace
+ *   prints, one event per line:
+ *
+ *	<time in ns> <cpu> <event name> <arg0> <arg1> <arg2>
+ *
+ *   Reading the file doesn't consume the events, and a ring being
+ *   written while it is printed may show a half-written event.
+ */
+
+enum {
+	OSPFS_TRACE_READ,		// ino, position, bytes read or -error
+	OSPFS_TRACE_WRITE,		// ino, position, bytes written or -error
+	OSPFS_TRACE_BLOCK_ALLOC,	// first block, number of blocks
+	OSPFS_TRACE_BLOCK_FREE,		// block, 1 if only a reference was dropped
+	OSPFS_TRACE_DIRENTRY_CREATE,	// directory ino, offset, ino
+	OSPFS_TRACE_DIRENTRY_LOOKUP,	// directory ino, offset or -1, probes
+	OSPFS_TRACE_JOURNAL_COMMIT,	// sequence number, blocks, ns taken
+	OSPFS_NTRACE
+};
+
+static const char *ospfs_trace_names[OSPFS_NTRACE] = {
+	"read", "write", "block_alloc", "block_free",
+	"direntry_create", "direntry_lookup", "journal_commit"
+};
+
+static unsigned int ospfs_trace;
+module_param(ospfs_trace, uint, 0644);
+MODULE_PARM_DESC(ospfs_trace, "Bitmask of trace events to record");
+
+#define OSPFS_TRACE_NRECS	1024
+
+typedef struct ospfs_trace_rec {
+	uint64_t tr_ns;
+	uint32_t tr_event;
+	int64_t tr_args[3];
+} ospfs_trace_rec_t;
+
+typedef struct ospfs_trace_ring {
+	unsigned long tr_next;		// Number of events ever recorded
+	ospfs_trace_rec_t tr_recs[OSPFS_TRACE_NRECS];
+} ospfs_trace_ring_t;
+
+// Allocated when the module is loaded; NULL if that failed
+static ospfs_trace_ring_t *ospfs_trace_rings;
+
+
+// ospfs_trace_event(event, a0, a1, a2)
+//	Records 'event' with arguments 'a0', 'a1' and 'a2', if it is on.
+
+#define ospfs_trace_event(event, a0, a1, a2)				\
+	do {								\
+		if (unlikely(ospfs_trace & (1U << (event))))		\
+			ospfs_trace_record((event), (a0), (a1), (a2));	\
+	} while (0)
+
+static noinline void
+ospfs_trace_record(int event, int64_t a0, int64_t a1, int64_t a2)
+{
+	ospfs_trace_ring_t *ring;
+	ospfs_trace_rec_t *rec;
+
+	if (!ospfs_trace_rings)
+		return;
+	ring = per_cpu_ptr(ospfs_trace_rings, get_cpu());
+	rec = &ring->tr_recs[ring->tr_next++ % OSPFS_TRACE_NRECS];
+	rec->tr_ns = ktime_to_ns(ktime_get());
+	rec->tr_event = event;
+	rec->tr_args[0] = a0;
+	rec->tr_args[1] = a1;
+	rec->tr_args[2] = a2;
+	put_cpu();
+}
+
+
+// ospfs_trace_show(m, v)
+//	Writes each CPU's recorded events, oldest first, to
+//	/proc/fs/ospfs_trace.
+
+static int
+ospfs_trace_show(struct seq_file *m, void *v)
+{
+	ospfs_trace_ring_t *ring;
+	ospfs_trace_rec_t *rec;
+	unsigned long i;
+	int cpu;
+
+	if (!ospfs_trace_rings)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(ospfs_trace_rings, cpu);
+		i = ring->tr_next > OSPFS_TRACE_NRECS ? ring->tr_next - OSPFS_TRACE_NRECS : 0;
+		for (; i < ring->tr_next; i++) {
+			rec = &ring->tr_recs[i % OSPFS_TRACE_NRECS];
+			if (rec->tr_event >= OSPFS_NTRACE)
+				continue;
+			seq_printf(m, "%llu %d %s %lld %lld %lld\n",
+				   (unsigned long long) rec->tr_ns, cpu,
+				   ospfs_trace_names[rec->tr_event],
+				   (long long) rec->tr_args[0], (long long) rec->tr_args[1],
+				   (long long) rec->tr_args[2]);
+		}
+	}
+	return 0;
+}
+
+static int
+ospfs_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ospfs_trace_show, NULL);
+}
+
+static struct file_operations ospfs_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ospfs_trace_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+
+
 /*****************************************************************************
  * BITVECTOR OPERATIONS
  *
@@ -119,6 +473,27 @@ bitvector_clear(void *vector, int i)
 	((uint32_t *) vector) [i / 32] &= ~(1 << (i % 32));
 }
 
+// bitvector_set_atomic, bitvector_clear_atomic -- Like bitvector_set and
+//	bitvector_clear, but safe against other CPUs changing other bits of
+//	the same word at the same time.
+static inline void
+bitvector_set_atomic(void *vector, int i)
+{
+	uint32_t *w = (uint32_t *) vector + i / 32, old;
+	do
+		old = *w;
+	while (cmpxchg(w, old, old | (1U << (i % 32))) != old);
+}
+
+static inline void
+bitvector_clear_atomic(void *vector, int i)
+{
+	uint32_t *w = (uint32_t *) vector + i / 32, old;
+	do
+		old = *w;
+	while (cmpxchg(w, old, old & ~(1U << (i % 32))) != old);
+}
+
 // bitvector_test -- Return the value of the 'i'th bit of 'vector'.
 static inline int
 bitvector_test(const void *vector, int i)
@@ -126,6 +501,29 @@ bitvector_test(const void *vector, int i)
 	return (((const uint32_t *) vector) [i / 32] & (1 << (i % 32))) != 0;
 }
 
+// bitvector_find_set -- Return the index of the first 1 bit in 'vector'
+//	at or after bit 'i', or 'nbits' if bits 'i' through 'nbits - 1' are
+//	all 0.  The vector is scanned 64 bits at a time, so 'vector' must be
+//	a whole number of 64-bit words long (bits past 'nbits' are ignored).
+static inline int
+bitvector_find_set(const void *vector, int i, int nbits)
+{
+	const uint64_t *w = (const uint64_t *) vector;
+	int wi = i / 64;
+	uint64_t cur;
+
+	if (i >= nbits)
+		return nbits;
+	cur = w[wi] & (~(uint64_t) 0 << (i % 64));
+	while (!cur) {
+		if (++wi * 64 >= nbits)
+			return nbits;
+		cur = w[wi];
+	}
+	i = wi * 64 + __builtin_ctzll(cur);
+	return i < nbits ? i : nbits;
+}
+
 
 
 /*****************************************************************************
@@ -145,19 +543,357 @@ ospfs_size2nblocks(uint32_t size)
 }
 
 
+// ospfs_sparse_packed(ptr)
+//	Returns nonzero if 'ptr' points into the packed blocks of a sparse
+//	image.
+
+static inline int
+ospfs_sparse_packed(const void *ptr)
+{
+	return (const uint8_t *) ptr >= ospfs_data
+		&& (const uint8_t *) ptr < ospfs_data + (ospfs_packed_nblocks << ospfs_sparse_bits);
+}
+
+
+// ospfs_sparse_group_page(group)
+//	Returns the address of the page holding the blocks of page-sized
+//	group 'group' that aren't packed, or 0 if it has none yet.
+
+static unsigned long
+ospfs_sparse_group_page(uint32_t group)
+{
+	unsigned int shift = PAGE_SHIFT - ospfs_sparse_bits;
+	uint32_t b;
+	uint8_t *data;
+
+	for (b = group << shift; b < (group + 1) << shift && b < ospfs_sparse_nblocks; b++)
+		if ((data = ospfs_blockmap[b]) && !ospfs_sparse_packed(data))
+			return (unsigned long) data & PAGE_MASK;
+	return 0;
+}
+
+
+// ospfs_sparse_page_group(addr)
+//	Returns the group whose page is at 'addr'.  The page must have come
+//	from ospfs_sparse_block().  Doesn't lock: a page is entered in the
+//	table before any pointer into it is published.
+
+static uint32_t
+ospfs_sparse_page_group(unsigned long addr)
+{
+	uint32_t mask = (1U << ospfs_sparse_pages_bits) - 1;
+	uint32_t h = hash_long(addr >> PAGE_SHIFT, ospfs_sparse_pages_bits), g;
+
+	smp_rmb();		// pairs with ospfs_sparse_block()
+	for (;; h = (h + 1) & mask)
+		if ((g = ospfs_sparse_pages[h])
+		    && ospfs_sparse_group_page(g - 1) == addr)
+			return g - 1;
+}
+
+
+// ospfs_sparse_block(blockno)
+//	Gives block 'blockno' of a sparse image memory of its own, zeroed.
+//	The memory is a page shared with the other blocks in the same
+//	page-sized group that don't have memory yet, entered in
+//	'ospfs_sparse_pages' so ospfs_ptr_blockno() can find block numbers.
+//	May sleep.  Only blocks that were free at mount come here, once they
+//	have been allocated, so atomic-context lookups never do.
+
+static void *
+ospfs_sparse_block(uint32_t blockno)
+{
+	unsigned int shift = PAGE_SHIFT - ospfs_sparse_bits;
+	uint32_t first = blockno & ~((1U << shift) - 1), last, b, h;
+	unsigned long addr = get_zeroed_page(GFP_NOFS | __GFP_NOFAIL);
+
+	last = min(first + (1U << shift), ospfs_sparse_nblocks);
+	spin_lock(&ospfs_blockmap_lock);
+	for (b = first; b < last && ospfs_blockmap[b]; b++)
+		/* nothing */;
+	if (b == last) {
+		// Another caller gave the group its page first
+		spin_unlock(&ospfs_blockmap_lock);
+		free_page(addr);
+		return ospfs_blockmap[blockno];
+	}
+	h = hash_long(addr >> PAGE_SHIFT, ospfs_sparse_pages_bits);
+	while (ospfs_sparse_pages[h])
+		h = (h + 1) & ((1U << ospfs_sparse_pages_bits) - 1);
+	ospfs_sparse_pages[h] = (first >> shift) + 1;
+	smp_wmb();		// the zeroes and the entry are visible before the pointers
+	for (; b < last; b++)
+		if (!ospfs_blockmap[b])
+			ospfs_blockmap[b] = (uint8_t *) addr + ((b - first) << ospfs_sparse_bits);
+	spin_unlock(&ospfs_blockmap_lock);
+	return ospfs_blockmap[blockno];
+}
+
+
+// ospfs_bdev_install(blockno, bh)
+//	Makes 'bh' block 'blockno's held buffer, unless it already has one,
+//	in which case 'bh' is released.  Returns the held buffer.
+
+static struct buffer_head *
+ospfs_bdev_install(uint32_t blockno, struct buffer_head *bh)
+{
+	struct buffer_head ***slot = &ospfs_bhs[blockno / OSPFS_BHS_PER];
+	struct buffer_head **page = NULL;
+
+	if (!*slot)
+		page = kzalloc(PAGE_SIZE, GFP_NOFS | __GFP_NOFAIL);
+	spin_lock(&ospfs_bhs_lock);
+	if (!*slot) {
+		smp_wmb();	// the NULLs are visible before the page
+		*slot = page;
+		page = NULL;
+	}
+	if (!(*slot)[blockno % OSPFS_BHS_PER]) {
+		smp_wmb();
+		(*slot)[blockno % OSPFS_BHS_PER] = bh;
+		bh = NULL;
+	}
+	spin_unlock(&ospfs_bhs_lock);
+	kfree(page);
+	if (bh)
+		brelse(bh);
+	return (*slot)[blockno % OSPFS_BHS_PER];
+}
+
+
+// ospfs_bdev_held(blockno)
+//	Returns block 'blockno's held buffer, or NULL if it hasn't been read.
+//	Takes no lock.
+
+static inline struct buffer_head *
+ospfs_bdev_held(uint32_t blockno)
+{
+	struct buffer_head **page = ospfs_bhs[blockno / OSPFS_BHS_PER], *bh;
+
+	if (!page)
+		return NULL;
+	smp_read_barrier_depends();
+	if ((bh = page[blockno % OSPFS_BHS_PER]))
+		smp_read_barrier_depends();
+	return bh;
+}
+
+
+// ospfs_bdev_bh(blockno)
+//	Returns block 'blockno's held buffer, reading it first if needed, or
+//	NULL if it can't be read.  Can sleep then, so a caller that can't
+//	must use blocks it has read before: directory lookups under RCU only
+//	reach blocks that were read when their index entries were made.
+
+static struct buffer_head *
+ospfs_bdev_bh(uint32_t blockno)
+{
+	struct buffer_head *bh;
+
+	if ((bh = ospfs_bdev_held(blockno)))
+		return bh;
+	if (!(bh = sb_bread(ospfs_bdev_sb, blockno))) {
+		eprintk("OSPFS: can't read block %u\n", blockno);
+		return NULL;
+	}
+	return ospfs_bdev_install(blockno, bh);
+}
+
+
 // ospfs_block(blockno)
-//	Use this function to load a block's contents from "disk".
+//	Use this function to load a block's contents from "disk".  In
+//	block-device mode, this reads the block and holds it until unmount,
+//	so it is meant for metadata; file data uses ospfs_data_get().
+//
+//	Only block-device mode can fail, and only for a block that isn't
+//	held yet.  The blocks below the first data block are held from
+//	mount, and an inode's indirect blocks (and a directory's data) from
+//	when its Linux inode is made (see ospfs_inode_pin), so the code that
+//	works on a file doesn't check for errors.
 //
 //   Input:   blockno -- block number
-//   Returns: a pointer to that block's data
+//   Returns: a pointer to that block's data, or NULL on a read error
 
 static void *
 ospfs_block(uint32_t blockno)
 {
+	struct buffer_head *bh;
+	uint8_t *data;
+
+	if (ospfs_bhs)
+		return (bh = ospfs_bdev_bh(blockno)) ? bh->b_data : NULL;
+	if (ospfs_blockmap) {
+		if (!(data = ospfs_blockmap[blockno]))
+			return ospfs_sparse_block(blockno);
+		smp_read_barrier_depends();
+		return data;
+	}
 	return &ospfs_data[blockno * OSPFS_BLKSIZE];
 }
 
 
+// ospfs_block_new(blockno)
+//	Like ospfs_block(), but for a metadata block whose old contents don't
+//	matter: returns it erased, without reading it from the disk.  Never
+//	fails.
+
+static void *
+ospfs_block_new(uint32_t blockno)
+{
+	struct buffer_head *bh;
+	void *data;
+
+	if (!ospfs_bhs) {
+		data = ospfs_block(blockno);
+		memset(data, 0, OSPFS_BLKSIZE);
+		return data;
+	}
+	if (!(bh = ospfs_bdev_held(blockno)))
+		bh = ospfs_bdev_install(blockno, sb_getblk(ospfs_bdev_sb, blockno));
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OSPFS_BLKSIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh->b_data;
+}
+
+
+// ospfs_ptr_blockno(ptr)
+//	Returns the number of the block that 'ptr' points into.  'ptr' must
+//	have come from ospfs_block().  In block-device mode the buffers live
+//	in the device's page cache, so the page index gives the block number.
+//	The pages of a sparse image are ours, and are looked up in
+//	'ospfs_sparse_pages'.
+
+static uint32_t
+ospfs_ptr_blockno(const void *ptr)
+{
+	if (ospfs_blockmap && ospfs_sparse_packed(ptr))
+		return ospfs_packed_blockno[((const uint8_t *) ptr - ospfs_data) >> OSPFS_BLKSIZE_BITS];
+	if (ospfs_blockmap)
+		return (ospfs_sparse_page_group((unsigned long) ptr & PAGE_MASK)
+			<< (PAGE_SHIFT - OSPFS_BLKSIZE_BITS))
+			+ offset_in_page(ptr) / OSPFS_BLKSIZE;
+	if (ospfs_bhs)
+		return (virt_to_page(ptr)->index << (PAGE_CACHE_SHIFT - OSPFS_BLKSIZE_BITS))
+			+ offset_in_page(ptr) / OSPFS_BLKSIZE;
+	return ((const uint8_t *) ptr - ospfs_data) / OSPFS_BLKSIZE;
+}
+
+
+// ospfs_blocks_contiguous()
+//	Returns nonzero if consecutive blocks are consecutive in memory, so a
+//	run of them can be copied or erased at once.  True in array mode,
+//	unless the image is sparse.
+
+static inline int
+ospfs_blocks_contiguous(void)
+{
+	return ospfs_bhs == NULL && ospfs_blockmap == NULL;
+}
+
+
+// ospfs_block_dirty(blockno)
+//	Call after changing block 'blockno', so that in block-device mode it
+//	is written back.  Journaled metadata blocks use ospfs_journal_dirty().
+
+static inline void
+ospfs_block_dirty(uint32_t blockno)
+{
+	struct buffer_head *bh;
+
+	if (ospfs_bhs && (bh = ospfs_bdev_bh(blockno)))
+		mark_buffer_dirty(bh);
+}
+
+
+// ospfs_data_get(blockno, bhp), ospfs_data_new(blockno, bhp)
+// ospfs_data_put(bh, dirty)
+//	Access a file data block.  ospfs_data_get() returns a pointer to
+//	block 'blockno's data, or NULL on a read error; ospfs_data_new()
+//	returns one to the block erased, without reading it, for a block that
+//	is about to be overwritten.  ospfs_data_put() must follow, with the
+//	buffer they set in '*bhp', and 'dirty' nonzero if the block changed.
+//	In block-device mode the block is only held in between; otherwise
+//	'*bhp' is NULL, and these just use ospfs_block().
+
+static void *
+ospfs_data_get(uint32_t blockno, struct buffer_head **bhp)
+{
+	*bhp = NULL;
+	if (!ospfs_bhs)
+		return ospfs_block(blockno);
+	if (!(*bhp = sb_bread(ospfs_bdev_sb, blockno)))
+		return NULL;
+	return (*bhp)->b_data;
+}
+
+static void *
+ospfs_data_new(uint32_t blockno, struct buffer_head **bhp)
+{
+	void *data;
+
+	*bhp = NULL;
+	if (!ospfs_bhs) {
+		data = ospfs_block(blockno);
+		memset(data, 0, OSPFS_BLKSIZE);
+		return data;
+	}
+	*bhp = sb_getblk(ospfs_bdev_sb, blockno);
+	lock_buffer(*bhp);
+	memset((*bhp)->b_data, 0, OSPFS_BLKSIZE);
+	set_buffer_uptodate(*bhp);
+	unlock_buffer(*bhp);
+	return (*bhp)->b_data;
+}
+
+static inline void
+ospfs_data_put(struct buffer_head *bh, int dirty)
+{
+	if (bh) {
+		if (dirty)
+			mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+}
+
+
+// ospfs_sync_disk()
+//	In block-device mode, writes every dirty block to the disk and waits.
+
+static inline void
+ospfs_sync_disk(void)
+{
+	if (ospfs_bhs)
+		sync_blockdev(ospfs_bdev_sb->s_bdev);
+}
+
+
+// ospfs_block_write(blockno), ospfs_block_wait(blockno)
+//	In block-device mode, start writing block 'blockno' to the disk now,
+//	and wait for that write to finish.  Used to order journal writes.
+
+static inline void
+ospfs_block_write(uint32_t blockno)
+{
+	struct buffer_head *bh;
+
+	if (ospfs_bhs && (bh = ospfs_bdev_bh(blockno))) {
+		mark_buffer_dirty(bh);
+		ll_rw_block(SWRITE, 1, &bh);
+	}
+}
+
+static inline void
+ospfs_block_wait(uint32_t blockno)
+{
+	struct buffer_head *bh;
+
+	if (ospfs_bhs && (bh = ospfs_bdev_bh(blockno)))
+		wait_on_buffer(bh);
+}
+
+
 // ospfs_inode(ino)
 //	Use this function to load a 'ospfs_inode' structure from "disk".
 //
@@ -170,8 +906,19 @@ ospfs_inode(ino_t ino)
 	ospfs_inode_t *oi;
 	if (ino >= ospfs_super->os_ninodes)
 		return 0;
-	oi = ospfs_block(ospfs_super->os_firstinob);
-	return &oi[ino];
+	oi = ospfs_block(ospfs_super->os_firstinob + ino / OSPFS_BLKINODES);
+	return &oi[ino % OSPFS_BLKINODES];
+}
+
+
+// ospfs_inode_inline(oi)
+//	Returns nonzero iff regular file 'oi' keeps its data in the inode
+//	(see INLINE DATA in ospfs.h).
+
+static inline int
+ospfs_inode_inline(ospfs_inode_t *oi)
+{
+	return oi->oi_ftype == OSPFS_FTYPE_REG && (oi->oi_mode & OSPFS_MODE_INLINE);
 }
 
 
@@ -182,49 +929,195 @@ ospfs_inode(ino_t ino)
 //   Inputs:  oi     -- pointer to a OSPFS inode
 //	      offset -- byte offset into that inode
 //   Returns: the block number of the block that contains the 'offset'th byte
-//	      of the file
+//	      of the file, or 0 if that byte is in a hole (see SPARSE FILES
+//	      below), past the end of the file, or stored in the inode
 
 static inline uint32_t
 ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
 {
 	uint32_t blockno = offset / OSPFS_BLKSIZE;
-	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK
+	    || ospfs_inode_inline(oi))
 		return 0;
 	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
-		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
-		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
+		uint32_t *indirect2_block, *indirect_block;
+		if (oi->oi_indirect2 == 0)
+			return 0;
+		indirect2_block = ospfs_block(oi->oi_indirect2);
+		if (indirect2_block[blockoff / OSPFS_NINDIRECT] == 0)
+			return 0;
+		indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
 		return indirect_block[blockoff % OSPFS_NINDIRECT];
 	} else if (blockno >= OSPFS_NDIRECT) {
-		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
+		uint32_t *indirect_block;
+		if (oi->oi_indirect == 0)
+			return 0;
+		indirect_block = ospfs_block(oi->oi_indirect);
 		return indirect_block[blockno - OSPFS_NDIRECT];
 	} else
 		return oi->oi_direct[blockno];
 }
 
 
-// ospfs_inode_data(oi, offset)
-//	Use this function to load part of inode's data from "disk",
-//	where 'offset' is relative to the first byte of inode data.
+// Block-map cursors
+//	Each open regular file keeps an 'ospfs_bmap_cursor' in the
+//	'ospfs_open_file' at its 'filp->private_data'.  The cursor remembers the last indirect block
+//	ospfs_cursor_blockno() resolved and the file block its first pointer
+//	maps, so sequential access past the direct blocks costs one array
+//	load per block instead of a walk down from the inode.
 //
-//   Inputs:  oi     -- pointer to a OSPFS inode
-//	      offset -- byte offset into 'oi's data contents
-//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
+//	Indirect blocks only change identity when they are freed, so
+//	remove_block() bumps 'ospfs_bmap_generation' whenever it frees one;
+//	a cursor from an older generation is ignored.
 //
-//	Be careful: the returned pointer is only valid within a single block.
-//	This function is a simple combination of 'ospfs_inode_blockno'
-//	and 'ospfs_block'.
+//	Several reads of one open file can run at once (pread(2) on a shared
+//	file descriptor), each holding ii_sem only shared.  So ospfs_read and
+//	ospfs_write work on a copy of the cursor on their stack, taken and
+//	stored back under the open file's 'of_lock'.
 
-static inline void *
-ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+typedef struct ospfs_bmap_cursor {
+	uint32_t bc_base;	// File block mapped by bc_ptrs[0]; 0 if empty
+	uint32_t *bc_ptrs;	// The cached indirect block
+	uint32_t bc_gen;	// ospfs_bmap_generation when filled in
+} ospfs_bmap_cursor_t;
+
+typedef struct ospfs_open_file {
+	spinlock_t of_lock;		// Guards of_cursor
+	ospfs_bmap_cursor_t of_cursor;	// Left by the last read or write
+} ospfs_open_file_t;
+
+static uint32_t ospfs_bmap_generation;
+
+
+// ospfs_cursor_get(filp, cur), ospfs_cursor_put(filp, cur)
+//	Copy open file 'filp's block-map cursor into 'cur', and store 'cur'
+//	back as the cursor.
+
+static inline void
+ospfs_cursor_get(struct file *filp, ospfs_bmap_cursor_t *cur)
 {
-	uint32_t blockno = ospfs_inode_blockno(oi, offset);
-	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
+	ospfs_open_file_t *of = filp->private_data;
+
+	spin_lock(&of->of_lock);
+	*cur = of->of_cursor;
+	spin_unlock(&of->of_lock);
 }
 
+static inline void
+ospfs_cursor_put(struct file *filp, const ospfs_bmap_cursor_t *cur)
+{
+	ospfs_open_file_t *of = filp->private_data;
 
-/*****************************************************************************
- * LOW-LEVEL FILE SYSTEM FUNCTIONS
+	spin_lock(&of->of_lock);
+	of->of_cursor = *cur;
+	spin_unlock(&of->of_lock);
+}
+
+
+// ospfs_cursor_blockno(oi, offset, cur)
+//	Like ospfs_inode_blockno, but consults and updates the block-map
+//	cursor 'cur'.  A seek outside the cached indirect block just falls
+//	back to a full lookup.  'cur' may be NULL.
+
+static inline uint32_t
+ospfs_cursor_blockno(ospfs_inode_t *oi, uint32_t offset, ospfs_bmap_cursor_t *cur)
+{
+	uint32_t blockno = offset / OSPFS_BLKSIZE;
+	uint32_t *indirect_block;
+
+	if (!cur || blockno < OSPFS_NDIRECT)
+		return ospfs_inode_blockno(oi, offset);
+	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK
+	    || ospfs_inode_inline(oi))
+		return 0;
+
+	if (cur->bc_base && cur->bc_gen == ospfs_bmap_generation
+	    && blockno - cur->bc_base < OSPFS_NINDIRECT)
+		return cur->bc_ptrs[blockno - cur->bc_base];
+
+	if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
+		uint32_t *indirect2_block;
+		if (oi->oi_indirect2 == 0)
+			return 0;
+		indirect2_block = ospfs_block(oi->oi_indirect2);
+		if (indirect2_block[blockoff / OSPFS_NINDIRECT] == 0)
+			return 0;
+		indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
+		cur->bc_base = blockno - blockoff % OSPFS_NINDIRECT;
+	} else {
+		if (oi->oi_indirect == 0)
+			return 0;
+		indirect_block = ospfs_block(oi->oi_indirect);
+		cur->bc_base = OSPFS_NDIRECT;
+	}
+	cur->bc_ptrs = indirect_block;
+	cur->bc_gen = ospfs_bmap_generation;
+	return indirect_block[blockno - cur->bc_base];
+}
+
+
+// ospfs_inode_data(oi, offset)
+//	Use this function to load part of inode's data from "disk",
+//	where 'offset' is relative to the first byte of inode data.
+//
+//   Inputs:  oi     -- pointer to a OSPFS inode
+//	      offset -- byte offset into 'oi's data contents
+//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
+//
+//	Be careful: the returned pointer is only valid within a single block.
+//	This function is a simple combination of 'ospfs_inode_blockno'
+//	and 'ospfs_block'.
+
+static inline void *
+ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+{
+	uint32_t blockno = ospfs_inode_blockno(oi, offset);
+	uint8_t *data = ospfs_block(blockno);
+	return data ? data + (offset % OSPFS_BLKSIZE) : NULL;
+}
+
+
+// ospfs_inode_pin(oi, data)
+//	In block-device mode, reads inode 'oi's indirect blocks and holds
+//	them, so that ospfs_block() can't fail on them later; if 'data' is
+//	set, its data blocks too.  Called before anything else works on the
+//	inode: when its Linux inode is made, and for the journal at mount.
+//
+//   Returns: 0 on success, -EIO if a block can't be read or the inode
+//	      points outside the file system.
+
+static int
+ospfs_inode_pin(ospfs_inode_t *oi, int data)
+{
+	uint32_t *indirect2, nblocks = ospfs_super->os_nblocks, off, b;
+
+	if (!ospfs_bhs || oi->oi_ftype == OSPFS_FTYPE_SYMLINK || ospfs_inode_inline(oi))
+		return 0;
+	if (oi->oi_indirect
+	    && (oi->oi_indirect >= nblocks || !ospfs_block(oi->oi_indirect)))
+		return -EIO;
+	if (oi->oi_indirect2) {
+		if (oi->oi_indirect2 >= nblocks
+		    || !(indirect2 = ospfs_block(oi->oi_indirect2)))
+			return -EIO;
+		for (b = 0; b < OSPFS_NINDIRECT; b++)
+			if (indirect2[b]
+			    && (indirect2[b] >= nblocks || !ospfs_block(indirect2[b])))
+				return -EIO;
+	}
+	if (data)
+		for (off = 0; off < oi->oi_size; off += OSPFS_BLKSIZE)
+			if ((b = ospfs_inode_blockno(oi, off))
+			    && (b >= nblocks || !ospfs_block(b)))
+				return -EIO;
+	return 0;
+}
+
+
+/*****************************************************************************
+ * LOW-LEVEL FILE SYSTEM FUNCTIONS
  * There are no exercises in this section, and you don't need to understand
  * the code.
  */
@@ -235,12 +1128,16 @@ ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
 //	notion of inodes on disk, and for such file systems, Linux's
 //	'struct inode's are like a cache of on-disk inodes.
 //
-//	This function takes an inode number for the OSPFS and constructs
-//	and returns the corresponding Linux 'struct inode'.
+//	This function takes an inode number for the OSPFS and returns the
+//	corresponding Linux 'struct inode'.  It comes from Linux's inode
+//	cache if it is there, so all the names of a file share one inode,
+//	and so one page cache; otherwise it is constructed, and the OSPFS
+//	inode's metadata blocks are read (see ospfs_inode_pin).
 //
 //   Inputs:  sb  -- the relevant Linux super_block structure (one per mount)
 //	      ino -- OSPFS inode number
-//   Returns: 'struct inode'
+//   Returns: 'struct inode', or NULL if 'ino' is out of range or the
+//	      inode's blocks can't be read
 
 static struct inode *
 ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
@@ -250,8 +1147,16 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 
 	if (!oi)
 		return 0;
-	if (!(inode = new_inode(sb)))
+	if (!(inode = iget_locked(sb, ino)))
 		return 0;
+	if (!(inode->i_state & I_NEW))
+		return inode;
+	if (ospfs_inode_pin(oi, oi->oi_ftype == OSPFS_FTYPE_DIR) < 0) {
+		make_bad_inode(inode);
+		unlock_new_inode(inode);
+		iput(inode);
+		return 0;
+	}
 
 	inode->i_ino = ino;
 	// Make it look like everything was created by root.
@@ -260,9 +1165,10 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 
 	if (oi->oi_ftype == OSPFS_FTYPE_REG) {
 		// Make an inode for a regular file.
-		inode->i_mode = oi->oi_mode | S_IFREG;
+		inode->i_mode = (oi->oi_mode & ~OSPFS_MODE_INLINE) | S_IFREG;
 		inode->i_op = &ospfs_reg_inode_ops;
 		inode->i_fop = &ospfs_reg_file_ops;
+		inode->i_mapping->a_ops = &ospfs_aops;
 		inode->i_nlink = oi->oi_nlink;
 
 	} else if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
@@ -285,79 +1191,1674 @@ ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
 
 	// Access and modification times are now.
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
+	unlock_new_inode(inode);
 	return inode;
 }
 
 
-// ospfs_fill_super, ospfs_get_sb
+// ospfs_super_check(os, bits, size)
+//	Checks whether 'os', read from block 1 assuming blocks of 2^'bits'
+//	bytes, is the superblock of an OSPFS with that block size that fits in
+//	'size' blocks.  The free-block bitmap, inode blocks, and
+//	reference-count map must follow each other inside the file system,
+//	so that a crafted image can't send ospfs_inode() and ospfs_refcount()
+//	past its end.
+//
+//   Returns: the file system's size in blocks, or 0 if 'os' isn't such a
+//	      superblock.
+
+static uint32_t
+ospfs_super_check(const ospfs_super_t *os, unsigned int bits, uint32_t size)
+{
+	unsigned int os_bits = os->os_blksize_bits ? : OSPFS_BLKSIZE_BITS_MIN;
+	uint64_t freemap_end, inodes_end;
+
+	if (os->os_magic != OSPFS_MAGIC || os_bits != bits
+	    || os->os_nblocks <= OSPFS_FREEMAP_BLK || os->os_nblocks > size
+	    || os->os_ninodes <= OSPFS_ROOT_INO)
+		return 0;
+
+	freemap_end = OSPFS_FREEMAP_BLK
+		+ (((uint64_t) os->os_nblocks + (8U << bits) - 1) >> (bits + 3));
+	inodes_end = os->os_firstinob
+		+ (((uint64_t) os->os_ninodes * OSPFS_INODESIZE + (1U << bits) - 1) >> bits);
+	if (os->os_firstinob < freemap_end || inodes_end > os->os_nblocks)
+		return 0;
+	if (os->os_refmapb
+	    && (os->os_refmapb < inodes_end
+		|| os->os_refmapb + (((uint64_t) os->os_nblocks * sizeof(uint32_t)
+				      + (1U << bits) - 1) >> bits) > os->os_nblocks))
+		return 0;
+	return os->os_nblocks;
+}
+
+
+// ospfs_sparse_init()
+//	Sets up array mode for a sparse image, the first time it is mounted:
+//	builds 'ospfs_blockmap' from the image's runs and checks the
+//	superblock.  The blocks below the first data block, and the data
+//	blocks the bitmap marks allocated, get memory now; the rest are free
+//	and get it when they are first used.
+//
+//   Returns: 0 on success, -EINVAL if the image isn't an OSPFS,
+//	      -ENOMEM if out of memory.
+
+static int
+ospfs_sparse_init(void)
+{
+	unsigned int bits;
+	uint8_t **blockmap;
+	uint32_t *packed_blockno, *pages;
+	uint32_t nblocks, npacked = 0, ngroups, first, r, b;
+	unsigned int pages_bits;
+
+	if (ospfs_blockmap) {
+		ospfs_blksize_bits = ospfs_sparse_bits;
+		ospfs_super = (ospfs_super_t *) ospfs_blockmap[1];
+		return 0;
+	}
+
+	for (bits = OSPFS_BLKSIZE_BITS_MIN; bits <= OSPFS_BLKSIZE_BITS_MAX; bits++)
+		if ((1U << bits) == ospfs_sparse_blksize)
+			break;
+	if (bits > OSPFS_BLKSIZE_BITS_MAX || bits > PAGE_SHIFT)
+		goto bad;
+	nblocks = ospfs_length >> bits;
+	for (r = 0; r < ospfs_sparse_nruns; r++) {
+		first = ospfs_sparse_runs[2*r];
+		if (first >= nblocks || ospfs_sparse_runs[2*r + 1] > nblocks - first)
+			goto bad;
+		npacked += ospfs_sparse_runs[2*r + 1];
+	}
+	if (npacked == 0)
+		goto bad;
+	// The page table is at most half full
+	ngroups = (nblocks + (1U << (PAGE_SHIFT - bits)) - 1) >> (PAGE_SHIFT - bits);
+	pages_bits = fls(ngroups) + 1;
+
+	if (!(blockmap = ospfs_big_alloc(nblocks * sizeof(uint8_t *))))
+		return -ENOMEM;
+	if (!(packed_blockno = ospfs_big_alloc(npacked * sizeof(uint32_t)))) {
+		ospfs_big_free(blockmap, nblocks * sizeof(uint8_t *));
+		return -ENOMEM;
+	}
+	if (!(pages = ospfs_big_alloc(sizeof(uint32_t) << pages_bits))) {
+		ospfs_big_free(packed_blockno, npacked * sizeof(uint32_t));
+		ospfs_big_free(blockmap, nblocks * sizeof(uint8_t *));
+		return -ENOMEM;
+	}
+	memset(blockmap, 0, nblocks * sizeof(uint8_t *));
+	memset(pages, 0, sizeof(uint32_t) << pages_bits);
+	npacked = 0;
+	for (r = 0; r < ospfs_sparse_nruns; r++)
+		for (b = ospfs_sparse_runs[2*r];
+		     b < ospfs_sparse_runs[2*r] + ospfs_sparse_runs[2*r + 1]; b++) {
+			blockmap[b] = &ospfs_data[npacked << bits];
+			packed_blockno[npacked++] = b;
+		}
+
+	if (!blockmap[1]
+	    || !ospfs_super_check((ospfs_super_t *) blockmap[1], bits, nblocks)) {
+		ospfs_big_free(pages, sizeof(uint32_t) << pages_bits);
+		ospfs_big_free(packed_blockno, npacked * sizeof(uint32_t));
+		ospfs_big_free(blockmap, nblocks * sizeof(uint8_t *));
+		goto bad;
+	}
+
+	ospfs_blockmap = blockmap;
+	ospfs_packed_blockno = packed_blockno;
+	ospfs_packed_nblocks = npacked;
+	ospfs_sparse_pages = pages;
+	ospfs_sparse_pages_bits = pages_bits;
+	ospfs_sparse_nblocks = nblocks;
+	ospfs_blksize_bits = ospfs_sparse_bits = bits;
+	ospfs_super = (ospfs_super_t *) blockmap[1];
+
+	// Everything in use gets memory now, so later lookups, some of
+	// which can't sleep, find it
+	for (b = 0; b < ospfs_super->os_nblocks; b++)
+		if (b < ospfs_first_datab()
+		    || !bitvector_test(ospfs_freemap(b / OSPFS_BLKBITSIZE), b % OSPFS_BLKBITSIZE))
+			(void) ospfs_block(b);
+	return 0;
+
+    bad:
+	eprintk("OSPFS: no file system found in the compiled-in image\n");
+	return -EINVAL;
+}
+
+
+// ospfs_sparse_destroy()
+//	Frees a sparse image's pages and tables.  Called when the module is
+//	unloaded.
+
+static void
+ospfs_sparse_destroy(void)
+{
+	unsigned int per = 1U << (PAGE_SHIFT - ospfs_sparse_bits);
+	uint32_t g, b;
+
+	if (!ospfs_blockmap)
+		return;
+	// A page-sized group of blocks shares at most one page
+	for (g = 0; g < ospfs_sparse_nblocks; g += per)
+		for (b = g; b < g + per && b < ospfs_sparse_nblocks; b++)
+			if (ospfs_blockmap[b] && !ospfs_sparse_packed(ospfs_blockmap[b])) {
+				free_page((unsigned long) ospfs_blockmap[b] & PAGE_MASK);
+				break;
+			}
+	ospfs_big_free(ospfs_sparse_pages, sizeof(uint32_t) << ospfs_sparse_pages_bits);
+	ospfs_big_free(ospfs_packed_blockno, ospfs_packed_nblocks * sizeof(uint32_t));
+	ospfs_big_free(ospfs_blockmap, ospfs_sparse_nblocks * sizeof(uint8_t *));
+	ospfs_blockmap = NULL;
+}
+
+
+// ospfs_array_init()
+//	Sets up array mode: finds the superblock of the image in 'ospfs_data'
+//	and its block size.
+//
+//   Returns: 0 on success, -EINVAL if the array doesn't hold an OSPFS.
+
+static int
+ospfs_array_init(void)
+{
+	unsigned int bits;
+
+	if (ospfs_sparse_blksize)
+		return ospfs_sparse_init();
+	for (bits = OSPFS_BLKSIZE_BITS_MIN;
+	     bits <= OSPFS_BLKSIZE_BITS_MAX && bits <= PAGE_CACHE_SHIFT; bits++)
+		if ((2U << bits) <= ospfs_length
+		    && ospfs_super_check((ospfs_super_t *) &ospfs_data[1 << bits],
+					 bits, ospfs_length >> bits)) {
+			ospfs_blksize_bits = bits;
+			ospfs_super = (ospfs_super_t *) &ospfs_data[1 << bits];
+			return 0;
+		}
+	eprintk("OSPFS: no file system found in the compiled-in image\n");
+	return -EINVAL;
+}
+
+
+// ospfs_bdev_destroy()
+//	Leaves block-device mode, releasing the held buffers.  Dirty buffers
+//	are written back by the kernel as usual.
+
+static void
+ospfs_bdev_destroy(void)
+{
+	uint32_t i, j;
+
+	if (!ospfs_bhs)
+		return;
+	for (i = 0; i < ospfs_bhs_nslots; i++) {
+		if (!ospfs_bhs[i])
+			continue;
+		for (j = 0; j < OSPFS_BHS_PER; j++)
+			if (ospfs_bhs[i][j])
+				brelse(ospfs_bhs[i][j]);
+		kfree(ospfs_bhs[i]);
+	}
+	ospfs_big_free(ospfs_bhs, ospfs_bhs_nslots * sizeof(struct buffer_head **));
+	ospfs_bhs = NULL;
+	ospfs_bdev_sb = NULL;
+	ospfs_super = NULL;
+}
+
+
+// ospfs_bdev_init(sb)
+//	Sets up block-device mode for 'sb', whose device holds an OSPFS image
+//	(for instance, one written by ospfsformat and copied with dd).  Reads
+//	the blocks below the first data block -- the superblock, bitmap,
+//	inodes, and reference counts, which are used under spinlocks -- into
+//	the buffer cache, and holds them there until ospfs_bdev_destroy().
+//	Other blocks are read when they are used.
+//
+//   Returns: 0 on success, -EINVAL if the device doesn't hold an OSPFS,
+//	      -EIO on a read error, -ENOMEM if out of memory.
+
+static int
+ospfs_bdev_init(struct super_block *sb)
+{
+	struct buffer_head *bh;
+	unsigned int bits;
+	uint32_t nblocks = 0, b;
+
+	// The superblock is in block 1, wherever that is for the block size
+	for (bits = OSPFS_BLKSIZE_BITS_MIN; bits <= OSPFS_BLKSIZE_BITS_MAX; bits++) {
+		if (bits > PAGE_CACHE_SHIFT || !sb_set_blocksize(sb, 1 << bits))
+			break;
+		if (!(bh = sb_bread(sb, 1)))
+			return -EIO;
+		nblocks = ospfs_super_check((ospfs_super_t *) bh->b_data, bits,
+					    i_size_read(sb->s_bdev->bd_inode) >> bits);
+		brelse(bh);
+		if (nblocks)
+			break;
+	}
+	if (!nblocks) {
+		eprintk("OSPFS: no file system found on device\n");
+		return -EINVAL;
+	}
+	ospfs_blksize_bits = bits;
+
+	ospfs_bhs_nslots = (nblocks + OSPFS_BHS_PER - 1) / OSPFS_BHS_PER;
+	if (!(ospfs_bhs = ospfs_big_alloc(ospfs_bhs_nslots * sizeof(struct buffer_head **))))
+		return -ENOMEM;
+	memset(ospfs_bhs, 0, ospfs_bhs_nslots * sizeof(struct buffer_head **));
+	ospfs_bdev_sb = sb;
+
+	// The superblock first, since it says where the data blocks begin
+	if (!(bh = sb_bread(sb, 1)))
+		goto eio;
+	ospfs_super = (ospfs_super_t *) ospfs_bdev_install(1, bh)->b_data;
+	for (b = 0; b < ospfs_first_datab(); b++)
+		if (b != 1) {
+			if (!(bh = sb_bread(sb, b)))
+				goto eio;
+			ospfs_bdev_install(b, bh);
+		}
+	return 0;
+
+    eio:
+	ospfs_bdev_destroy();
+	return -EIO;
+}
+
+
+// ospfs_fill_super, ospfs_get_sb, ospfs_kill_sb
 //	These functions are called by Linux when the user mounts a version of
 //	the OSPFS onto some directory.  They help construct a Linux
 //	'struct super_block' for that file system.
+//
+//	Mounting "none" (or any name that isn't a path) mounts the image
+//	compiled into the module; mounting a path, like /dev/sdb1, mounts the
+//	OSPFS on that block device.  The module keeps its state in globals,
+//	so only one OSPFS can be mounted at a time: bit 0 of 'ospfs_mounted'
+//	is set while one is, or is being mounted.
+
+static unsigned long ospfs_mounted;
 
 static int
 ospfs_fill_super(struct super_block *sb, void *data, int flags)
 {
 	struct inode *root_inode;
+	int r = -ENOMEM;
+
+	if (test_and_set_bit(0, &ospfs_mounted)) {
+		eprintk("OSPFS: only one OSPFS can be mounted at a time\n");
+		r = -EBUSY;
+		goto fail;
+	}
+
+	if ((r = sb->s_bdev ? ospfs_bdev_init(sb) : ospfs_array_init()) < 0)
+		goto fail_mode;
+	r = -ENOMEM;
 
 	sb->s_blocksize = OSPFS_BLKSIZE;
 	sb->s_blocksize_bits = OSPFS_BLKSIZE_BITS;
 	sb->s_magic = OSPFS_MAGIC;
+	sb->s_maxbytes = OSPFS_MAXFILESIZE;
 	sb->s_op = &ospfs_superblock_ops;
 
+	// Bring the metadata up to date from the journal, then build the
+	// in-memory allocator and inode state
+	if (DESIGNPROJECT_JOURNAL && (r = ospfs_journal_replay()) < 0)
+		goto fail_freemap;
+	r = -ENOMEM;
+	if (ospfs_freemap_init() < 0)
+		goto fail_freemap;
+	if (ospfs_icache_init() < 0)
+		goto fail_icache;
+	if (ospfs_inomap_init() < 0)
+		goto fail_inomap;
+	if (DESIGNPROJECT_JOURNAL)
+		ospfs_journal_init(sb);
+
 	if (!(root_inode = ospfs_mk_linux_inode(sb, OSPFS_ROOT_INO))
 	    || !(sb->s_root = d_alloc_root(root_inode))) {
 		iput(root_inode);
-		sb->s_dev = 0;
-		return -ENOMEM;
+		goto fail_root;
 	}
 
 	return 0;
+
+    fail_root:
+	ospfs_journal_destroy();
+	ospfs_inomap_destroy();
+    fail_inomap:
+	ospfs_icache_destroy();
+    fail_icache:
+	ospfs_freemap_destroy();
+    fail_freemap:
+	ospfs_bdev_destroy();
+    fail_mode:
+	clear_bit(0, &ospfs_mounted);
+    fail:
+	sb->s_dev = 0;
+	return r;
+}
+
+// ospfs_put_super
+//	Called by Linux when the file system is unmounted.  Releases the
+//	in-memory state built by ospfs_fill_super.
+
+static void
+ospfs_put_super(struct super_block *sb)
+{
+	ospfs_journal_destroy();
+	ospfs_inomap_destroy();
+	ospfs_icache_destroy();
+	ospfs_freemap_destroy();
+	ospfs_bdev_destroy();
+	clear_bit(0, &ospfs_mounted);
+}
+
+// ospfs_write_super, ospfs_sync_fs
+//	Called by Linux to write back a dirty superblock, periodically and on
+//	sync(2).  They commit the journal's running transaction.
+
+static void
+ospfs_write_super(struct super_block *sb)
+{
+	ospfs_journal_flush();
+	sb->s_dirt = 0;
+}
+
+static int
+ospfs_sync_fs(struct super_block *sb, int wait)
+{
+	ospfs_journal_flush();
+	if (wait)
+		ospfs_sync_disk();
+	return 0;
 }
 
 static int
 ospfs_get_sb(struct file_system_type *fs_type, int flags, const char *dev_name, void *data, struct vfsmount *mount)
 {
+	if (dev_name && dev_name[0] == '/')
+		return get_sb_bdev(fs_type, flags, dev_name, data, ospfs_fill_super, mount);
 	return get_sb_single(fs_type, flags, data, ospfs_fill_super, mount);
 }
 
+static void
+ospfs_kill_sb(struct super_block *sb)
+{
+	if (sb->s_bdev)
+		kill_block_super(sb);
+	else
+		kill_anon_super(sb);
+	// Run the directory index's pending RCU callbacks, and free what
+	// they retire
+	rcu_barrier();
+	dir_index_reap();
+}
+
 
 // ospfs_delete_dentry
-//	Another bookkeeping function.
+//	Another bookkeeping function.  Called when the last reference to a
+//	dentry goes away; returning nonzero frees it at once.  Names of files
+//	stay in the dcache, so later path walks find them without calling
+//	ospfs_dir_lookup.  All of a file's names share its 'struct inode'
+//	(see ospfs_mk_linux_inode), and changes go through it, so the cached
+//	inode stays current.  Negative dentries are dropped.
 
 static int
 ospfs_delete_dentry(struct dentry *dentry)
 {
-	return 1;
+	return dentry->d_inode == NULL;
 }
 
 
 /*****************************************************************************
- * DIRECTORY OPERATIONS
+ * IN-MEMORY INODE STATE
  *
- * EXERCISE: Finish 'ospfs_dir_readdir' and 'ospfs_symlink'.
+ *   All the names of a file share one Linux 'struct inode' (see
+ *   ospfs_mk_linux_inode), which Linux keeps in its inode cache while a
+ *   dentry or an open file refers to it.  After that Linux may drop it,
+ *   and the next lookup builds it again from the OSPFS inode.  So what we
+ *   must remember about an OSPFS inode for longer -- its lock, its
+ *   directory index, how many times it is open -- lives here instead: a
+ *   table indexed by OSPFS inode number, built at mount time and freed at
+ *   unmount.
+ *
+ *   LOCKING.  Each inode's 'ii_sem' guards its size, block pointers, link
+ *   count and data; for a directory, also its direntries and index.
+ *   Readers and lookups hold it shared, so readers never contend with
+ *   each other, and readers of different files share no lock at all.
+ *   Changes hold it exclusive.  Below the inode locks, the free-block
+ *   bitmap, the free-inode stack and the journal each have their own lock.
+ *   Locks are taken in this order:
+ *
+ *	page lock -> directory ii_sem -> file ii_sem
+ *		-> ospfs_freemap_mutex -> ospfs_journal_mutex
+ *
+ *   with ospfs_inomap_lock, a spinlock, innermost.  Because writeback
+ *   takes page locks, ospfs_read and ospfs_write only touch the page cache
+ *   while they don't hold ii_sem.
+ *
+ *   Lookups through a directory's index take no lock at all: the index is
+ *   read under RCU (see DIRECTORY INDEX below).
  */
 
-// ospfs_dir_lookup(dir, dentry, ignore)
-//	This function implements the "lookup" directory operation, which
-//	looks up a named entry.
-//
-//	We have written this function for you.
-//
-//   Input:  dir    -- The Linux 'struct inode' for the directory.
-//		       You can extract the corresponding 'ospfs_inode_t'
-//		       by calling 'ospfs_inode' with the relevant inode number.
-//	     dentry -- The name of the entry being looked up.
-//   Effect: Looks up the entry named 'dentry'.  If found, attaches the
-//	     entry's 'struct inode' to the 'dentry'.  If not found, returns
-//	     a "negative dentry", which has no inode attachment.
+typedef struct ospfs_dir_index ospfs_dir_index_t;
 
-static struct dentry *
-ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ignore)
+typedef struct ospfs_inode_info {
+	struct rw_semaphore ii_sem;	// See LOCKING above
+	ospfs_dir_index_t *ii_dir;	// Directory hash index, or NULL
+	uint32_t ii_nopen;		// Number of open files on this inode
+} ospfs_inode_info_t;
+
+static ospfs_inode_info_t *ospfs_icache;
+
+static void dir_index_free(ospfs_dir_index_t *di);
+
+
+// ospfs_big_alloc(size), ospfs_big_free(ptr, size)
+//	Allocate and free tables that may be too big for kmalloc.
+
+static void *
+ospfs_big_alloc(size_t size)
 {
-	// Find the OSPFS inode corresponding to 'dir'
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	struct inode *entry_inode = NULL;
-	int entry_off;
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void
+ospfs_big_free(void *ptr, size_t size)
+{
+	if (size <= PAGE_SIZE)
+		kfree(ptr);
+	else
+		vfree(ptr);
+}
+
+
+// ospfs_icache_init(), ospfs_icache_destroy()
+//	Create and free the in-memory inode table.  Called at mount and
+//	unmount time.
+
+static int
+ospfs_icache_init(void)
+{
+	size_t size = ospfs_super->os_ninodes * sizeof(ospfs_inode_info_t);
+	uint32_t ino;
+
+	if (!(ospfs_icache = ospfs_big_alloc(size)))
+		return -ENOMEM;
+	memset(ospfs_icache, 0, size);
+	for (ino = 0; ino < ospfs_super->os_ninodes; ino++)
+		init_rwsem(&ospfs_icache[ino].ii_sem);
+	return 0;
+}
+
+static void
+ospfs_icache_destroy(void)
+{
+	uint32_t ino;
+
+	if (!ospfs_icache)
+		return;
+	for (ino = 0; ino < ospfs_super->os_ninodes; ino++)
+		dir_index_free(ospfs_icache[ino].ii_dir);
+	ospfs_big_free(ospfs_icache, ospfs_super->os_ninodes * sizeof(ospfs_inode_info_t));
+	ospfs_icache = NULL;
+}
+
+
+// ospfs_inode_ino(oi)
+//	Returns the inode number of the OSPFS inode 'oi'.
+
+static inline ino_t
+ospfs_inode_ino(ospfs_inode_t *oi)
+{
+	uint32_t blockno = ospfs_ptr_blockno(oi);
+	ospfs_inode_t *block = ospfs_block(blockno);
+	return (blockno - ospfs_super->os_firstinob) * OSPFS_BLKINODES + (oi - block);
+}
+
+
+// ospfs_inode_info(ino)
+//	Returns the in-memory state for inode 'ino', which must be valid.
+
+static inline ospfs_inode_info_t *
+ospfs_inode_info(ino_t ino)
+{
+	return &ospfs_icache[ino];
+}
+
+
+
+/*****************************************************************************
+ * JOURNAL
+ *
+ *   Metadata changes -- to the free-block bitmap, inodes, indirect blocks,
+ *   and directory blocks -- are logged to the redo journal in
+ *   OSPFS_JOURNAL_INODE (see ospfs.h for the format).  File data is not
+ *   logged.
+ *
+ *   An operation that changes metadata brackets its work with
+ *   ospfs_journal_begin(credits) and ospfs_journal_end(), and calls
+ *   ospfs_journal_dirty() on each metadata block before or after changing
+ *   it.  The bracket is a handle on the running transaction, kept in
+ *   current->journal_info; 'credits' is the most blocks the operation may
+ *   add to the transaction.  Begin reserves them, waiting for a commit if
+ *   the transaction has no room, so an operation is not split across
+ *   transactions.  Brackets nest; an inner begin only tops the handle's
+ *   credits up.  Changes whose size has no bound -- growing or truncating
+ *   a file by many blocks -- call ospfs_journal_extend() between steps
+ *   that leave the metadata consistent.  If the transaction has no room
+ *   left at such a point, the handle is restarted: the steps so far
+ *   commit, and the rest go into the next transaction.
+ *
+ *   Operations are group-committed: the blocks they dirty collect in one
+ *   running transaction, whose commit window closes when an operation
+ *   ends and finds that it has reached 'ospfs_commit_blocks' blocks or
+ *   'ospfs_commit_ops' operations, or that it is older than
+ *   'ospfs_commit_ms' milliseconds.  The transaction is then locked, and
+ *   written to the log once the operations still running in it finish.
+ *   A block dirtied by many operations in the window is logged once.
+ *   Until then the superblock is marked dirty, so the kernel's periodic
+ *   write_super, sync(2), fsync(2), and unmount all flush the running
+ *   transaction (see ospfs_journal_flush()).
+ *
+ *   The home blocks are changed in place, so whoever persists the image
+ *   need only save the journal after each commit, and the home blocks
+ *   when the log is checkpointed.  On a block device, the kernel does
+ *   this: a logged block's buffer is only marked dirty once its
+ *   transaction's commit block is on the disk.  A commit that leaves too
+ *   little room in the log for another transaction checkpoints it.  No
+ *   handle is open then, so the home blocks hold only committed changes:
+ *   they are written to the disk, and the log restarts.  Until then, a
+ *   block in the log isn't allocated again, since replay would overwrite
+ *   its new contents, which may be file data that isn't logged; nor is a
+ *   block freed in the running transaction, which will be in the log.
+ *   ospfs_journal_replay() brings the home blocks up to date from the log
+ *   at mount time.
+ *
+ *   'ospfs_journal_mutex' guards the journal's state.  It is only held
+ *   inside the functions below, so operations on different files run
+ *   concurrently and share the running transaction.  'ospfs_txn_handles'
+ *   counts their handles, and a transaction only commits when it has
+ *   none.  One that runs out of room is locked: new handles wait, and
+ *   the last running handle to finish commits it.  Since handles can
+ *   wait for each other this way, an operation takes its ii_sem locks
+ *   before it begins its handle, never while holding one.
+ */
+
+#define OSPFS_JOURNAL_NBLOCKS	128	// Size of a newly created journal
+
+static ospfs_inode_t *ospfs_journal_oi;	// The journal inode, or NULL if
+					// journaling is off
+static uint32_t ospfs_journal_head;	// Next free log block
+static uint32_t ospfs_journal_seq;	// Next transaction sequence number
+static uint32_t *ospfs_journal_logged;	// Bit b set iff block b is in the log
+static uint32_t *ospfs_txn_member;	// Bit b set iff block b is in the
+					// running transaction
+static int ospfs_journal_want_checkpoint; // Set when allocation skipped
+					// logged blocks and failed
+
+// ospfs_journal_logged and ospfs_txn_member share one allocation.
+static inline size_t
+ospfs_journal_bitmap_words(void)
+{
+	return (ospfs_super->os_nblocks + 31) / 32;
+}
+
+static inline size_t
+ospfs_journal_logged_size(void)
+{
+	return 2 * ospfs_journal_bitmap_words() * sizeof(uint32_t);
+}
+
+static uint32_t ospfs_txn_blocknos[OSPFS_JOURNAL_MAXTAGS]; // Dirty blocks
+static uint32_t ospfs_txn_nblocks;	// Number of dirty blocks
+static uint32_t ospfs_txn_max;		// Dirty blocks allowed per transaction
+static uint32_t ospfs_txn_credits;	// Blocks reserved by open handles
+static int ospfs_txn_handles;		// Handles open in the transaction
+static int ospfs_txn_locked;		// Set while it waits for them to finish
+static uint32_t ospfs_txn_nops;		// Operations in the running transaction
+static unsigned long ospfs_txn_start;	// When it dirtied its first block
+static struct super_block *ospfs_journal_sb; // Marked dirty while a
+					// transaction is running
+static DEFINE_MUTEX(ospfs_journal_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(ospfs_journal_waitq); // Woken after a commit
+
+// ospfs_handle_t
+//	A task's handle on the running transaction, from its outermost
+//	ospfs_journal_begin() to the matching ospfs_journal_end().
+typedef struct ospfs_handle {
+	int h_ref;			// Open brackets
+	uint32_t h_credits;		// Blocks it may still add
+} ospfs_handle_t;
+
+// Credits, in blocks, for the operations below.  One step of a size
+// change -- a block added or removed, or a run of up to OSPFS_NINDIRECT
+// new blocks -- dirties the inode block, an indirect^2 block, at most two
+// indirect blocks, and the bitmap or reference-count blocks of what it
+// allocates or frees: at most two for the data blocks, and one for each
+// of up to three indirect blocks.
+#define OSPFS_CREDITS_STEP	10
+#define OSPFS_CREDITS_INODE	1	// One inode
+#define OSPFS_CREDITS_DIRENT	(OSPFS_CREDITS_STEP + 2) // A new direntry and
+					// its directory's inode
+#define OSPFS_CREDITS_CREATE	(OSPFS_CREDITS_DIRENT + 1) // ... and its inode
+#define OSPFS_CREDITS_UNLINK	3	// A direntry, its inode, and the
+					// start of free_inode
+
+// Commit window; see above.  ospfs_commit_ops = 1 commits every operation.
+static unsigned int ospfs_commit_blocks = OSPFS_JOURNAL_MAXTAGS / 2;
+static unsigned int ospfs_commit_ops = 1024;
+static unsigned int ospfs_commit_ms = 5000;
+module_param(ospfs_commit_blocks, uint, 0644);
+MODULE_PARM_DESC(ospfs_commit_blocks, "Commit the journal after this many dirty blocks");
+module_param(ospfs_commit_ops, uint, 0644);
+MODULE_PARM_DESC(ospfs_commit_ops, "Commit the journal after this many operations");
+module_param(ospfs_commit_ms, uint, 0644);
+MODULE_PARM_DESC(ospfs_commit_ms, "Commit the journal after this many milliseconds");
+
+// Delayed allocation: writes don't erase new blocks they will fill.
+static unsigned int ospfs_delalloc = 1;
+module_param(ospfs_delalloc, uint, 0644);
+MODULE_PARM_DESC(ospfs_delalloc, "Don't erase new blocks that a write fills");
+
+
+// ospfs_journal_block(k)
+//	Returns a pointer to the k'th block of the journal, or NULL if the
+//	journal inode has no such block.
+
+static void *
+ospfs_journal_block(ospfs_inode_t *joi, uint32_t k)
+{
+	uint32_t blockno = ospfs_inode_blockno(joi, k * OSPFS_BLKSIZE);
+	return blockno ? ospfs_block(blockno) : NULL;
+}
+
+
+// journal_write(k), journal_wait(k)
+//	Start writing the k'th journal block to the disk, and wait for the
+//	write to finish.  (No-ops in array mode; see ospfs_block_write.)
+
+static inline void
+journal_write(uint32_t k)
+{
+	ospfs_block_write(ospfs_inode_blockno(ospfs_journal_oi, k * OSPFS_BLKSIZE));
+}
+
+static inline void
+journal_wait(uint32_t k)
+{
+	ospfs_block_wait(ospfs_inode_blockno(ospfs_journal_oi, k * OSPFS_BLKSIZE));
+}
+
+
+// ospfs_journal_valid(joi)
+//	Returns the journal superblock of 'joi' if it holds a journal whose
+//	blocks are all present, NULL otherwise.
+
+static ospfs_journal_super_t *
+ospfs_journal_valid(ospfs_inode_t *joi)
+{
+	ospfs_journal_super_t *js;
+	uint32_t nblocks = joi->oi_size / OSPFS_BLKSIZE;
+
+	if (ospfs_super->os_ninodes <= OSPFS_JOURNAL_INODE
+	    || joi->oi_nlink == 0 || joi->oi_ftype != OSPFS_FTYPE_REG
+	    || nblocks < 4 || !(js = ospfs_journal_block(joi, 0))
+	    || js->js_magic != OSPFS_JOURNAL_MAGIC || js->js_nblocks != nblocks
+	    || !ospfs_journal_block(joi, nblocks - 1))
+		return NULL;
+	return js;
+}
+
+
+// journal_txn_crc(desc, joi, pos)
+//	Returns the CRC of the transaction whose descriptor 'desc' is at log
+//	block 'pos'.  The caller has checked that its blocks are in the log.
+
+static uint32_t
+journal_txn_crc(ospfs_journal_desc_t *desc, ospfs_inode_t *joi, uint32_t pos)
+{
+	uint32_t crc = crc32_le(~0, (unsigned char *) desc, OSPFS_BLKSIZE);
+	uint32_t i;
+
+	for (i = 0; i < desc->jd_nblocks; i++)
+		crc = crc32_le(crc, ospfs_journal_block(joi, pos + 1 + i), OSPFS_BLKSIZE);
+	return crc;
+}
+
+
+// journal_checkpoint()
+//	Restarts the log.  The home blocks already hold everything in it; on
+//	a block device, they are written to the disk first.  The caller holds
+//	ospfs_journal_mutex, and no handle is open, so the home blocks hold
+//	no uncommitted changes.
+
+static void
+journal_checkpoint(void)
+{
+	ospfs_journal_super_t *js = ospfs_journal_block(ospfs_journal_oi, 0);
+
+	ospfs_sync_disk();
+	js->js_seq = ospfs_journal_seq;
+	journal_write(0);
+	journal_wait(0);
+	ospfs_journal_head = 1;
+	memset(ospfs_journal_logged, 0, ospfs_journal_bitmap_words() * sizeof(uint32_t));
+}
+
+
+// ospfs_journal_busy(blockno)
+//	Returns nonzero if block 'blockno' is in the log, or was dirtied as
+//	metadata in the running transaction (and has since been freed), so
+//	it can't be allocated until the next checkpoint.  Called without
+//	ospfs_journal_mutex, by allocators inside handles: the log only
+//	changes in commits, which run when no handle is open, and a block's
+//	transaction bit is set before the block can be freed.
+
+static inline int
+ospfs_journal_busy(uint32_t blockno)
+{
+	return ospfs_journal_logged
+		&& (bitvector_test(ospfs_journal_logged, blockno)
+		    || bitvector_test(ospfs_txn_member, blockno));
+}
+
+
+// journal_commit()
+//	Writes the dirty blocks to the log as one transaction, and starts a
+//	new, empty transaction.
+//
+//	On a block device, the descriptor and logged blocks reach the disk
+//	before the commit block, and the commit block before the home blocks
+//	are marked dirty; so a crash leaves either the old metadata or a
+//	complete transaction to replay.  Then, if the log is too full for
+//	another transaction, or an allocator found only logged blocks free,
+//	checkpoints it.  The caller holds ospfs_journal_mutex, and no handle
+//	is open.
+
+static void
+journal_commit(void)
+{
+	ospfs_inode_t *joi = ospfs_journal_oi;
+	ospfs_journal_desc_t *desc;
+	ospfs_journal_commit_t *commit;
+	uint32_t crc, i;
+	ktime_t start_time;
+
+	if (ospfs_txn_nblocks == 0)
+		return;
+	start_time = ktime_get();
+
+	desc = ospfs_journal_block(joi, ospfs_journal_head);
+	memset(desc, 0, OSPFS_BLKSIZE);
+	desc->jd_magic = OSPFS_JOURNAL_MAGIC;
+	desc->jd_type = OSPFS_JOURNAL_DESC;
+	desc->jd_seq = ospfs_journal_seq;
+	desc->jd_nblocks = ospfs_txn_nblocks;
+	memcpy(desc->jd_blocknos, ospfs_txn_blocknos, ospfs_txn_nblocks * sizeof(uint32_t));
+	crc = crc32_le(~0, (unsigned char *) desc, OSPFS_BLKSIZE);
+	journal_write(ospfs_journal_head);
+
+	for (i = 0; i < ospfs_txn_nblocks; i++) {
+		void *data = ospfs_journal_block(joi, ospfs_journal_head + 1 + i);
+		memcpy(data, ospfs_block(ospfs_txn_blocknos[i]), OSPFS_BLKSIZE);
+		crc = crc32_le(crc, data, OSPFS_BLKSIZE);
+		bitvector_set(ospfs_journal_logged, ospfs_txn_blocknos[i]);
+		bitvector_clear(ospfs_txn_member, ospfs_txn_blocknos[i]);
+		journal_write(ospfs_journal_head + 1 + i);
+	}
+	for (i = 0; i <= ospfs_txn_nblocks; i++)
+		journal_wait(ospfs_journal_head + i);
+
+	commit = ospfs_journal_block(joi, ospfs_journal_head + 1 + ospfs_txn_nblocks);
+	memset(commit, 0, OSPFS_BLKSIZE);
+	commit->jc_magic = OSPFS_JOURNAL_MAGIC;
+	commit->jc_type = OSPFS_JOURNAL_COMMIT;
+	commit->jc_seq = ospfs_journal_seq;
+	commit->jc_crc = crc;
+	journal_write(ospfs_journal_head + 1 + ospfs_txn_nblocks);
+	journal_wait(ospfs_journal_head + 1 + ospfs_txn_nblocks);
+
+	for (i = 0; i < ospfs_txn_nblocks; i++)
+		ospfs_block_dirty(ospfs_txn_blocknos[i]);
+	ospfs_trace_event(OSPFS_TRACE_JOURNAL_COMMIT, ospfs_journal_seq, ospfs_txn_nblocks,
+			  ktime_to_ns(ktime_sub(ktime_get(), start_time)));
+
+	ospfs_journal_head += ospfs_txn_nblocks + 2;
+	ospfs_journal_seq++;
+	ospfs_txn_nblocks = 0;
+	ospfs_txn_nops = 0;
+	if (ospfs_journal_sb)
+		ospfs_journal_sb->s_dirt = 0;
+
+	if (ospfs_journal_head + ospfs_txn_max + 2 > joi->oi_size / OSPFS_BLKSIZE
+	    || ospfs_journal_want_checkpoint) {
+		ospfs_journal_want_checkpoint = 0;
+		journal_checkpoint();
+	}
+}
+
+
+// journal_commit_locked()
+//	Commits a locked transaction, unlocks it, and wakes the tasks waiting
+//	to begin handles.  The caller holds ospfs_journal_mutex, and the
+//	transaction has no open handles.
+
+static void
+journal_commit_locked(void)
+{
+	journal_commit();
+	ospfs_txn_locked = 0;
+	wake_up_all(&ospfs_journal_waitq);
+}
+
+
+// journal_attach(h, credits), journal_detach(h, endop)
+//	Add handle 'h' to the running transaction with 'credits' blocks
+//	reserved, and take it out again.  Attaching waits while the
+//	transaction is locked, or hasn't room for the credits; then it locks
+//	the transaction, so the handles already in it finish and commit.
+//	Detaching gives back the unused credits.  If 'endop' is set, the
+//	handle's operation is over, and if the commit window has closed, the
+//	transaction is locked.  The last handle to leave a locked
+//	transaction commits it.
+
+static void
+journal_attach(ospfs_handle_t *h, uint32_t credits)
+{
+	mutex_lock(&ospfs_journal_mutex);
+	while (ospfs_txn_locked
+	       || ospfs_txn_nblocks + ospfs_txn_credits + credits > ospfs_txn_max) {
+		if (ospfs_txn_handles == 0) {
+			journal_commit_locked();
+			continue;
+		}
+		ospfs_txn_locked = 1;
+		mutex_unlock(&ospfs_journal_mutex);
+		wait_event(ospfs_journal_waitq, !ospfs_txn_locked);
+		mutex_lock(&ospfs_journal_mutex);
+	}
+	ospfs_txn_handles++;
+	ospfs_txn_credits += credits;
+	h->h_credits = credits;
+	mutex_unlock(&ospfs_journal_mutex);
+}
+
+static void
+journal_detach(ospfs_handle_t *h, int endop)
+{
+	mutex_lock(&ospfs_journal_mutex);
+	ospfs_txn_credits -= h->h_credits;
+	h->h_credits = 0;
+	ospfs_txn_handles--;
+	if (endop && ospfs_txn_nblocks > 0)
+		ospfs_txn_nops++;
+
+	if (endop && ospfs_txn_nblocks > 0
+	    && (ospfs_txn_nblocks >= ospfs_commit_blocks
+		|| ospfs_txn_nops >= ospfs_commit_ops
+		|| time_after_eq(jiffies, ospfs_txn_start + msecs_to_jiffies(ospfs_commit_ms))))
+		ospfs_txn_locked = 1;
+
+	if (ospfs_txn_handles == 0 && ospfs_txn_locked)
+		journal_commit_locked();
+	else if (ospfs_txn_nblocks > 0 && ospfs_journal_sb)
+		ospfs_journal_sb->s_dirt = 1;
+	mutex_unlock(&ospfs_journal_mutex);
+}
+
+
+// ospfs_journal_begin(credits), ospfs_journal_end()
+//	Bracket an operation whose metadata changes should commit together,
+//	and which dirties at most 'credits' blocks.  They nest; an inner
+//	begin makes sure the handle has 'credits' left, restarting it if
+//	need be (see ospfs_journal_extend).  When the last open bracket
+//	closes, the operation is done with the running transaction, which
+//	commits if its window is closed.  Both do nothing if journaling is
+//	off.  May sleep.
+
+static void
+ospfs_journal_begin(uint32_t credits)
+{
+	ospfs_handle_t *h = current->journal_info;
+
+	if (!ospfs_journal_oi)
+		return;
+	if (h) {
+		h->h_ref++;
+		ospfs_journal_extend(credits);
+		return;
+	}
+	h = kmalloc(sizeof(ospfs_handle_t), GFP_NOFS | __GFP_NOFAIL);
+	h->h_ref = 1;
+	journal_attach(h, credits);
+	current->journal_info = h;
+}
+
+static void
+ospfs_journal_end(void)
+{
+	ospfs_handle_t *h = current->journal_info;
+
+	if (!h || --h->h_ref > 0)
+		return;
+	current->journal_info = NULL;
+	journal_detach(h, 1);
+	kfree(h);
+}
+
+
+// ospfs_journal_extend(credits)
+//	Makes sure the current handle may dirty 'credits' more blocks.  If
+//	the running transaction can't spare them, restarts the handle: the
+//	operation's changes so far commit with the transaction, and the rest
+//	go into a new one.  So callers only extend where the metadata is
+//	consistent.  Does nothing outside a handle.  May sleep.
+
+static void
+ospfs_journal_extend(uint32_t credits)
+{
+	ospfs_handle_t *h = current->journal_info;
+
+	if (!h || h->h_credits >= credits)
+		return;
+
+	mutex_lock(&ospfs_journal_mutex);
+	if (!ospfs_txn_locked
+	    && ospfs_txn_nblocks + ospfs_txn_credits + credits - h->h_credits <= ospfs_txn_max) {
+		ospfs_txn_credits += credits - h->h_credits;
+		h->h_credits = credits;
+		mutex_unlock(&ospfs_journal_mutex);
+		return;
+	}
+	mutex_unlock(&ospfs_journal_mutex);
+
+	journal_detach(h, 0);
+	journal_attach(h, credits);
+}
+
+
+// ospfs_journal_flush()
+//	Commits the running transaction: locks it, and waits for the
+//	operations still in it to finish.  Does nothing inside a handle,
+//	which would wait for itself.  May sleep.
+
+static void
+ospfs_journal_flush(void)
+{
+	mutex_lock(&ospfs_journal_mutex);
+	if (!ospfs_journal_oi || ospfs_txn_nblocks == 0)
+		goto out;
+	if (ospfs_txn_handles == 0)
+		journal_commit_locked();
+	else if (!current->journal_info) {
+		ospfs_txn_locked = 1;
+		mutex_unlock(&ospfs_journal_mutex);
+		wait_event(ospfs_journal_waitq, !ospfs_txn_locked);
+		return;
+	}
+    out:
+	mutex_unlock(&ospfs_journal_mutex);
+}
+
+
+// ospfs_journal_dirty(ptr)
+//	Adds the metadata block containing 'ptr' to the current task's
+//	handle's transaction, using one of its credits.  Outside a handle, or
+//	if journaling is off, just marks the block dirty (see
+//	ospfs_block_dirty).  Never commits: the transaction holds the
+//	handle's changes until it ends.  A block already in the transaction
+//	costs nothing and takes no lock, so callers needn't batch their
+//	calls for the same block; the transaction can't commit under the
+//	open handle, so the block's bit stays set.
+
+static void
+ospfs_journal_dirty(const void *ptr)
+{
+	ospfs_handle_t *h = current->journal_info;
+	uint32_t blockno = ospfs_ptr_blockno(ptr);
+
+	if (!ospfs_journal_oi || !h) {
+		ospfs_block_dirty(blockno);
+		return;
+	}
+	if (bitvector_test(ospfs_txn_member, blockno))
+		return;
+
+	mutex_lock(&ospfs_journal_mutex);
+	if (bitvector_test(ospfs_txn_member, blockno))
+		goto out;
+
+	// An operation that dirties more than it reserved borrows what the
+	// transaction can spare.  If it can't, the block goes unjournaled:
+	// that is a bug in the operation's credits.
+	if (h->h_credits == 0) {
+		if (ospfs_txn_nblocks + ospfs_txn_credits >= ospfs_txn_max) {
+			eprintk("OSPFS: journal handle out of credits for block %u\n", blockno);
+			ospfs_block_dirty(blockno);
+			goto out;
+		}
+		ospfs_txn_credits++;
+		h->h_credits++;
+	}
+	h->h_credits--;
+	ospfs_txn_credits--;
+	if (ospfs_txn_nblocks == 0)
+		ospfs_txn_start = jiffies;
+	ospfs_txn_blocknos[ospfs_txn_nblocks++] = blockno;
+	bitvector_set(ospfs_txn_member, blockno);
+
+    out:
+	mutex_unlock(&ospfs_journal_mutex);
+}
+
+
+// ospfs_journal_replay()
+//	Copies the blocks of every committed transaction in the log to their
+//	homes, then restarts the log.  Called at mount time, before anything
+//	else reads the metadata.
+//
+//   Returns: 0 on success, -EIO if the journal can't be read.
+
+static int
+ospfs_journal_replay(void)
+{
+	ospfs_inode_t *joi = ospfs_inode(OSPFS_JOURNAL_INODE);
+	ospfs_journal_super_t *js;
+	uint32_t pos = 1, seq, ntxns = 0;
+
+	if (!joi || joi->oi_nlink == 0)
+		return 0;
+	if (ospfs_inode_pin(joi, 1) < 0) {
+		eprintk("OSPFS: can't read the journal\n");
+		return -EIO;
+	}
+	if (!(js = ospfs_journal_valid(joi)))
+		return 0;
+
+	for (seq = js->js_seq; pos + 2 <= js->js_nblocks; seq++, ntxns++) {
+		ospfs_journal_desc_t *desc = ospfs_journal_block(joi, pos);
+		ospfs_journal_commit_t *commit;
+		uint32_t i;
+
+		if (desc->jd_magic != OSPFS_JOURNAL_MAGIC
+		    || desc->jd_type != OSPFS_JOURNAL_DESC
+		    || desc->jd_seq != seq
+		    || desc->jd_nblocks > OSPFS_JOURNAL_MAXTAGS
+		    || pos + desc->jd_nblocks + 2 > js->js_nblocks)
+			break;
+
+		commit = ospfs_journal_block(joi, pos + 1 + desc->jd_nblocks);
+		if (commit->jc_magic != OSPFS_JOURNAL_MAGIC
+		    || commit->jc_type != OSPFS_JOURNAL_COMMIT
+		    || commit->jc_seq != seq
+		    || journal_txn_crc(desc, joi, pos) != commit->jc_crc)
+			break;
+
+		for (i = 0; i < desc->jd_nblocks; i++)
+			if (desc->jd_blocknos[i] < OSPFS_FREEMAP_BLK
+			    || desc->jd_blocknos[i] >= ospfs_super->os_nblocks)
+				break;
+		if (i < desc->jd_nblocks) {
+			eprintk("OSPFS: journal transaction %u is corrupt\n", seq);
+			break;
+		}
+
+		for (i = 0; i < desc->jd_nblocks; i++) {
+			memcpy(ospfs_block_new(desc->jd_blocknos[i]),
+			       ospfs_journal_block(joi, pos + 1 + i), OSPFS_BLKSIZE);
+			ospfs_block_dirty(desc->jd_blocknos[i]);
+		}
+		pos += desc->jd_nblocks + 2;
+	}
+
+	if (ntxns) {
+		eprintk("OSPFS: replayed %u journal transactions\n", ntxns);
+		ospfs_sync_disk();
+		js->js_seq = seq;
+		ospfs_block_dirty(ospfs_ptr_blockno(js));
+		ospfs_sync_disk();
+	}
+	return 0;
+}
+
+
+// ospfs_journal_init(sb)
+//	Turns on journaling, creating the journal if the image has none.
+//	Called at mount time, after ospfs_journal_replay() and
+//	ospfs_freemap_init().  If the journal can't be created, the file
+//	system runs without one.
+
+static void
+ospfs_journal_init(struct super_block *sb)
+{
+	ospfs_inode_t *joi;
+	ospfs_journal_super_t *js;
+	uint32_t nblocks;
+
+	ospfs_journal_oi = NULL;
+	ospfs_journal_sb = sb;
+	ospfs_txn_nblocks = 0;
+	ospfs_txn_nops = 0;
+	ospfs_txn_credits = 0;
+	ospfs_txn_handles = 0;
+	ospfs_txn_locked = 0;
+	ospfs_journal_want_checkpoint = 0;
+	if (ospfs_super->os_ninodes <= OSPFS_JOURNAL_INODE)
+		return;
+	joi = ospfs_inode(OSPFS_JOURNAL_INODE);
+
+	if (!(js = ospfs_journal_valid(joi))) {
+		if (joi->oi_nlink != 0) {
+			eprintk("OSPFS: inode %u is not a journal; journaling is off\n",
+				OSPFS_JOURNAL_INODE);
+			return;
+		}
+		memset(joi, 0, sizeof(ospfs_inode_t));
+		joi->oi_nlink = 1;
+		joi->oi_ftype = OSPFS_FTYPE_REG;
+		if (change_size(joi, OSPFS_JOURNAL_NBLOCKS * OSPFS_BLKSIZE) < 0
+		    || ospfs_inode_pin(joi, 1) < 0) {
+			eprintk("OSPFS: no room for a journal; journaling is off\n");
+			change_size(joi, 0);
+			memset(joi, 0, sizeof(ospfs_inode_t));
+			return;
+		}
+		js = ospfs_journal_block(joi, 0);
+		js->js_magic = OSPFS_JOURNAL_MAGIC;
+		js->js_nblocks = OSPFS_JOURNAL_NBLOCKS;
+		js->js_seq = 1;
+		ospfs_block_dirty(ospfs_ptr_blockno(js));
+		// The journal must be on the disk before anything is logged
+		ospfs_sync_disk();
+	}
+
+	if (!(ospfs_journal_logged = ospfs_big_alloc(ospfs_journal_logged_size()))) {
+		eprintk("OSPFS: out of memory; journaling is off\n");
+		return;
+	}
+	memset(ospfs_journal_logged, 0, ospfs_journal_logged_size());
+	ospfs_txn_member = ospfs_journal_logged + ospfs_journal_bitmap_words();
+
+	nblocks = js->js_nblocks;
+	// Cap a transaction at a quarter of the log, so several commits
+	// fit between checkpoints
+	ospfs_txn_max = (nblocks - 3) / 4 < OSPFS_JOURNAL_MAXTAGS ? (nblocks - 3) / 4 : OSPFS_JOURNAL_MAXTAGS;
+	if (ospfs_txn_max < OSPFS_CREDITS_CREATE) {
+		eprintk("OSPFS: journal too small; journaling is off\n");
+		ospfs_big_free(ospfs_journal_logged, ospfs_journal_logged_size());
+		ospfs_journal_logged = NULL;
+		return;
+	}
+	ospfs_journal_seq = js->js_seq;
+	ospfs_journal_head = 1;
+	ospfs_journal_oi = joi;
+}
+
+
+// ospfs_journal_destroy()
+//	Commits anything outstanding, checkpoints, and turns journaling off.
+//	Called at unmount time.
+
+static void
+ospfs_journal_destroy(void)
+{
+	if (ospfs_journal_oi) {
+		journal_commit();
+		journal_checkpoint();
+		ospfs_big_free(ospfs_journal_logged, ospfs_journal_logged_size());
+	}
+	ospfs_journal_logged = NULL;
+	ospfs_txn_member = NULL;
+	ospfs_journal_oi = NULL;
+	ospfs_journal_sb = NULL;
+}
+
+
+
+/*****************************************************************************
+ * DIRECTORY INDEX
+ *
+ *   Looking a name up in a directory would otherwise mean comparing it
+ *   against every direntry.  Instead, the first lookup in a directory
+ *   builds a hash table that maps each live name to the byte offset of its
+ *   direntry.  Directories never shrink, so offsets stay valid; the
+ *   functions that fill in or clear direntries keep the table up to date.
+ *   The table holds no copies of names: a hash match is confirmed against
+ *   the direntry itself.
+ *
+ *   The index also counts the directory's holes (blank direntries inside
+ *   oi_size) and remembers a lower bound on the offset of the first one,
+ *   so create_blank_direntry can append without scanning when there are
+ *   no holes, and find a hole without rescanning the live entries before
+ *   it when there are.
+ *
+ *   If memory runs out, the table is dropped and lookups fall back to a
+ *   linear scan until it can be rebuilt.
+ *
+ *   Lookups read the table under rcu_read_lock(), without the directory's
+ *   ii_sem; changes still hold ii_sem exclusive.  So a reader must never
+ *   see a half-made change:
+ *   - New entries are published with hlist_add_head_rcu() after their
+ *     direntry is filled in, and removed entries are freed only after a
+ *     grace period.
+ *   - The table is never rehashed in place.  Growing it builds a new copy
+ *     and publishes that at 'ii_dir'; dropping it clears 'ii_dir'.  The
+ *     old copy is retired with call_rcu(), rather than waiting for a
+ *     grace period under ii_sem and inside a journal handle.  Since
+ *     freeing it may sleep, the RCU callback only queues it, and the
+ *     next dir_index_replace() or unmount frees it.
+ *   - A direntry's name is written before its inode number, and read
+ *     after (see ospfs_fill_direntry and direntry_name_eq).
+ *   The direntry blocks themselves stay put while a lookup runs, because
+ *   the VFS holds the directory's i_mutex across lookups and rmdir.  So
+ *   the lookups that reach ospfs_dir_lookup run one at a time per
+ *   directory: they skip ii_sem, and don't wait for writers holding it,
+ *   but they can't skip i_mutex.  Most path walks never get here, since
+ *   names that exist stay in the dcache (see ospfs_delete_dentry); only
+ *   the first lookup of a name, and lookups of missing names, do.
+ */
+
+#define OSPFS_DIR_INDEX_MINBUCKETS	64	// Must be a power of two
+
+struct ospfs_dir_index {
+	uint32_t di_nbuckets;		// Number of hash buckets (power of 2)
+	uint32_t di_nentries;		// Number of names in the table
+	struct hlist_head *di_buckets;
+	uint32_t di_nholes;		// Number of blank direntries
+	uint32_t di_first_hole;		// No hole has a smaller offset
+	struct rcu_head di_rcu;		// For retiring after lookups finish
+	struct ospfs_dir_index *di_retired_next; // Next retired index
+};
+
+typedef struct ospfs_dir_hent {
+	struct hlist_node dh_link;
+	uint32_t dh_hash;		// full_name_hash() of the name
+	uint32_t dh_off;		// Offset of the direntry in the directory
+	struct rcu_head dh_rcu;		// For freeing after lookups finish
+} ospfs_dir_hent_t;
+
+
+// direntry_namelen(od)
+//	Returns the length of direntry 'od's name.
+//
+// direntry_name_eq(od, name, namelen)
+//	Returns nonzero iff 'od' is a live direntry named 'name'.
+//	'namelen' must be at most OSPFS_MAXNAMELEN.
+//
+// direntry_ftype(od, namelen)
+//	Returns direntry 'od's cached file type, or
+//	OSPFS_DIRENTRY_FTYPE_UNKNOWN if it has none: a name of
+//	OSPFS_MAXNAMELEN bytes leaves no room for one (see ospfs.h).
+//	'namelen' is the length of its name.
+
+static inline int
+direntry_namelen(const ospfs_direntry_t *od)
+{
+	return strnlen(od->od_name, OSPFS_MAXNAMELEN);
+}
+
+
+static inline int
+direntry_name_eq(const ospfs_direntry_t *od, const char *name, int namelen)
+{
+	if (!od->od_ino)
+		return 0;
+	smp_rmb();		// Pairs with ospfs_fill_direntry
+	return (namelen == OSPFS_MAXNAMELEN || od->od_name[namelen] == '\0')
+		&& memcmp(od->od_name, name, namelen) == 0;
+}
+
+
+static inline uint8_t
+direntry_ftype(const ospfs_direntry_t *od, int namelen)
+{
+	return namelen < OSPFS_MAXNAMELEN ? od->od_ftype : OSPFS_DIRENTRY_FTYPE_UNKNOWN;
+}
+
+
+static struct hlist_head *
+dir_index_alloc_buckets(uint32_t nbuckets)
+{
+	struct hlist_head *buckets;
+	uint32_t i;
+
+	if (!(buckets = ospfs_big_alloc(nbuckets * sizeof(struct hlist_head))))
+		return NULL;
+	for (i = 0; i < nbuckets; i++)
+		INIT_HLIST_HEAD(&buckets[i]);
+	return buckets;
+}
+
+
+// dir_index_free(di)
+//	Frees a directory index and all its entries.  'di' may be NULL.
+
+static void
+dir_index_free(ospfs_dir_index_t *di)
+{
+	struct hlist_node *pos, *n;
+	uint32_t i;
+
+	if (!di)
+		return;
+	for (i = 0; i < di->di_nbuckets; i++)
+		hlist_for_each_safe(pos, n, &di->di_buckets[i])
+			kfree(hlist_entry(pos, ospfs_dir_hent_t, dh_link));
+	ospfs_big_free(di->di_buckets, di->di_nbuckets * sizeof(struct hlist_head));
+	kfree(di);
+}
+
+
+// dir_index_hent_free_rcu(head)
+//	RCU callback that frees a removed index entry.
+
+static void
+dir_index_hent_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, ospfs_dir_hent_t, dh_rcu));
+}
+
+
+// dir_index_retire_rcu(head), dir_index_reap()
+//	A replaced index can't be freed from its RCU callback, which runs in
+//	softirq context, where vfree() isn't allowed.  The callback puts it
+//	on the retired list, and dir_index_reap() frees that list.
+
+static ospfs_dir_index_t *ospfs_dir_retired;
+static DEFINE_SPINLOCK(ospfs_dir_retired_lock);
+
+static void
+dir_index_retire_rcu(struct rcu_head *head)
+{
+	ospfs_dir_index_t *di = container_of(head, ospfs_dir_index_t, di_rcu);
+
+	spin_lock(&ospfs_dir_retired_lock);
+	di->di_retired_next = ospfs_dir_retired;
+	ospfs_dir_retired = di;
+	spin_unlock(&ospfs_dir_retired_lock);
+}
+
+static void
+dir_index_reap(void)
+{
+	ospfs_dir_index_t *di, *next;
+
+	spin_lock_bh(&ospfs_dir_retired_lock);
+	di = ospfs_dir_retired;
+	ospfs_dir_retired = NULL;
+	spin_unlock_bh(&ospfs_dir_retired_lock);
+
+	for (; di; di = next) {
+		next = di->di_retired_next;
+		dir_index_free(di);
+	}
+}
+
+
+// dir_index_insert(di, hash, off)
+//	Adds the direntry at offset 'off', whose name hashes to 'hash'.
+//	Returns 0 on success, -ENOMEM on failure.
+
+static int
+dir_index_insert(ospfs_dir_index_t *di, uint32_t hash, uint32_t off)
+{
+	ospfs_dir_hent_t *h = kmalloc(sizeof(ospfs_dir_hent_t), GFP_KERNEL);
+
+	if (!h)
+		return -ENOMEM;
+	h->dh_hash = hash;
+	h->dh_off = off;
+	hlist_add_head_rcu(&h->dh_link, &di->di_buckets[hash & (di->di_nbuckets - 1)]);
+	di->di_nentries++;
+	return 0;
+}
+
+
+// dir_index_alloc(nbuckets)
+//	Returns a new, empty index with 'nbuckets' buckets, or NULL if we're
+//	out of memory.
+
+static ospfs_dir_index_t *
+dir_index_alloc(uint32_t nbuckets)
+{
+	ospfs_dir_index_t *di = kzalloc(sizeof(ospfs_dir_index_t), GFP_KERNEL);
+
+	if (!di)
+		return NULL;
+	di->di_nbuckets = nbuckets;
+	if (!(di->di_buckets = dir_index_alloc_buckets(nbuckets))) {
+		kfree(di);
+		return NULL;
+	}
+	return di;
+}
+
+
+// dir_index_grow(di)
+//	Returns a copy of 'di' with twice as many buckets, or NULL if we're
+//	out of memory.  'di' itself is left alone, since lookups may be
+//	walking it.
+
+static ospfs_dir_index_t *
+dir_index_grow(ospfs_dir_index_t *di)
+{
+	ospfs_dir_index_t *ndi = dir_index_alloc(di->di_nbuckets * 2);
+	struct hlist_node *pos;
+	uint32_t i;
+
+	if (!ndi)
+		return NULL;
+	for (i = 0; i < di->di_nbuckets; i++)
+		hlist_for_each(pos, &di->di_buckets[i]) {
+			ospfs_dir_hent_t *h = hlist_entry(pos, ospfs_dir_hent_t, dh_link);
+			if (dir_index_insert(ndi, h->dh_hash, h->dh_off) < 0) {
+				dir_index_free(ndi);
+				return NULL;
+			}
+		}
+	ndi->di_nholes = di->di_nholes;
+	ndi->di_first_hole = di->di_first_hole;
+	return ndi;
+}
+
+
+// dir_index_build(dir_oi)
+//	Builds the index for directory 'dir_oi' with one pass over its
+//	entries.  Returns NULL if we're out of memory.
+
+static ospfs_dir_index_t *
+dir_index_build(ospfs_inode_t *dir_oi)
+{
+	ospfs_dir_index_t *di;
+	uint32_t nbuckets = OSPFS_DIR_INDEX_MINBUCKETS, off;
+
+	while (nbuckets < dir_oi->oi_size / OSPFS_DIRENTRY_SIZE / 2)
+		nbuckets *= 2;
+	if (!(di = dir_index_alloc(nbuckets)))
+		return NULL;
+
+	di->di_first_hole = dir_oi->oi_size;
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
+		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
+		int namelen;
+		if (!od->od_ino) {
+			if (di->di_nholes++ == 0)
+				di->di_first_hole = off;
+			continue;
+		}
+		namelen = direntry_namelen(od);
+		if (dir_index_insert(di, full_name_hash(od->od_name, namelen), off) < 0) {
+			dir_index_free(di);
+			return NULL;
+		}
+	}
+	return di;
+}
+
+
+// ospfs_dir_index(dir_oi, build)
+//	Returns the index for directory 'dir_oi'.  If it doesn't exist yet and
+//	'build' is nonzero, builds it.  Returns NULL if there is no index.
+//
+//	Lookups build the index holding the directory's ii_sem shared, so two
+//	of them may build it at once; the first to finish installs its copy.
+//	(cmpxchg() orders the table's contents before its publication.)
+
+static ospfs_dir_index_t *
+ospfs_dir_index(ospfs_inode_t *dir_oi, int build)
+{
+	ospfs_inode_info_t *ii = ospfs_inode_info(ospfs_inode_ino(dir_oi));
+	ospfs_dir_index_t *di;
+
+	if (!ii->ii_dir && build && (di = dir_index_build(dir_oi))
+	    && cmpxchg(&ii->ii_dir, NULL, di) != NULL)
+		dir_index_free(di);
+	return ii->ii_dir;
+}
+
+
+// dir_index_replace(dir_oi, ndi)
+//	Installs 'ndi' (possibly NULL) as the index for directory 'dir_oi',
+//	and retires the old one, to be freed once no lookup can still be
+//	using it.  Also frees the indexes retired earlier.
+
+static void
+dir_index_replace(ospfs_inode_t *dir_oi, ospfs_dir_index_t *ndi)
+{
+	ospfs_inode_info_t *ii = ospfs_inode_info(ospfs_inode_ino(dir_oi));
+	ospfs_dir_index_t *di = ii->ii_dir;
+
+	rcu_assign_pointer(ii->ii_dir, ndi);
+	dir_index_reap();
+	if (di)
+		call_rcu(&di->di_rcu, dir_index_retire_rcu);
+}
+
+
+// dir_index_drop(dir_oi)
+//	Throws away the index for directory 'dir_oi'; the next lookup will
+//	rebuild it.  Used when an update can't be applied.
+
+static void
+dir_index_drop(ospfs_inode_t *dir_oi)
+{
+	dir_index_replace(dir_oi, NULL);
+}
+
+
+// dir_index_add(dir_oi, off, name, namelen)
+//	Records that the direntry at offset 'off' in 'dir_oi' is now named
+//	'name'.  Called after the direntry is filled in.  Grows the table
+//	when it gets crowded; if that fails, the table just stays at its
+//	current size.
+
+static void
+dir_index_add(ospfs_inode_t *dir_oi, uint32_t off, const char *name, int namelen)
+{
+	ospfs_dir_index_t *di = ospfs_dir_index(dir_oi, 0), *ndi;
+
+	if (!di)
+		return;
+	if (dir_index_insert(di, full_name_hash(name, namelen), off) < 0)
+		dir_index_drop(dir_oi);
+	else if (di->di_nentries > 2 * di->di_nbuckets && (ndi = dir_index_grow(di)))
+		dir_index_replace(dir_oi, ndi);
+}
+
+
+// dir_index_lookup(di, dir_oi, name, namelen)
+//	Returns the offset of the direntry named 'name' in directory 'dir_oi',
+//	whose index is 'di', or -1 if there is none.  The caller holds either
+//	the directory's ii_sem or rcu_read_lock().  'namelen' must be at most
+//	OSPFS_MAXNAMELEN.
+
+static int
+dir_index_lookup(ospfs_dir_index_t *di, ospfs_inode_t *dir_oi,
+		 const char *name, int namelen)
+{
+	uint32_t hash = full_name_hash(name, namelen), probes = 0;
+	ospfs_dir_hent_t *h;
+	struct hlist_node *pos;
+	int off = -1;
+
+	hlist_for_each_entry_rcu(h, pos, &di->di_buckets[hash & (di->di_nbuckets - 1)], dh_link) {
+		probes++;
+		if (h->dh_hash == hash
+		    && direntry_name_eq(ospfs_inode_data(dir_oi, h->dh_off), name, namelen)) {
+			off = h->dh_off;
+			break;
+		}
+	}
+	ospfs_stat_lookup(probes);
+	ospfs_trace_event(OSPFS_TRACE_DIRENTRY_LOOKUP, ospfs_inode_ino(dir_oi), off, probes);
+	return off;
+}
+
+
+// dir_index_remove(dir_oi, off, name, namelen)
+//	Records that the direntry at offset 'off' in 'dir_oi', named 'name',
+//	is being cleared, leaving a hole.
+
+static void
+dir_index_remove(ospfs_inode_t *dir_oi, uint32_t off, const char *name, int namelen)
+{
+	ospfs_dir_index_t *di = ospfs_dir_index(dir_oi, 0);
+	uint32_t hash = full_name_hash(name, namelen);
+	struct hlist_node *pos;
+
+	if (!di)
+		return;
+	di->di_nholes++;
+	if (off < di->di_first_hole)
+		di->di_first_hole = off;
+	hlist_for_each(pos, &di->di_buckets[hash & (di->di_nbuckets - 1)]) {
+		ospfs_dir_hent_t *h = hlist_entry(pos, ospfs_dir_hent_t, dh_link);
+		if (h->dh_off == off) {
+			hlist_del_rcu(pos);
+			call_rcu(&h->dh_rcu, dir_index_hent_free_rcu);
+			di->di_nentries--;
+			return;
+		}
+	}
+}
+
+
+
+/*****************************************************************************
+ * DIRECTORY OPERATIONS
+ *
+ * EXERCISE: Finish 'ospfs_dir_readdir' and 'ospfs_symlink'.
+ */
+
+// ospfs_dir_lookup(dir, dentry, ignore)
+//	This function implements the "lookup" directory operation, which
+//	looks up a named entry.
+//
+//	We have written this function for you.
+//
+//   Input:  dir    -- The Linux 'struct inode' for the directory.
+//		       You can extract the corresponding 'ospfs_inode_t'
+//		       by calling 'ospfs_inode' with the relevant inode number.
+//	     dentry -- The name of the entry being looked up.
+//   Effect: Looks up the entry named 'dentry'.  If found, attaches the
+//	     entry's 'struct inode' to the 'dentry'.  If not found, returns
+//	     a "negative dentry", which has no inode attachment.
+
+static struct dentry *
+ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ignore)
+{
+	// Find the OSPFS inode corresponding to 'dir'
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dir->i_ino);
+	struct inode *entry_inode = NULL;
+	ospfs_dir_index_t *di;
+	uint32_t ino = 0;
+	int off;
 
 	// Make sure filename is not too long
 	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
@@ -366,23 +2867,28 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 	// Mark with our operations
 	dentry->d_op = &ospfs_dentry_ops;
 
-	// Search through the directory block
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		// Find the OSPFS inode for the entry
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
-
-		// Set 'entry_inode' if we find the file we are looking for
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
-			entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
-			if (!entry_inode)
-				return (struct dentry *) ERR_PTR(-EINVAL);
-			break;
-		}
+	// Search the directory's index, if it has one, without locking
+	rcu_read_lock();
+	if ((di = rcu_dereference(dir_ii->ii_dir))) {
+		off = dir_index_lookup(di, dir_oi, dentry->d_name.name, dentry->d_name.len);
+		if (off >= 0)
+			ino = ((ospfs_direntry_t *) ospfs_inode_data(dir_oi, off))->od_ino;
+	}
+	rcu_read_unlock();
+
+	// Otherwise search it the slow way, building the index
+	if (!di) {
+		down_read(&dir_ii->ii_sem);
+		off = find_direntry_off(dir_oi, dentry->d_name.name, dentry->d_name.len);
+		if (off >= 0)
+			ino = ((ospfs_direntry_t *) ospfs_inode_data(dir_oi, off))->od_ino;
+		up_read(&dir_ii->ii_sem);
 	}
 
+	// Set 'entry_inode' if we found the file we are looking for
+	if (ino && !(entry_inode = ospfs_mk_linux_inode(dir->i_sb, ino)))
+		return (struct dentry *) ERR_PTR(-EIO);
+
 	// We return a dentry whether or not the file existed.
 	// The file exists if and only if 'entry_inode != NULL'.
 	// If the file doesn't exist, the dentry is called a "negative dentry".
@@ -433,6 +2939,7 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	struct inode *dir_inode = filp->f_dentry->d_inode;
 	ospfs_inode_t *dir_oi = ospfs_inode(dir_inode->i_ino);
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dir_inode->i_ino);
 	uint32_t f_pos = filp->f_pos;
 	int r = 0;		/* Error return value, if any */
 	int ok_so_far = 0;	/* Return value from 'filldir' */
@@ -451,81 +2958,55 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			f_pos++;
 	}
 
-	// actual entries
+	// Actual entries, a directory block at a time: look up each block
+	// once, then hand its live entries to filldir.  Entries carry their
+	// file type, so only entries from older images touch the inode table.
+	down_read(&dir_ii->ii_sem);
 	while (r == 0 && ok_so_far >= 0 && f_pos >= 2) {
-		ospfs_direntry_t *od;
-		ospfs_inode_t *entry_oi;
-
-		/* If at the end of the directory, set 'r' to 1 and exit
-		 * the loop.  For now we do this all the time.
-		 *
-		 * EXERCISE: Your code here */
-		
-		// f_pos is an offset into directory data plus two; thus, (f_pos - 2) is the proper data offset
-		int entry_off = (f_pos - 2) * OSPFS_DIRENTRY_SIZE;
-		if (ospfs_inode_blockno(dir_oi, entry_off) == 0)
-		{
+		uint32_t entry_off = (f_pos - 2) * OSPFS_DIRENTRY_SIZE;
+		uint32_t blockno, block_end;
+		char *block;
+
+		if (entry_off >= dir_oi->oi_size) {
 			r = 1;
 			break;
 		}
-
-		/* Get a pointer to the next entry (od) in the directory.
-		 * The file system interprets the contents of a
-		 * directory-file as a sequence of ospfs_direntry structures.
-		 * You will find 'f_pos' and 'ospfs_inode_data' useful.
-		 *
-		 * Then use the fields of that file to fill in the directory
-		 * entry.  To figure out whether a file is a regular file or
-		 * another directory, use 'ospfs_inode' to get the directory
-		 * entry's corresponding inode, and check out its 'oi_ftype'
-		 * member.
-		 *
-		 * Make sure you ignore blank directory entries!  (Which have
-		 * an inode number of 0.)
-		 *
-		 * If the current entry is successfully read (the call to
-		 * filldir returns >= 0), or the current entry is skipped,
-		 * your function should advance f_pos by the proper amount to
-		 * advance to the next directory entry.
-		 */
-
-		/* EXERCISE: Your code here */
-
-		
-		od = ospfs_inode_data(dir_oi, entry_off);
-
-		// Check for blank or invalid dir entries -- if so skip this direntry
-		if (od->od_ino <= 0) {
-			f_pos++;
-			continue;
+		if ((blockno = ospfs_inode_blockno(dir_oi, entry_off)) == 0) {
+			r = -EIO;
+			break;
 		}
-		
-		entry_oi = ospfs_inode(od->od_ino);
-
-		int len = 0;
-		while (od->od_name[len] != NULL)
-			len++;
-
-		switch (entry_oi->oi_ftype)
-		{
-			case (OSPFS_FTYPE_REG) :
-				ok_so_far = filldir(dirent, od->od_name, len, f_pos, od->od_ino, DT_REG);
+		block = ospfs_block(blockno);
+
+		block_end = (entry_off / OSPFS_BLKSIZE + 1) * OSPFS_BLKSIZE;
+		if (block_end > dir_oi->oi_size)
+			block_end = dir_oi->oi_size;
+
+		for (; entry_off < block_end; entry_off += OSPFS_DIRENTRY_SIZE, f_pos++) {
+			ospfs_direntry_t *od = (ospfs_direntry_t *)
+				(block + entry_off % OSPFS_BLKSIZE);
+			uint32_t ftype;
+			int namelen;
+
+			// Ignore blank directory entries
+			if (od->od_ino == 0)
+				continue;
+
+			namelen = direntry_namelen(od);
+			if (direntry_ftype(od, namelen) != OSPFS_DIRENTRY_FTYPE_UNKNOWN)
+				ftype = od->od_ftype - OSPFS_DIRENTRY_FTYPE(0);
+			else
+				ftype = ospfs_inode(od->od_ino)->oi_ftype;
+
+			ok_so_far = filldir(dirent, od->od_name, namelen,
+					    f_pos, od->od_ino,
+					    ftype == OSPFS_FTYPE_DIR ? DT_DIR
+					    : ftype == OSPFS_FTYPE_SYMLINK ? DT_LNK
+					    : DT_REG);
+			if (ok_so_far < 0)
 				break;
-			case (OSPFS_FTYPE_DIR) :
-				ok_so_far = filldir(dirent, od->od_name, len, f_pos, od->od_ino, DT_DIR);
-				break;
-			default:
-				ok_so_far = filldir(dirent, od->od_name, len, f_pos, od->od_ino, DT_LNK);
-		}
-
-		if (ok_so_far >= 0)
-			f_pos++;
-		else
-		{
-			r = 0;
-			break;
 		}
 	}
+	up_read(&dir_ii->ii_sem);
 
 	// Save the file position and return!
 	filp->f_pos = f_pos;
@@ -543,33 +3024,52 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 //
 //   Returns: 0 if success and -ENOENT on entry not found.
 //
-//   EXERCISE: Make sure that deleting symbolic links works correctly.
+//   Removing the last link to an inode frees it (see free_inode).
 
 static int
 ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 {
 	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
+	ospfs_inode_info_t *ii = ospfs_inode_info(dentry->d_inode->i_ino);
 	ospfs_inode_t *dir_oi = ospfs_inode(dentry->d_parent->d_inode->i_ino);
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dentry->d_parent->d_inode->i_ino);
 	int entry_off;
 	ospfs_direntry_t *od;
 
-	od = NULL; // silence compiler warning; entry_off indicates when !od
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		od = ospfs_inode_data(dir_oi, entry_off);
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0)
-			break;
-	}
-
-	if (entry_off == dir_oi->oi_size) {
+	down_write(&dir_ii->ii_sem);
+	entry_off = find_direntry_off(dir_oi, dentry->d_name.name, dentry->d_name.len);
+	if (entry_off < 0) {
+		up_write(&dir_ii->ii_sem);
 		printk("<1>ospfs_unlink should not fail!\n");
 		return -ENOENT;
 	}
 
+	down_write(&ii->ii_sem);
+	// Empty a closed file losing its last link first, in transactions of
+	// its own, so a crash partway leaves a shorter file rather than a
+	// free inode that still holds blocks
+	if (oi->oi_nlink == 1 && ii->ii_nopen == 0 && oi->oi_ftype == OSPFS_FTYPE_REG)
+		change_size(oi, 0);
+	ospfs_journal_begin(OSPFS_CREDITS_UNLINK);
+	od = ospfs_inode_data(dir_oi, entry_off);
+	dir_index_remove(dir_oi, entry_off, dentry->d_name.name, dentry->d_name.len);
+	ospfs_journal_dirty(od);
 	od->od_ino = 0;
-	oi->oi_nlink--;
+	ospfs_journal_dirty(oi);
+
+	// When the last link goes, free the inode -- unless the file is
+	// still open, in which case ospfs_release frees it on last close.
+	// The Linux inode is shared by all the file's names, so it loses a
+	// link too; a freed inode number may be reused at once, so the cached
+	// inode must not be found again.
+	dentry->d_inode->i_nlink--;
+	if (--oi->oi_nlink == 0 && ii->ii_nopen == 0) {
+		remove_inode_hash(dentry->d_inode);
+		free_inode(dentry->d_inode->i_ino);
+	}
+	ospfs_journal_end();
+	up_write(&ii->ii_sem);
+	up_write(&dir_ii->ii_sem);
 	return 0;
 }
 
@@ -578,9 +3078,468 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 /*****************************************************************************
  * FREE-BLOCK BITMAP OPERATIONS
  *
- * EXERCISE: Implement these functions.
+ *   The on-disk free-block bitmap is the authority on which blocks are free.
+ *   To keep allocation cheap as the disk fills, we also keep two in-memory
+ *   structures, built at mount time by ospfs_freemap_init():
+ *
+ *   - 'ospfs_freemap_nfree[k]' counts the free bits in bitmap block k, and
+ *     'ospfs_freemap_summary' has bit k set iff that count is nonzero.
+ *     Full bitmap blocks are skipped without being read.
+ *   - 'ospfs_alloc_cursor' is a next-fit cursor: each search starts just
+ *     past the previous allocation and wraps around to the first data block.
+ *
+ *   Within a bitmap block, bitvector_find_set() scans 64 bits at a time.
+ *
+ *   'ospfs_freemap_mutex' guards the bitmap and these structures; holding
+ *   it, the allocator may still dirty journal blocks.
+ *
+ *   So that writers on different CPUs don't all serialize on that mutex,
+ *   allocate_block() hands out blocks from per-CPU pools.  A pool is a run
+ *   of up to OSPFS_POOL_BLOCKS free blocks reserved, under the mutex, for
+ *   one CPU; its blocks are then taken under the pool's own spinlock.  A
+ *   reservation exists only in memory: the reserved blocks stay free in
+ *   the bitmap, and free_block() and freemap_search() leave them alone,
+ *   until the CPU allocates them, so a crash loses nothing.  Searches
+ *   find a block's reservation in 'ospfs_reserved', the pools sorted by
+ *   block number, without taking the pools' locks.
+ *   'ospfs_nfree' and the summary don't count reserved blocks.  When the
+ *   disk runs low, and at unmount, the unused parts of the reservations
+ *   are given back.  Since pool allocations touch the bitmap without the
+ *   mutex, all bitmap updates use the atomic bitvector operations.
  */
 
+static uint32_t *ospfs_freemap_nfree;	// Free bits per bitmap block
+static uint32_t *ospfs_freemap_summary;	// Bit k set iff nfree[k] > 0
+static uint32_t ospfs_nfreemap;		// Number of bitmap blocks
+static uint32_t ospfs_nfree;		// Free blocks on the whole disk
+static uint32_t ospfs_alloc_cursor;	// Where the next search starts
+static DEFINE_MUTEX(ospfs_freemap_mutex);
+
+#define OSPFS_POOL_BLOCKS	32	// Blocks reserved at a time per CPU
+
+typedef struct ospfs_alloc_pool {
+	spinlock_t ap_lock;		// Guards both fields; ap_end also
+					// changes only under the freemap mutex
+	uint32_t ap_next;		// Reserved blocks are [ap_next, ap_end)
+	uint32_t ap_end;
+} ospfs_alloc_pool_t;
+
+static DEFINE_PER_CPU(ospfs_alloc_pool_t, ospfs_alloc_pools);
+
+// The pools with reservations, in block order.  Guarded by
+// ospfs_freemap_mutex, so searches can find a block's reservation
+// without taking any pool's lock.
+static ospfs_alloc_pool_t **ospfs_reserved;
+static unsigned int ospfs_nreserved;
+
+
+// ospfs_freemap(k)
+//	Returns a pointer to the k'th block of the free-block bitmap.
+
+static inline void *
+ospfs_freemap(uint32_t k)
+{
+	return ospfs_block(OSPFS_FREEMAP_BLK + k);
+}
+
+
+// ospfs_first_datab()
+//	Returns the number of the first data block, i.e. the first block after
+//	the inode blocks and the reference-count map, if any.  Blocks below
+//	this are never allocated or freed.
+
+static inline uint32_t
+ospfs_first_datab(void)
+{
+	if (ospfs_super->os_refmapb)
+		return ospfs_super->os_refmapb
+			+ (ospfs_super->os_nblocks + OSPFS_BLKREFS - 1) / OSPFS_BLKREFS;
+	return ospfs_super->os_firstinob
+		+ (ospfs_super->os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+}
+
+
+// ospfs_refcount(blockno)
+//	Returns a pointer to block 'blockno's entry in the reference-count map
+//	(see ospfs.h), or NULL if the file system has no map.  Entries change
+//	only under ospfs_freemap_mutex, and only ever go down.
+
+static inline uint32_t *
+ospfs_refcount(uint32_t blockno)
+{
+	if (!ospfs_super->os_refmapb)
+		return NULL;
+	return (uint32_t *) ospfs_block(ospfs_super->os_refmapb + blockno / OSPFS_BLKREFS)
+		+ blockno % OSPFS_BLKREFS;
+}
+
+
+// ospfs_block_shared(blockno)
+//	Returns nonzero iff more than one block pointer refers to 'blockno'.
+//	A zero answer stays true; a nonzero one may be stale.
+
+static inline int
+ospfs_block_shared(uint32_t blockno)
+{
+	uint32_t *refcount = ospfs_refcount(blockno);
+	return refcount && *refcount != 0;
+}
+
+
+// freemap_count(from, to, delta)
+//	Adds 'delta' (+1 or -1) to the in-memory free counts of each block in
+//	[from, to), as blocks enter or leave a pool.  The caller holds
+//	ospfs_freemap_mutex.
+
+static void
+freemap_count(uint32_t from, uint32_t to, int delta)
+{
+	for (; from < to; from++) {
+		uint32_t k = from / OSPFS_BLKBITSIZE;
+		ospfs_freemap_nfree[k] += delta;
+		if (ospfs_freemap_nfree[k] == 0)
+			bitvector_clear(ospfs_freemap_summary, k);
+		else
+			bitvector_set(ospfs_freemap_summary, k);
+		ospfs_nfree += delta;
+	}
+}
+
+
+// pool_reserved_end(blockno)
+//	If block 'blockno' is inside some CPU's reservation, returns the end
+//	of that reservation; otherwise returns 0.  The caller holds
+//	ospfs_freemap_mutex, so the reservations' ends and their order in
+//	'ospfs_reserved' are fixed, and a binary search finds the one that
+//	could hold 'blockno'.  Its start may still grow as soon as it is
+//	read, since pool_allocate() doesn't take the mutex; but pool_allocate
+//	clears a block's free bit before the block leaves the reservation, so
+//	a stale start only makes an allocated block look reserved, and a
+//	caller that gets 0 must test the bit again before using the block.
+
+static uint32_t
+pool_reserved_end(uint32_t blockno)
+{
+	unsigned int lo = 0, hi = ospfs_nreserved, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ospfs_reserved[mid]->ap_end <= blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < ospfs_nreserved && blockno >= ospfs_reserved[lo]->ap_next)
+		return ospfs_reserved[lo]->ap_end;
+	return 0;
+}
+
+
+// pool_reserve(pool, start, end)
+//	Makes [start, end), which is free and unreserved, the reservation of
+//	the empty 'pool', and adds it to 'ospfs_reserved'.  The caller holds
+//	ospfs_freemap_mutex.
+
+static void
+pool_reserve(ospfs_alloc_pool_t *pool, uint32_t start, uint32_t end)
+{
+	unsigned int i;
+
+	spin_lock(&pool->ap_lock);
+	pool->ap_next = start;
+	pool->ap_end = end;
+	spin_unlock(&pool->ap_lock);
+
+	for (i = ospfs_nreserved; i > 0 && ospfs_reserved[i - 1]->ap_end > end; i--)
+		ospfs_reserved[i] = ospfs_reserved[i - 1];
+	ospfs_reserved[i] = pool;
+	ospfs_nreserved++;
+}
+
+
+// freemap_available(blockno)
+//	Returns nonzero if block 'blockno' is free, in no reservation, and
+//	not busy in the journal (see ospfs_journal_busy()), so the caller,
+//	who holds ospfs_freemap_mutex, may allocate it.
+
+static inline int
+freemap_available(uint32_t blockno)
+{
+	void *freemap = ospfs_freemap(blockno / OSPFS_BLKBITSIZE);
+
+	if (!bitvector_test(freemap, blockno % OSPFS_BLKBITSIZE)
+	    || pool_reserved_end(blockno) || ospfs_journal_busy(blockno))
+		return 0;
+	// A block that left a reservation after the bit was first read is
+	// clear by now
+	smp_rmb();
+	return bitvector_test(freemap, blockno % OSPFS_BLKBITSIZE);
+}
+
+
+// pool_release(pool)
+//	Gives back the unused part of 'pool's reservation and empties it.
+//	The caller holds ospfs_freemap_mutex.
+
+static void
+pool_release(ospfs_alloc_pool_t *pool)
+{
+	unsigned int i;
+
+	if (pool->ap_end == 0)
+		return;
+	for (i = 0; ospfs_reserved[i] != pool; i++)
+		/* do nothing */;
+	for (ospfs_nreserved--; i < ospfs_nreserved; i++)
+		ospfs_reserved[i] = ospfs_reserved[i + 1];
+
+	spin_lock(&pool->ap_lock);
+	freemap_count(pool->ap_next, pool->ap_end, +1);
+	pool->ap_next = pool->ap_end = 0;
+	spin_unlock(&pool->ap_lock);
+}
+
+
+// pool_drain()
+//	Gives back every CPU's reservation.  The caller holds
+//	ospfs_freemap_mutex.
+
+static void
+pool_drain(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		pool_release(&per_cpu(ospfs_alloc_pools, cpu));
+}
+
+
+// ospfs_freemap_init()
+//	Builds the in-memory free-block summary from the on-disk bitmap.
+//	Called at mount time.
+//
+//   Returns: 0 on success, -ENOMEM if the summary can't be allocated.
+
+static int
+ospfs_freemap_init(void)
+{
+	uint32_t nblocks = ospfs_super->os_nblocks;
+	uint32_t k, b;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ospfs_alloc_pool_t *pool = &per_cpu(ospfs_alloc_pools, cpu);
+		spin_lock_init(&pool->ap_lock);
+		pool->ap_next = pool->ap_end = 0;
+	}
+
+	ospfs_nfreemap = (nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
+	ospfs_freemap_nfree = kzalloc(ospfs_nfreemap * sizeof(uint32_t), GFP_KERNEL);
+	// bitvector_find_set() needs whole 64-bit words
+	ospfs_freemap_summary = kzalloc((ospfs_nfreemap + 63) / 64 * sizeof(uint64_t), GFP_KERNEL);
+	ospfs_reserved = kmalloc(num_possible_cpus() * sizeof(ospfs_alloc_pool_t *), GFP_KERNEL);
+	ospfs_nreserved = 0;
+	if (!ospfs_freemap_nfree || !ospfs_freemap_summary || !ospfs_reserved) {
+		kfree(ospfs_freemap_nfree);
+		kfree(ospfs_freemap_summary);
+		kfree(ospfs_reserved);
+		ospfs_freemap_nfree = ospfs_freemap_summary = NULL;
+		ospfs_reserved = NULL;
+		return -ENOMEM;
+	}
+
+	ospfs_nfree = 0;
+	for (k = 0; k < ospfs_nfreemap; k++) {
+		uint32_t *freemap = ospfs_freemap(k);
+		uint32_t nbits = min_t(uint32_t, OSPFS_BLKBITSIZE, nblocks - k * OSPFS_BLKBITSIZE);
+		for (b = 0; b < nbits / 32; b++)
+			ospfs_freemap_nfree[k] += hweight32(freemap[b]);
+		for (b = nbits & ~31; b < nbits; b++)
+			ospfs_freemap_nfree[k] += bitvector_test(freemap, b);
+		if (ospfs_freemap_nfree[k])
+			bitvector_set(ospfs_freemap_summary, k);
+		ospfs_nfree += ospfs_freemap_nfree[k];
+	}
+
+	ospfs_alloc_cursor = ospfs_first_datab();
+	return 0;
+}
+
+
+// ospfs_freemap_destroy()
+//	Frees the in-memory free-block summary.  Called at unmount time.
+//	The blocks still reserved in pools are free in the bitmap already.
+
+static void
+ospfs_freemap_destroy(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		ospfs_alloc_pool_t *pool = &per_cpu(ospfs_alloc_pools, cpu);
+		pool->ap_next = pool->ap_end = 0;
+	}
+	kfree(ospfs_freemap_nfree);
+	kfree(ospfs_freemap_summary);
+	kfree(ospfs_reserved);
+	ospfs_freemap_nfree = ospfs_freemap_summary = NULL;
+	ospfs_reserved = NULL;
+	ospfs_nreserved = 0;
+}
+
+
+// freemap_search(from, to)
+//	Returns the number of the first free, unreserved block in [from, to)
+//	that isn't busy in the journal, or 0 if there is none.  Does not
+//	allocate the block.  If only busy blocks are free, asks for the log
+//	to be checkpointed at the next commit, which frees them.
+
+static uint32_t
+freemap_search(uint32_t from, uint32_t to)
+{
+	uint32_t k = from / OSPFS_BLKBITSIZE, scanned = 0, found = 0;
+	int busy = 0;
+
+	while (from < to) {
+		uint32_t base, end, bit;
+
+		// Skip bitmap blocks that have no free bits at all
+		k = bitvector_find_set(ospfs_freemap_summary, k, ospfs_nfreemap);
+		base = k * OSPFS_BLKBITSIZE;
+		if (k == ospfs_nfreemap || base >= to)
+			break;
+		if (from < base)
+			from = base;
+
+		end = min_t(uint32_t, to - base, OSPFS_BLKBITSIZE);
+		bit = bitvector_find_set(ospfs_freemap(k), from - base, end);
+		scanned++;
+		if (bit < end) {
+			uint32_t reserved_end = pool_reserved_end(base + bit);
+			if (reserved_end)
+				from = reserved_end;
+			else if (ospfs_journal_busy(base + bit)) {
+				busy = 1;
+				from = base + bit + 1;
+			} else {
+				// Recheck: the block may have just left a
+				// reservation, allocated
+				smp_rmb();
+				if (bitvector_test(ospfs_freemap(k), bit)) {
+					found = base + bit;
+					break;
+				}
+				from = base + bit + 1;
+			}
+			k = from / OSPFS_BLKBITSIZE;
+			continue;
+		}
+
+		from = base + OSPFS_BLKBITSIZE;
+		k++;
+	}
+
+	if (!found && busy)
+		ospfs_journal_want_checkpoint = 1;
+	ospfs_stat_add(OSPFS_STAT_ALLOC_SEARCHES, 1);
+	ospfs_stat_add(OSPFS_STAT_ALLOC_SCANNED, scanned);
+	ospfs_stat_hist(OSPFS_HIST_ALLOC_SCAN, scanned);
+	return found;
+}
+
+
+// freemap_journal(blockno)
+//	Journals the allocation of block 'blockno': its bitmap block becomes
+//	part of the transaction.
+
+static void
+freemap_journal(uint32_t blockno)
+{
+	ospfs_journal_dirty(ospfs_freemap(blockno / OSPFS_BLKBITSIZE));
+}
+
+
+// freemap_mark_allocated(blockno)
+//	Marks free block 'blockno' as allocated in the bitmap and the summary.
+//	The caller holds ospfs_freemap_mutex (as do freemap_search's callers),
+//	and must still call freemap_journal().
+
+static void
+freemap_mark_allocated(uint32_t blockno)
+{
+	bitvector_clear_atomic(ospfs_freemap(blockno / OSPFS_BLKBITSIZE),
+			       blockno % OSPFS_BLKBITSIZE);
+	freemap_count(blockno, blockno + 1, -1);
+}
+
+
+// pool_refill()
+//	Reserves a new run of up to OSPFS_POOL_BLOCKS free blocks for the
+//	current CPU's pool, giving back what is left of its old one.  Returns
+//	the number of blocks reserved, or 0 if the disk is too full for
+//	pools.  The caller holds ospfs_freemap_mutex.
+
+static uint32_t
+pool_refill(void)
+{
+	ospfs_alloc_pool_t *pool;
+	uint32_t start, len;
+
+	if (ospfs_nfree < OSPFS_POOL_BLOCKS * num_online_cpus())
+		return 0;
+
+	start = freemap_search(ospfs_alloc_cursor, ospfs_super->os_nblocks);
+	if (start == 0)
+		start = freemap_search(ospfs_first_datab(), ospfs_alloc_cursor);
+	if (start == 0)
+		return 0;
+
+	for (len = 1; len < OSPFS_POOL_BLOCKS && start + len < ospfs_super->os_nblocks; len++) {
+		if (!freemap_available(start + len))
+			break;
+	}
+	freemap_count(start, start + len, -1);
+
+	ospfs_alloc_cursor = start + len;
+	if (ospfs_alloc_cursor >= ospfs_super->os_nblocks)
+		ospfs_alloc_cursor = ospfs_first_datab();
+
+	pool = &per_cpu(ospfs_alloc_pools, get_cpu());
+	pool_release(pool);
+	pool_reserve(pool, start, start + len);
+	put_cpu();
+	return len;
+}
+
+
+// pool_allocate()
+//	Takes the next block from the current CPU's pool and marks it
+//	allocated in the bitmap.  The bit is cleared before the block leaves
+//	the reservation, so the block is never free and unreserved at once,
+//	even to freemap_search(), which reads the bitmap without the pool
+//	lock.  The caller must still call freemap_journal().  Returns 0 if
+//	the pool is empty.
+
+static uint32_t
+pool_allocate(void)
+{
+	ospfs_alloc_pool_t *pool = &per_cpu(ospfs_alloc_pools, get_cpu());
+	uint32_t blockno = 0;
+
+	spin_lock(&pool->ap_lock);
+	if (pool->ap_next < pool->ap_end) {
+		blockno = pool->ap_next;
+		bitvector_clear_atomic(ospfs_freemap(blockno / OSPFS_BLKBITSIZE),
+				       blockno % OSPFS_BLKBITSIZE);
+		smp_mb__after_clear_bit();
+		pool->ap_next = blockno + 1;
+	}
+	spin_unlock(&pool->ap_lock);
+	put_cpu();
+	return blockno;
+}
+
+
 // allocate_block()
 //	Use this function to allocate a block.
 //
@@ -592,81 +3551,277 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 //   a free block, allocates it (by marking it non-free), and returns the block
 //   number to the caller.  The block itself is not touched.
 //
+//   Blocks come from the current CPU's pool (see above), which is refilled
+//   when it runs out.  A refill's search is next-fit: it starts at
+//   'ospfs_alloc_cursor', runs to the end of the disk, then wraps around
+//   to the first data block.  When the disk is too full for pools, all
+//   reservations are given back and single blocks are found the same way.
+//
 //   Note:  A value of 0 for a bit indicates the corresponding block is
 //      allocated; a value of 1 indicates the corresponding block is free.
-//
-//   You can use the functions bitvector_set(), bitvector_clear(), and
-//   bitvector_test() to do bit operations on the map.
+
+static uint32_t
+freemap_allocate(void)
+{
+	uint32_t blockno;
+
+	if (ospfs_nfree == 0)
+		return 0;
+
+	blockno = freemap_search(ospfs_alloc_cursor, ospfs_super->os_nblocks);
+	if (blockno == 0)
+		blockno = freemap_search(ospfs_first_datab(), ospfs_alloc_cursor);
+	if (blockno == 0)
+		return 0;
+
+	freemap_mark_allocated(blockno);
+	freemap_journal(blockno);
+	ospfs_alloc_cursor = blockno + 1;
+	if (ospfs_alloc_cursor >= ospfs_super->os_nblocks)
+		ospfs_alloc_cursor = ospfs_first_datab();
+	return blockno;
+}
 
 static uint32_t
 allocate_block(void)
 {
-	/* EXERCISE: Your code here */
-  // Done - Vincent.
+	uint32_t blockno;
+
+	while ((blockno = pool_allocate()) == 0) {
+		mutex_lock(&ospfs_freemap_mutex);
+		if (pool_refill() == 0) {
+			// The disk is running low
+			pool_drain();
+			blockno = freemap_allocate();
+			mutex_unlock(&ospfs_freemap_mutex);
+			goto out;
+		}
+		mutex_unlock(&ospfs_freemap_mutex);
+	}
 
-  //Getting the pointer to the free map
-  //Remember, free block bitmap starts at block 2 in this implementation 
-	void * freemap = &ospfs_data[OSPFS_FREEMAP_BLK * OSPFS_BLKSIZE];
-  int freemap_idx = 0;
-  int idx;
+	freemap_journal(blockno);
+    out:
+	if (blockno) {
+		ospfs_stat_add(OSPFS_STAT_ALLOC_BLOCKS, 1);
+		ospfs_trace_event(OSPFS_TRACE_BLOCK_ALLOC, blockno, 1, 0);
+	}
+	return blockno;
+}
 
-  //Note that there might be multiple free block bitmaps so we're going to have
-  //to run through multiple free block bitmaps, and increment the freemap
-  //pointer every time
-  
-  //I want to optimize and use "idx = ospfs_super->os_firstinob", but why risk
-  //it?  I'm not sure 100% on the implementation details, so I'll just be safe.
 
-  for (idx = ospfs_super->os_firstinob; idx < ospfs_super->os_nblocks; idx++)
-  {
-    if (bitvector_test(freemap, (idx % OSPFS_BLKBITSIZE)) == 1)
-    {
-      //set the block to in use
-      bitvector_clear(freemap, (idx % OSPFS_BLKBITSIZE));
-      return idx;
-    }
+// allocate_extent(want, got)
+//	Use this function to allocate a run of physically contiguous blocks.
+//
+//   Inputs:  want -- the number of blocks the caller would like (>= 1)
+//	      got  -- set to the number of blocks actually allocated
+//   Returns: block number of the first allocated block,
+//	      or 0 if the disk is full
+//
+//   Like allocate_block(), the search is next-fit from 'ospfs_alloc_cursor'.
+//   The first free block found starts the run, which is extended over the
+//   following free blocks until it is 'want' blocks long or hits an
+//   allocated block.  So '*got' may be less than 'want'; the caller should
+//   call again for the rest.  The blocks themselves are not touched.
+
+static uint32_t
+allocate_extent(uint32_t want, uint32_t *got)
+{
+	uint32_t start, len;
+
+	*got = 0;
+	mutex_lock(&ospfs_freemap_mutex);
+	if ((start = freemap_allocate()) == 0)
+		goto out;
+
+	// The run's bitmap blocks are journaled once each
+	for (len = 1; len < want && start + len < ospfs_super->os_nblocks; len++) {
+		if (!freemap_available(start + len))
+			break;
+		freemap_mark_allocated(start + len);
+		if ((start + len) % OSPFS_BLKBITSIZE == 0)
+			freemap_journal(start + len);
+	}
+
+	ospfs_alloc_cursor = start + len;
+	if (ospfs_alloc_cursor >= ospfs_super->os_nblocks)
+		ospfs_alloc_cursor = ospfs_first_datab();
+	*got = len;
+
+    out:
+	mutex_unlock(&ospfs_freemap_mutex);
+	ospfs_stat_add(OSPFS_STAT_ALLOC_BLOCKS, *got);
+	if (start)
+		ospfs_trace_event(OSPFS_TRACE_BLOCK_ALLOC, start, *got, 0);
+	return start;
+}
+
+
+// free_block(blockno)
+//	Use this function to free an allocated block.
+//
+//   Inputs:  blockno -- the block number to be freed
+//   Returns: none
+//
+//   This function marks the named block as free in the free-block bitmap
+//   and updates the in-memory summary.  The boot sector, superblock,
+//   free-block bitmap, and inode blocks are never freed, and double frees
+//   are ignored, so the summary counts stay exact.  Freeing a shared block
+//   just drops one of its references.
+
+static void
+free_block(uint32_t blockno)
+{
+	uint32_t k = blockno / OSPFS_BLKBITSIZE;
+	void *freemap;
+	int shared = 0;
+
+	if (blockno < ospfs_first_datab() || blockno >= ospfs_super->os_nblocks) {
+		eprintk("OSPFS: free_block: bogus block number %u\n", blockno);
+		return;
+	}
+
+	mutex_lock(&ospfs_freemap_mutex);
+	if (ospfs_block_shared(blockno)) {
+		uint32_t *refcount = ospfs_refcount(blockno);
+		ospfs_journal_dirty(refcount);
+		(*refcount)--;
+		shared = 1;
+		goto out;
+	}
+	freemap = ospfs_freemap(k);
+	if (!bitvector_test(freemap, blockno % OSPFS_BLKBITSIZE)) {
+		ospfs_journal_dirty(freemap);
+		bitvector_set_atomic(freemap, blockno % OSPFS_BLKBITSIZE);
+		freemap_count(blockno, blockno + 1, +1);
+	}
+    out:
+	mutex_unlock(&ospfs_freemap_mutex);
+	ospfs_stat_add(OSPFS_STAT_FREE_BLOCKS, 1);
+	ospfs_trace_event(OSPFS_TRACE_BLOCK_FREE, blockno, shared, 0);
+}
+
+
+/*****************************************************************************
+ * FREE-INODE OPERATIONS
+ *
+ *   An inode is free iff its oi_nlink is 0.  Rather than probing the inode
+ *   table for one on every create, ospfs_inomap_init() collects the free
+ *   inode numbers at mount time into a stack, so allocation and release
+ *   are constant time.  The stack is filled from the top down, so a fresh
+ *   mount hands out the lowest-numbered inodes first.
+ *
+ *   Inodes 0 and OSPFS_ROOT_INO are never free, and OSPFS_JOURNAL_INODE is
+ *   reserved for the journal.  'ospfs_inomap_lock' guards the stack.
+ */
+
+static uint32_t *ospfs_free_inos;	// Stack of free inode numbers
+static uint32_t ospfs_nfree_inos;	// Number of entries on the stack
+static DEFINE_SPINLOCK(ospfs_inomap_lock);
+
+
+// ospfs_inomap_init()
+//	Builds the free-inode stack.  Called at mount time.
+//
+//   Returns: 0 on success, -ENOMEM if the stack can't be allocated.
+
+static int
+ospfs_inomap_init(void)
+{
+	uint32_t ino;
+
+	ospfs_free_inos = ospfs_big_alloc(ospfs_super->os_ninodes * sizeof(uint32_t));
+	if (!ospfs_free_inos)
+		return -ENOMEM;
+
+	ospfs_nfree_inos = 0;
+	for (ino = ospfs_super->os_ninodes - 1; ino > OSPFS_ROOT_INO; ino--)
+		if (ino != OSPFS_JOURNAL_INODE && ospfs_inode(ino)->oi_nlink == 0)
+			ospfs_free_inos[ospfs_nfree_inos++] = ino;
+	return 0;
+}
+
+
+// ospfs_inomap_destroy()
+//	Frees the free-inode stack.  Called at unmount time.
+
+static void
+ospfs_inomap_destroy(void)
+{
+	if (ospfs_free_inos)
+		ospfs_big_free(ospfs_free_inos, ospfs_super->os_ninodes * sizeof(uint32_t));
+	ospfs_free_inos = NULL;
+}
+
 
-    if (idx == OSPFS_BLKBITSIZE)
-    {
-      //increment freemap pointer to the next bitvector 
-      freemap_idx++;
-      freemap = &ospfs_data[(OSPFS_FREEMAP_BLK + freemap_idx) * OSPFS_BLKSIZE];
-    }
-  }
+// allocate_inode()
+//	Takes a free inode off the stack.  The inode itself is not touched;
+//	the caller must set its oi_nlink.
+//
+//   Returns: the inode number, or 0 if there are no free inodes.
 
-  
-	return 0;
+static uint32_t
+allocate_inode(void)
+{
+	uint32_t ino = 0;
+	uint32_t probes = 0;
+
+	spin_lock(&ospfs_inomap_lock);
+	while (ospfs_nfree_inos > 0) {
+		ino = ospfs_free_inos[--ospfs_nfree_inos];
+		probes++;
+		// Program defensively: never hand out an inode in use
+		if (ospfs_inode(ino)->oi_nlink == 0)
+			break;
+		ino = 0;
+	}
+	spin_unlock(&ospfs_inomap_lock);
+	ospfs_stat_add(OSPFS_STAT_INODE_ALLOCS, 1);
+	ospfs_stat_add(OSPFS_STAT_INODE_PROBES, probes);
+	ospfs_stat_hist(OSPFS_HIST_INODE_PROBES, probes);
+	return ino;
 }
 
 
-// free_block(blockno)
-//	Use this function to free an allocated block.
-//
-//   Inputs:  blockno -- the block number to be freed
-//   Returns: none
-//
-//   This function should mark the named block as free in the free-block
-//   bitmap.  (You might want to program defensively and make sure the block
-//   number isn't obviously bogus: the boot sector, superblock, free-block
-//   bitmap, and inode blocks must never be freed.  But this is not required.)
+// release_inode(ino)
+//	Puts inode 'ino', whose oi_nlink is 0, back on the free stack.  An
+//	inode that was allocated but never used can be released this way.
 
 static void
-free_block(uint32_t blockno)
+release_inode(uint32_t ino)
 {
-	/* EXERCISE: Your code here */
-  // Done - Vincent
+	spin_lock(&ospfs_inomap_lock);
+	if (ino <= OSPFS_ROOT_INO || ino >= ospfs_super->os_ninodes
+	    || ospfs_inode(ino)->oi_nlink != 0
+	    || ospfs_nfree_inos == ospfs_super->os_ninodes)
+		eprintk("OSPFS: release_inode: bogus inode %u\n", ino);
+	else
+		ospfs_free_inos[ospfs_nfree_inos++] = ino;
+	spin_unlock(&ospfs_inomap_lock);
+}
 
 
-  //Defensive programming? Yeah, maybe if I knew the implementation details of
-  //this module better, and I can't even return error codes! I have to flag it!
-  //Don't make us go in out of our head! 
- 
-  int freemap_idx = blockno / OSPFS_BLKBITSIZE;
-	void * freemap = &ospfs_data[(OSPFS_FREEMAP_BLK + freemap_idx) * OSPFS_BLKSIZE];
-  bitvector_set(freemap, blockno % OSPFS_BLKBITSIZE);
+// free_inode(ino)
+//	Called when inode 'ino' has no links and is not open.  Frees its data
+//	blocks and releases the inode.  The caller holds its ii_sem exclusive.
+//	A big file's blocks may be freed over several transactions.
+
+static void
+free_inode(uint32_t ino)
+{
+	ospfs_inode_t *oi = ospfs_inode(ino);
+
+	ospfs_journal_begin(OSPFS_CREDITS_INODE);
+	if (oi->oi_ftype == OSPFS_FTYPE_REG)
+		change_size(oi, 0);
+	ospfs_journal_extend(OSPFS_CREDITS_INODE);
+	ospfs_journal_dirty(oi);
+	memset(oi, 0, sizeof(ospfs_inode_t));
+	ospfs_journal_end();
+	release_inode(ino);
 }
 
 
+
 /*****************************************************************************
  * FILE OPERATIONS
  *
@@ -812,12 +3967,162 @@ direct_index(uint32_t b)
 }
 
 
-// add_block(ospfs_inode_t *oi)
+// nindirect_needed(n, count)
+//	Returns the number of indirect and doubly-indirect blocks that must be
+//	allocated to grow a file from 'n' to 'n + count' blocks.
+//
+// Inputs:  n     -- current number of blocks in the file
+//	    count -- number of data blocks to add
+
+static uint32_t
+nindirect_needed(uint32_t n, uint32_t count)
+{
+	uint32_t end = n + count;
+	uint32_t first2 = OSPFS_NDIRECT + OSPFS_NINDIRECT;
+	uint32_t needed = 0;
+
+	if (n <= OSPFS_NDIRECT && end > OSPFS_NDIRECT)
+		needed++;		// the indirect block
+	if (n <= first2 && end > first2)
+		needed++;		// the doubly indirect block
+	if (end > first2) {
+		// one indirect block per OSPFS_NINDIRECT blocks under indirect^2
+		uint32_t lo = (n > first2 ? n : first2) - first2;
+		uint32_t hi = end - first2;
+		needed += (hi + OSPFS_NINDIRECT - 1) / OSPFS_NINDIRECT
+			- (lo + OSPFS_NINDIRECT - 1) / OSPFS_NINDIRECT;
+	}
+	return needed;
+}
+
+
+// allocate_zeroed_block()
+//	Allocates a block with allocate_block() and erases it.
+//	Returns the block number, or 0 if the disk is full.
+
+static uint32_t
+allocate_zeroed_block(void)
+{
+	uint32_t blockno = allocate_block();
+	if (blockno) {
+		(void) ospfs_block_new(blockno);
+		ospfs_block_dirty(blockno);
+	}
+	return blockno;
+}
+
+
+// store_blockno(oi, n, blockno)
+//	Makes 'blockno' the file's n'th data block.  Allocates and erases the
+//	indirect and doubly-indirect blocks needed to hold the pointer, if
+//	they don't exist yet.  Returns 0 on success, -ENOSPC if an indirect
+//	block can't be allocated (nothing is changed in that case).
+
+static int
+store_blockno(ospfs_inode_t *oi, uint32_t n, uint32_t blockno)
+{
+	uint32_t *indirect;
+
+	if (indir_index(n) == -1) {
+		oi->oi_direct[direct_index(n)] = blockno;
+		return 0;
+	}
+
+	if (indir2_index(n) == -1) {
+		if (oi->oi_indirect == 0
+		    && (oi->oi_indirect = allocate_zeroed_block()) == 0)
+			return -ENOSPC;
+		indirect = ospfs_block(oi->oi_indirect);
+	} else {
+		uint32_t *indirect2;
+		uint32_t allocated2 = 0;
+
+		if (oi->oi_indirect2 == 0) {
+			if ((allocated2 = allocate_zeroed_block()) == 0)
+				return -ENOSPC;
+			oi->oi_indirect2 = allocated2;
+		}
+		indirect2 = ospfs_block(oi->oi_indirect2);
+		ospfs_journal_dirty(indirect2);
+		if (indirect2[indir_index(n)] == 0
+		    && (indirect2[indir_index(n)] = allocate_zeroed_block()) == 0) {
+			if (allocated2) {
+				free_block(allocated2);
+				oi->oi_indirect2 = 0;
+			}
+			return -ENOSPC;
+		}
+		indirect = ospfs_block(indirect2[indir_index(n)]);
+	}
+
+	ospfs_journal_dirty(indirect);
+	indirect[direct_index(n)] = blockno;
+	return 0;
+}
+
+
+// erase_blocks(blockno, count)
+//	Erases the 'count' consecutive blocks starting at 'blockno'.
+
+static void
+erase_blocks(uint32_t blockno, uint32_t count)
+{
+	struct buffer_head *bh;
+	uint32_t i;
+
+	if (ospfs_blocks_contiguous())
+		memset(ospfs_block(blockno), 0, count * OSPFS_BLKSIZE);
+	else
+		for (i = 0; i < count; i++) {
+			(void) ospfs_data_new(blockno + i, &bh);
+			ospfs_data_put(bh, 1);
+		}
+}
+
+
+// erase_run(start, n, got, keep_lo, keep_hi)
+//	Erases the 'got' new blocks starting at disk block 'start', which are
+//	to become file blocks 'n' on, except for file blocks [keep_lo,
+//	keep_hi).  The kept blocks are one range, so at most a prefix and a
+//	suffix of the run need erasing.
+
+static void
+erase_run(uint32_t start, uint32_t n, uint32_t got, uint32_t keep_lo, uint32_t keep_hi)
+{
+	uint32_t lo = keep_lo > n ? min_t(uint32_t, keep_lo - n, got) : 0;
+	uint32_t hi = keep_hi > n ? min_t(uint32_t, keep_hi - n, got) : 0;
+
+	if (hi <= lo)
+		erase_blocks(start, got);
+	else {
+		erase_blocks(start, lo);
+		erase_blocks(start + hi, got - hi);
+	}
+}
+
+
+// change_size_step(oi)
+//	Called before each step of a size change -- adding or removing a
+//	block, or a run of up to OSPFS_NINDIRECT blocks -- and at a point
+//	where 'oi' is consistent.  Makes sure the journal handle has credits
+//	for the step, restarting it if need be, and journals the inode.
+
+static void
+change_size_step(ospfs_inode_t *oi)
+{
+	ospfs_journal_extend(OSPFS_CREDITS_STEP);
+	ospfs_journal_dirty(oi);
+}
+
+
+// add_block(ospfs_inode_t *oi, erase)
 //   Adds a single data block to a file, adding indirect and
 //   doubly-indirect blocks if necessary. (Helper function for
 //   change_size).
 //
-// Inputs: oi -- pointer to the file we want to grow
+// Inputs: oi    -- pointer to the file we want to grow
+//	   erase -- zero if the caller will fill the whole new block, so it
+//		    needn't be erased first
 // Returns: 0 if successful, < 0 on error.  Specifically:
 //          -ENOSPC if you are unable to allocate a block
 //          due to the disk being full or
@@ -844,109 +4149,199 @@ direct_index(uint32_t b)
 //  3) update the oi->oi_size field
 
 static int
-add_block(ospfs_inode_t *oi)
+add_block(ospfs_inode_t *oi, int erase)
 {
-	// current number of blocks in file
-  // the current block number is n-1, and the
-  // newest block is n, this is because i made the
-  // mistake of zero indexing the helper functions
+	// current number of blocks in file; the new block is block 'n'
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t blockno;
+	int r;
 
-	// keep track of allocations to free in case of -ENOSPC
-  // allocated[0] is data block
-  // allocated[1] is indirect block
-  // allocated[2] is doubly indirect block
-	uint32_t allocated[3] = { 0, 0, 0 };
+	if (n >= OSPFS_MAXFILEBLKS)
+		return -EFBIG;
+	if ((blockno = allocate_block()) == 0)
+		return -ENOSPC;
+	if (erase)
+		erase_blocks(blockno, 1);
+
+	// store_blockno allocates any indirect blocks, and frees them again
+	// if it fails partway
+	if ((r = store_blockno(oi, n, blockno)) < 0) {
+		free_block(blockno);
+		return r;
+	}
 
-  
+	oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
+	return 0;
+}
 
-	/* EXERCISE: Your code here */
-  // Done - Vincent.
-  int idx_block = 0;
-  int idx_data = 0;
-  int new_blocks;
-  char *cur_block_char;
 
-  //hardcoded if this is the first block to be allocated
-  if (n == 0)
-  {
-    if ((oi->oi_direct[0] = allocate_block()) == 0)
-      return -ENOSPC;
+// add_blocks(oi, count, keep_lo, keep_hi)
+//   Adds 'count' data blocks to the end of a file in as few allocator
+//   passes as possible.  (Helper function for change_size.)
+//
+//   Data blocks are taken in contiguous runs of up to OSPFS_NINDIRECT
+//   blocks from allocate_extent(), one journal step each, and erased one
+//   run at a time (one block at a time on a block device),
+//   except for the file blocks numbered [keep_lo, keep_hi), which the
+//   caller is about to fill.  store_blockno() fills in the direct,
+//   indirect, and doubly-indirect slots for each run.  The indirect blocks
+//   are counted up front, so a request that can't fit on the disk fails
+//   with -ENOSPC before anything is allocated.
+//
+// Inputs:  oi      -- pointer to the file we want to grow
+//	    count   -- number of data blocks to add
+//	    keep_lo, keep_hi -- file blocks that needn't be erased
+// Returns: 0 if successful, < 0 on error.  Like add_block, oi->oi_size
+//	    tracks the blocks actually added, so on error the caller can
+//	    undo a partial growth with remove_block.
 
-    cur_block_char = (char *) ospfs_block(oi->oi_direct[0]);
-    for (idx_data = 0; idx_data < OSPFS_BLKSIZE; idx_data++)
-      cur_block_char[idx_data] = 0; 
-    oi->oi_size += OSPFS_BLKSIZE;
-    return 0;
-  }
+static int
+add_blocks(ospfs_inode_t *oi, uint32_t count, uint32_t keep_lo, uint32_t keep_hi)
+{
+	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	int r;
+
+	if (n + count > OSPFS_MAXFILEBLKS)
+		return -EFBIG;
+	if (count + nindirect_needed(n, count) > ospfs_nfree) {
+		// Blocks reserved in pools may make up the difference
+		mutex_lock(&ospfs_freemap_mutex);
+		pool_drain();
+		mutex_unlock(&ospfs_freemap_mutex);
+		if (count + nindirect_needed(n, count) > ospfs_nfree)
+			return -ENOSPC;
+	}
 
-  //Allocating blocks, and freeing if we can't allocate anymore
-  if (indir2_index(n) != indir2_index(n-1))
-    new_blocks = 3;
-  else if (indir_index(n) != indir_index(n-1))
-    new_blocks = 2;
-  else
-    new_blocks = 1;
+	while (count > 0) {
+		uint32_t got, i, start;
+
+		change_size_step(oi);
+		if ((start = allocate_extent(min_t(uint32_t, count, OSPFS_NINDIRECT), &got)) == 0)
+			return -ENOSPC;
+		erase_run(start, n, got, keep_lo, keep_hi);
+
+		for (i = 0; i < got; i++, n++) {
+			if ((r = store_blockno(oi, n, start + i)) < 0) {
+				for (; i < got; i++)
+					free_block(start + i);
+				return r;
+			}
+			oi->oi_size = (n + 1) * OSPFS_BLKSIZE;
+		}
+		count -= got;
+	}
 
-  for (idx_block = 0; idx_block < new_blocks; idx_block++)
-  {
-    allocated[idx_block] = allocate_block();
-    if (allocated[idx_block] == 0)
-    {
-      idx_block--;
-      for ( ; idx_block >= 0; idx_block-- )
-        free_block(allocated[idx_block]);
-      return -ENOSPC;
-    }
-  }
+	return 0;
+}
 
-  //Zeroing out blocks
-  for (idx_block = 0; idx_block < new_blocks; idx_block++)
-  {
-    cur_block_char = (char *) ospfs_block(allocated[idx_block]);
-    for (idx_data = 0; idx_data < OSPFS_BLKSIZE; idx_data++)
-      cur_block_char[idx_data] = 0; 
-  }
 
+// unshare_block(oi, n)
+//   Gives 'oi' its own copy of its n'th data block if that block is shared
+//   with other files, so the file can write to it.  The caller is in a
+//   transaction with 'oi' dirty.
+//
+// Returns: 0 if successful, -ENOSPC if the disk fills up.
 
+static int
+unshare_block(ospfs_inode_t *oi, uint32_t n)
+{
+	uint32_t old = ospfs_inode_blockno(oi, n * OSPFS_BLKSIZE);
+	uint32_t blockno;
+	struct buffer_head *bh, *old_bh;
+	void *old_data;
+	int r;
 
-  //NOTE: 
-  //this threw me off a lot, what is stored inside the indirect and indirect
-  //blocks are the BLOCK NUMBERS, not their pointers
-  if (new_blocks == 3)
-  {
-    oi->oi_indirect2 = allocated[2];
-    *(uint32_t *) ospfs_block(allocated[2]) = allocated[1];
-    *(uint32_t *) ospfs_block(allocated[1]) = allocated[0];
-  }
-  else if (new_blocks == 2)
-  {
+	if (old == 0 || !ospfs_block_shared(old))
+		return 0;
+	if ((blockno = allocate_block()) == 0)
+		return -ENOSPC;
+	if (!(old_data = ospfs_data_get(old, &old_bh))) {
+		free_block(blockno);
+		return -EIO;
+	}
+	memcpy(ospfs_data_new(blockno, &bh), old_data, OSPFS_BLKSIZE);
+	ospfs_data_put(bh, 1);
+	ospfs_data_put(old_bh, 0);
+	if ((r = store_blockno(oi, n, blockno)) < 0) {
+		free_block(blockno);
+		return r;
+	}
+	free_block(old);
+	return 0;
+}
 
-    *(uint32_t *) ospfs_block(allocated[1]) = allocated[0];
 
-    if (indir2_index(n) == 0)
-      ((uint32_t *) ospfs_block(oi->oi_indirect2))[indir_index(n)] = allocated[1];
-    else
-      *(uint32_t *) ospfs_block(oi->oi_indirect) = allocated[1];
-  }
-  else
-  {
-    if (indir2_index(n) == 0)
-      ((uint32_t *) ospfs_block(((uint32_t *) ospfs_block(oi->oi_indirect2))[indir_index(n)]))[direct_index(n)] = allocated[0]; 
-    else if (indir_index(n) != -1)
-      ((uint32_t *) ospfs_block(oi->oi_indirect))[direct_index(n)] = allocated[0];
-    else
-      oi->oi_direct[direct_index(n)] = allocated[0];
-  }
+// fill_holes(oi, lo, hi, keep_lo, keep_hi)
+//   Allocates a block for every hole among file blocks [lo, hi), in
+//   extents as long as the runs of holes allow, up to OSPFS_NINDIRECT
+//   blocks (one journal step).  New blocks are erased
+//   except for file blocks [keep_lo, keep_hi).  Shared blocks in the range
+//   are replaced by private copies.  (Helper function for
+//   change_size_fill.)
+//
+// Returns: 0 if successful, -ENOSPC if the disk fills up.  The holes
+//	    filled before that stay filled.
+
+static int
+fill_holes(ospfs_inode_t *oi, uint32_t lo, uint32_t hi,
+	   uint32_t keep_lo, uint32_t keep_hi)
+{
+	uint32_t n = lo;
+	int r;
 
+	while (n < hi) {
+		uint32_t run, start, got, i;
 
+		change_size_step(oi);
+		if (ospfs_inode_blockno(oi, n * OSPFS_BLKSIZE) != 0) {
+			if ((r = unshare_block(oi, n)) < 0)
+				return r;
+			n++;
+			continue;
+		}
+		for (run = 1; run < OSPFS_NINDIRECT && n + run < hi
+			     && ospfs_inode_blockno(oi, (n + run) * OSPFS_BLKSIZE) == 0; run++)
+			/* do nothing */;
+
+		// A single block comes from this CPU's pool; allocate_block
+		// also knows to drain the pools when the disk runs low
+		start = run > 1 ? allocate_extent(run, &got) : 0;
+		if (start == 0) {
+			got = 1;
+			if ((start = allocate_block()) == 0)
+				return -ENOSPC;
+		}
+		erase_run(start, n, got, keep_lo, keep_hi);
+
+		for (i = 0; i < got; i++, n++)
+			if ((r = store_blockno(oi, n, start + i)) < 0) {
+				for (; i < got; i++)
+					free_block(start + i);
+				return r;
+			}
+	}
+	return 0;
+}
 
 
+// needs_fill(oi, start, end)
+//	Returns nonzero iff some of the bytes [start, end) of 'oi' that lie
+//	inside the file are in a hole or in a shared block, so that writing
+//	them first needs change_size_fill.
 
-  //updating size field
-  oi->oi_size += OSPFS_BLKSIZE;
-  
-	return 0; 
+static int
+needs_fill(ospfs_inode_t *oi, uint32_t start, uint32_t end)
+{
+	uint32_t n, blockno;
+
+	if (ospfs_inode_inline(oi))
+		return 0;
+	end = min_t(uint32_t, end, oi->oi_size);
+	for (n = start / OSPFS_BLKSIZE; n * OSPFS_BLKSIZE < end; n++)
+		if ((blockno = ospfs_inode_blockno(oi, n * OSPFS_BLKSIZE)) == 0
+		    || ospfs_block_shared(blockno))
+			return 1;
+	return 0;
 }
 
 
@@ -959,9 +4354,10 @@ add_block(ospfs_inode_t *oi)
 // Returns: 0 if successful, < 0 on error.
 //          If the function is successful, then oi->oi_size
 //          should be set to the maximum file size that could
-//          fit in oi's blocks.  If the function returns -EIO (for
-//          instance if an indirect block that should be there isn't),
-//          then oi->oi_size should remain unchanged.
+//          fit in oi's blocks.  If the last block is a hole whose
+//          indirect (or doubly-indirect) block is missing too, the whole
+//          hole goes at once: oi->oi_size drops to the first block that
+//          block would have covered.
 //
 // EXERCISE: Finish off this function.
 //
@@ -975,71 +4371,112 @@ add_block(ospfs_inode_t *oi)
 static int
 remove_block(ospfs_inode_t *oi)
 {
-  
-	// current number of blocks in file
-  // Same problem as in add_block, my direc_index, indir_index, and
-  // indir2_index functions are zero indexed, which is incompatible with these
-  // things
+	// current number of blocks in file; the last block is block 'n - 1'
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t b = n - 1;
+	uint32_t *indirect;
 
+	if (n == 0)
+		return 0;
 
-	/* EXERCISE: Your code here */
-  // allocated[0] is data block
-  // allocated[1] is indirect block
-  // allocated[2] is doubly indirect block
-  uint32_t allocated[3] = {0, 0, 0};
+	if (indir_index(b) == -1) {
+		if (oi->oi_direct[b])
+			free_block(oi->oi_direct[b]);
+		oi->oi_direct[b] = 0;
+	} else if (indir2_index(b) == -1) {
+		if (oi->oi_indirect == 0) {
+			oi->oi_size = OSPFS_NDIRECT * OSPFS_BLKSIZE;
+			return 0;
+		}
+		indirect = ospfs_block(oi->oi_indirect);
+		ospfs_journal_dirty(indirect);
+		if (indirect[direct_index(b)])
+			free_block(indirect[direct_index(b)]);
+		indirect[direct_index(b)] = 0;
+		// 'b' was the only block under the indirect block
+		if (b == OSPFS_NDIRECT) {
+			free_block(oi->oi_indirect);
+			oi->oi_indirect = 0;
+			ospfs_bmap_generation++;
+		}
+	} else {
+		uint32_t *indirect2;
+		if (oi->oi_indirect2 == 0) {
+			oi->oi_size = (OSPFS_NDIRECT + OSPFS_NINDIRECT) * OSPFS_BLKSIZE;
+			return 0;
+		}
+		indirect2 = ospfs_block(oi->oi_indirect2);
+		if (indirect2[indir_index(b)] == 0) {
+			// Skip to the first block this indirect block would map
+			b -= direct_index(b);
+		} else {
+			indirect = ospfs_block(indirect2[indir_index(b)]);
+			ospfs_journal_dirty(indirect);
+			if (indirect[direct_index(b)])
+				free_block(indirect[direct_index(b)]);
+			indirect[direct_index(b)] = 0;
+		}
+		if (direct_index(b) == 0 && indirect2[indir_index(b)]) {
+			ospfs_journal_dirty(indirect2);
+			free_block(indirect2[indir_index(b)]);
+			indirect2[indir_index(b)] = 0;
+			ospfs_bmap_generation++;
+		}
+		if (b == OSPFS_NDIRECT + OSPFS_NINDIRECT) {
+			free_block(oi->oi_indirect2);
+			oi->oi_indirect2 = 0;
+		}
+	}
 
-  if (indir2_index(n) != indir2_index(n - 1))
-  {
-    allocated[2] = oi->oi_indirect2; 
-    allocated[1] = ((uint32_t *) ospfs_block(allocated[2]))[0];
-    allocated[0] = ((uint32_t *) ospfs_block(allocated[1]))[0];
-    free_block(allocated[0]);
-    free_block(allocated[1]);
-    free_block(allocated[2]);
+	oi->oi_size = b * OSPFS_BLKSIZE;
+	return 0;
+}
 
-  }
-  else if (indir_index(n) != indir_index(n - 1))
-  {
-    if (indir2_index(n) == 0)
-    {
-      allocated[2] = oi->oi_indirect2; 
-      allocated[1] = ((uint32_t *) ospfs_block(allocated[2]))[indir_index(n-1)];
-      allocated[0] = ((uint32_t *) ospfs_block(allocated[1]))[direct_index(n-1)];
-    }
-    else
-    {
-      allocated[1] = oi->oi_indirect;
-      allocated[0] = ((uint32_t *) ospfs_block(allocated[1]))[direct_index(n-1)];
-    }
-    free_block(allocated[0]);
-    free_block(allocated[1]);
-  }
-  else
-  {
-    if (indir2_index(n) == 0)
-    {
-      allocated[2] = oi->oi_indirect2; 
-      allocated[1] = ((uint32_t *) ospfs_block(allocated[2]))[indir_index(n-1)];
-      allocated[0] = ((uint32_t *) ospfs_block(allocated[1]))[direct_index(n-1)];
-    }
-    else if (indir_index(n) != -1)
-    {
-      allocated[1] = oi->oi_indirect;
-      allocated[0] = ((uint32_t *) ospfs_block(allocated[1]))[direct_index(n-1)];
-    }
-    else
-    {
-      allocated[0] = oi->oi_direct[direct_index(n - 1)];
-    }
-    free_block(allocated[0]);
-  }
 
-  oi->oi_size -= (oi->oi_size % OSPFS_BLKSIZE);
-  //I want it to subtract OSPFS_BLKSIZE, not 0, if oi_size % OSPFS_BLKSIZE == 0
-  if (((oi->oi_size % OSPFS_BLKSIZE) == 0) && (oi->oi_size != 0))
-    oi->oi_size -= OSPFS_BLKSIZE;
-	return 0; 
+// inline_spill(oi)
+//	Moves inline file 'oi's data to a new block, making it an ordinary
+//	file of the same size.  Returns 0 on success, -ENOSPC if no block is
+//	free (nothing is changed in that case).  The caller has journaled
+//	the inode.
+
+static int
+inline_spill(ospfs_inode_t *oi)
+{
+	ospfs_inline_inode_t *ioi = (ospfs_inline_inode_t *) oi;
+	uint32_t blockno = 0;
+	struct buffer_head *bh;
+
+	if (oi->oi_size > 0) {
+		if ((blockno = allocate_block()) == 0)
+			return -ENOSPC;
+		memcpy(ospfs_data_new(blockno, &bh), ioi->oi_data, oi->oi_size);
+		ospfs_data_put(bh, 1);
+	}
+	memset(ioi->oi_data, 0, OSPFS_MAXINLINELEN);
+	oi->oi_mode &= ~OSPFS_MODE_INLINE;
+	if (blockno)
+		oi->oi_direct[0] = blockno;
+	return 0;
+}
+
+
+// SPARSE FILES
+//	A 0 block pointer inside a regular file -- in oi_direct, in an
+//	indirect block, or standing for a whole missing indirect block -- is
+//	a hole, which reads as zeros.  Growing a regular file only changes its
+//	size, so the new space is all hole; ospfs_write and writeback fill in
+//	blocks when data first lands in them.  Directories and the journal
+//	are never sparse: their blocks are written through pointers without
+//	a chance to allocate.
+
+// ospfs_inode_sparse(oi)
+//	Returns nonzero iff 'oi' may have holes.
+
+static inline int
+ospfs_inode_sparse(ospfs_inode_t *oi)
+{
+	return oi->oi_ftype == OSPFS_FTYPE_REG
+		&& ospfs_inode_ino(oi) != OSPFS_JOURNAL_INODE;
 }
 
 
@@ -1051,11 +4488,13 @@ remove_block(ospfs_inode_t *oi)
 //	      want_size -- the requested size in bytes
 //   Returns: 0 on success, < 0 on error.  In particular:
 //		-ENOSPC: if there are no free blocks available
+//		-EFBIG:  if 'want_size' exceeds OSPFS_MAXFILESIZE
 //		-EIO:    an I/O error -- for example an indirect block should
 //			 exist, but doesn't
 //	      If the function succeeds, the file's oi_size member should be
 //	      changed to want_size, with blocks allocated as appropriate.
 //	      Any newly-allocated blocks should be erased (set to 0).
+//	      (A sparse file grows by a hole instead.)
 //	      If there is an -ENOSPC error when growing a file,
 //	      the file size and allocated blocks should not change from their
 //	      original values!!!
@@ -1066,9 +4505,10 @@ remove_block(ospfs_inode_t *oi)
 //   is good -- the function is pretty easy.  But the function might have
 //   to add or remove blocks.
 //
-//   If you need to grow the file, then do so by adding one block at a time
-//   using the add_block function you coded above. If one of these additions
-//   fails with -ENOSPC, you must shrink the file back to its original size!
+//   To grow the file by one block, we use add_block.  Larger growths use
+//   add_blocks, which allocates contiguous extents in one pass of the
+//   free map.  If either fails with -ENOSPC, the file is shrunk back to
+//   its original size!
 //
 //   If you need to shrink the file, remove blocks from the end of
 //   the file one at a time using the remove_block function you coded above.
@@ -1077,69 +4517,302 @@ remove_block(ospfs_inode_t *oi)
 //         (The value that the final add_block or remove_block set it to
 //          is probably not correct).
 //
+//   The change is journaled a step at a time (see change_size_step), so
+//   a big one may span transactions; each step leaves the file consistent.
+//   The caller holds the file's ii_sem exclusive.
+//
 //   EXERCISE: Finish off this function.
 
 static int
 change_size(ospfs_inode_t *oi, uint32_t new_size)
 {
-	//uint32_t old_size = oi->oi_size;
+	return change_size_fill(oi, new_size, 0, 0);
+}
+
+
+// change_size_fill(oi, new_size, fill_start, fill_end)
+//	Like change_size, but the caller promises to write the bytes
+//	[fill_start, fill_end) right away, while still holding ii_sem.  In a
+//	sparse file, the holes in that range are filled with new blocks.
+//	New blocks past the old end of file that the range covers, and those
+//	whose only unfilled bytes lie past the new end of file, are not
+//	erased -- they would only be overwritten.  If the caller fills less
+//	than it promised, it must shrink the file back over the unfilled
+//	bytes.
+
+static int
+change_size_fill(ospfs_inode_t *oi, uint32_t new_size,
+		 uint32_t fill_start, uint32_t fill_end)
+{
+	uint32_t old_size = oi->oi_size;
+	uint32_t old_nblocks = ospfs_size2nblocks(old_size);
+	uint32_t new_nblocks = ospfs_size2nblocks(new_size);
+	uint32_t keep_lo = max_t(uint32_t, ospfs_size2nblocks(fill_start), old_nblocks);
+	uint32_t keep_hi = fill_end >= new_size ? new_nblocks : fill_end / OSPFS_BLKSIZE;
 	int r = 0;
 
-    while (ospfs_size2nblocks(oi->oi_size) < ospfs_size2nblocks(new_size)) {
+	if (fill_end <= fill_start || !ospfs_delalloc)
+		keep_lo = keep_hi = 0;
+
+	ospfs_journal_begin(OSPFS_CREDITS_STEP);
+	ospfs_journal_dirty(oi);
+
+	// Inline data stays in the inode while it fits
+	if (ospfs_inode_inline(oi)) {
+		ospfs_inline_inode_t *ioi = (ospfs_inline_inode_t *) oi;
+		if (new_size <= OSPFS_MAXINLINELEN) {
+			if (new_size > old_size)
+				memset(ioi->oi_data + old_size, 0, new_size - old_size);
+			oi->oi_size = new_size;
+			goto out;
+		}
+		if ((r = inline_spill(oi)) < 0)
+			goto out;
+	}
+
+	// Data past the old end of file in its last block may be left over
+	// from before a shrink; erase it so the growth reads as zeros.
+	if (new_size > old_size && old_size % OSPFS_BLKSIZE != 0
+	    && ospfs_inode_blockno(oi, old_size - 1) != 0) {
+		uint32_t blockno;
+		struct buffer_head *bh = NULL;
+		char *slack;
+		if ((r = unshare_block(oi, (old_size - 1) / OSPFS_BLKSIZE)) < 0)
+			goto out;
+		blockno = ospfs_inode_blockno(oi, old_size - 1);
+		if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
+			slack = ospfs_block(blockno);
+			ospfs_journal_dirty(slack);
+		} else if (!(slack = ospfs_data_get(blockno, &bh))) {
+			r = -EIO;
+			goto out;
+		}
+		memset(slack + old_size % OSPFS_BLKSIZE, 0, OSPFS_BLKSIZE - old_size % OSPFS_BLKSIZE);
+		ospfs_data_put(bh, 1);
+	}
+
+	if (ospfs_inode_sparse(oi)) {
+		// Grow by a hole, then fill in the blocks the caller will write
+		if (new_size > old_size)
+			oi->oi_size = new_size;
+		if (fill_end > fill_start)
+			r = fill_holes(oi, fill_start / OSPFS_BLKSIZE,
+				       ospfs_size2nblocks(min_t(uint32_t, fill_end, oi->oi_size)),
+				       keep_lo, keep_hi);
+	} else if (new_nblocks == old_nblocks + 1)
+		// Growing by a single block (the common append case) goes
+		// through add_block; anything larger is allocated in extents.
+		r = add_block(oi, old_nblocks < keep_lo || old_nblocks >= keep_hi);
+	else if (new_nblocks > old_nblocks)
+		r = add_blocks(oi, new_nblocks - old_nblocks, keep_lo, keep_hi);
+
+	if (r < 0) {
+		// Undo any partial growth
+		while (ospfs_size2nblocks(oi->oi_size) > old_nblocks) {
+			change_size_step(oi);
+			if (remove_block(oi) < 0)
+				break;
+		}
+		oi->oi_size = old_size;
+		goto out;
+	}
+
+	while (ospfs_size2nblocks(oi->oi_size) > new_nblocks) {
+		change_size_step(oi);
+		if ((r = remove_block(oi)) < 0)
+			goto out;
+	}
+
+	oi->oi_size = new_size;
+	if (new_nblocks > old_nblocks)
+		ospfs_stat_add(OSPFS_STAT_BLOCKS_ADDED, new_nblocks - old_nblocks);
+	else
+		ospfs_stat_add(OSPFS_STAT_BLOCKS_REMOVED, old_nblocks - new_nblocks);
+
+	// An emptied file starts over with inline data
+	if (new_size == 0 && ospfs_inode_sparse(oi))
+		oi->oi_mode |= OSPFS_MODE_INLINE;
+
+    out:
+	ospfs_journal_end();
+	return r;
+}
+
+
+// ospfs_notify_change
+//	This function gets called when the user changes a file's size,
+//	owner, or permissions, among other things.
+//	OSPFS only pays attention to file size changes (see change_size above).
+//	We have written this function for you -- except for file quotas.
+
+static int
+ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_inode_info_t *ii = ospfs_inode_info(inode->i_ino);
+	int retval = 0;
+
+	// Drop cached pages past a new, smaller size before their blocks go,
+	// so writeback can't write into freed blocks
+	if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size < i_size_read(inode))
+		truncate_inode_pages(inode->i_mapping, attr->ia_size);
+
+	down_write(&ii->ii_sem);
+	ospfs_journal_begin(OSPFS_CREDITS_INODE);
+	if (attr->ia_valid & ATTR_SIZE) {
+		// We should not be able to change directory size
+		if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
+			retval = -EPERM;
+			goto out;
+		}
+		if ((retval = change_size(oi, attr->ia_size)) < 0)
+			goto out;
+	}
+
+	if (attr->ia_valid & ATTR_MODE) {
+		// Set this inode's mode to the value 'attr->ia_mode'.
+		ospfs_journal_extend(OSPFS_CREDITS_INODE);
+		ospfs_journal_dirty(oi);
+		oi->oi_mode = attr->ia_mode | (oi->oi_mode & OSPFS_MODE_INLINE);
+	}
+
+	if ((retval = inode_change_ok(inode, attr)) < 0
+	    || (retval = inode_setattr(inode, attr)) < 0)
+		goto out;
+
+    out:
+	ospfs_journal_end();
+	up_write(&ii->ii_sem);
+	return retval;
+}
+
+
+// ospfs_inode_nallocated(oi)
+//	Returns the number of blocks 'oi' takes up on the disk: its data
+//	blocks, which for a sparse file may be far fewer than its size
+//	suggests, and its indirect blocks.  A block shared with other files
+//	counts for each of them.
+
+static uint32_t
+ospfs_inode_nallocated(ospfs_inode_t *oi)
+{
+	uint32_t *indirect, *indirect2, n = 0, i, j;
+
+	if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK || ospfs_inode_inline(oi))
+		return 0;
+	for (i = 0; i < OSPFS_NDIRECT; i++)
+		n += oi->oi_direct[i] != 0;
+	if (oi->oi_indirect && (indirect = ospfs_block(oi->oi_indirect))) {
+		for (n++, j = 0; j < OSPFS_NINDIRECT; j++)
+			n += indirect[j] != 0;
+	}
+	if (oi->oi_indirect2 && (indirect2 = ospfs_block(oi->oi_indirect2))) {
+		for (n++, i = 0; i < OSPFS_NINDIRECT; i++) {
+			if (!indirect2[i] || !(indirect = ospfs_block(indirect2[i])))
+				continue;
+			for (n++, j = 0; j < OSPFS_NINDIRECT; j++)
+				n += indirect[j] != 0;
+		}
+	}
+	return n;
+}
+
+
+// ospfs_getattr(mnt, dentry, stat)
+//	Fills in 'stat' for stat(2).  The Linux inode doesn't track how many
+//	blocks the file uses, so this counts them, and st_blocks (and du)
+//	tell a sparse file from a full one.
+
+static int
+ospfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_info_t *ii = ospfs_inode_info(inode->i_ino);
+
+	generic_fillattr(inode, stat);
+	down_read(&ii->ii_sem);
+	stat->blocks = (unsigned long long) ospfs_inode_nallocated(ospfs_inode(inode->i_ino))
+		<< (OSPFS_BLKSIZE_BITS - 9);
+	up_read(&ii->ii_sem);
+	return 0;
+}
 
-      /* EXERCISE: Your code here */
-      //Done - Vincent.
-      if ((r = add_block(oi)) < 0)
-        return r;
 
-    }
-    while (ospfs_size2nblocks(oi->oi_size) > ospfs_size2nblocks(new_size)) {
-      /* EXERCISE: Your code here */
-      //Done - Vincent.
-      if ((r = remove_block(oi)) < 0)
-        return r;
-    }
- // }
+// ospfs_contig_bytes(oi, offset, blockno, max, cur)
+//	Returns how many bytes of 'oi's data, starting at 'offset' and up to
+//	'max', are stored in physically consecutive blocks.  'blockno' must
+//	be the block that holds the 'offset'th byte.  Since the disk is one
+//	array, such a run can be moved with a single copy.  On a block device
+//	it can't, so runs end at the end of the block.  'cur' is the
+//	caller's copy of the block-map cursor, or NULL.
 
-	/* EXERCISE: Make sure you update necessary file meta data
-	             and return the proper value. */
-  //Done - Vincent.
-  oi->oi_size = new_size;  
-	return 0; // Replace this line
+static uint32_t
+ospfs_contig_bytes(ospfs_inode_t *oi, uint32_t offset, uint32_t blockno, uint32_t max,
+		   ospfs_bmap_cursor_t *cur)
+{
+	uint32_t n = OSPFS_BLKSIZE - offset % OSPFS_BLKSIZE;
+
+	while (n < max && ospfs_blocks_contiguous()
+	       && ospfs_cursor_blockno(oi, offset + n, cur) == ++blockno)
+		n += OSPFS_BLKSIZE;
+	return n < max ? n : max;
 }
 
 
-// ospfs_notify_change
-//	This function gets called when the user changes a file's size,
-//	owner, or permissions, among other things.
-//	OSPFS only pays attention to file size changes (see change_size above).
-//	We have written this function for you -- except for file quotas.
+// ospfs_open, ospfs_release
+//	Linux calls these functions when a regular file is opened and when
+//	its last reference is closed.  They set up and free the open file's
+//	block-map cursor, and count the inode's open files so an unlinked
+//	file's blocks survive until it is closed.
 
 static int
-ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
+ospfs_open(struct inode *inode, struct file *filp)
 {
-	struct inode *inode = dentry->d_inode;
-	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
-	int retval = 0;
+	ospfs_inode_info_t *ii = ospfs_inode_info(inode->i_ino);
+	ospfs_open_file_t *of;
 
-	if (attr->ia_valid & ATTR_SIZE) {
-		// We should not be able to change directory size
-		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
-			return -EPERM;
-		if ((retval = change_size(oi, attr->ia_size)) < 0)
-			goto out;
+	if (!(of = kzalloc(sizeof(ospfs_open_file_t), GFP_KERNEL)))
+		return -ENOMEM;
+	spin_lock_init(&of->of_lock);
+	filp->private_data = of;
+	down_write(&ii->ii_sem);
+	ii->ii_nopen++;
+	up_write(&ii->ii_sem);
+	return 0;
+}
+
+static int
+ospfs_release(struct inode *inode, struct file *filp)
+{
+	ospfs_inode_info_t *ii = ospfs_inode_info(inode->i_ino);
+
+	kfree(filp->private_data);
+	filp->private_data = NULL;
+
+	// Free a file that was unlinked while it was open.  Its inode number
+	// may be reused at once, so the cached inode must not be found again.
+	down_write(&ii->ii_sem);
+	if (--ii->ii_nopen == 0 && ospfs_inode(inode->i_ino)->oi_nlink == 0) {
+		remove_inode_hash(inode);
+		free_inode(inode->i_ino);
 	}
+	up_write(&ii->ii_sem);
+	return 0;
+}
 
-	if (attr->ia_valid & ATTR_MODE)
-		// Set this inode's mode to the value 'attr->ia_mode'.
-		oi->oi_mode = attr->ia_mode;
 
-	if ((retval = inode_change_ok(inode, attr)) < 0
-	    || (retval = inode_setattr(inode, attr)) < 0)
-		goto out;
+// ospfs_fsync(filp, dentry, datasync)
+//	Linux calls this function for fsync(2) and fdatasync(2), on files and
+//	directories.  Commits the journal's running transaction, then, on a
+//	block device, writes the dirty blocks to the disk.
 
-    out:
-	return retval;
+static int
+ospfs_fsync(struct file *filp, struct dentry *dentry, int datasync)
+{
+	ospfs_journal_flush();
+	ospfs_sync_disk();
+	return 0;
 }
 
 
@@ -1154,74 +4827,92 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 //   Returns: Number of chars read on success, -(error code) on error.
 //
 //   This function copies the corresponding bytes from the file into the user
-//   space ptr (buffer).  Use copy_to_user() to accomplish this.
-//   The current file position is passed into the function
-//   as 'f_pos'; read data starting at that position, and update the position
-//   when you're done.
-//
-//   EXERCISE: Complete this function.
-
-
+//   space ptr (buffer), using one copy_to_user() call per run of physically
+//   consecutive blocks, and clear_user() for holes.  The current file
+//   position is passed into the function as 'f_pos'; read data starting at
+//   that position, and update the position when you're done.
 
 static ssize_t
 ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	ino_t ino = filp->f_dentry->d_inode->i_ino;
+	ospfs_inode_t *oi = ospfs_inode(ino);
+	ospfs_inode_info_t *ii = ospfs_inode_info(ino);
+	ospfs_bmap_cursor_t cursor, *cur = &cursor;
+	struct address_space *mapping = filp->f_dentry->d_inode->i_mapping;
 	int retval = 0;
 	size_t amount = 0;
+	ktime_t start_time = ktime_get();
 
-	// Make sure we don't read past the end of the file!
-	// Change 'count' so we never read past the end of the file.
- 
-  // Objective: try to find where the current file size is, and
-  // return the min of count and filesizeleft (which is probably
-  // something to do with f_pos - filp and filesize)
+	// Write pages dirtied through mmap back to their blocks first
+	if (mapping->nrpages)
+		filemap_write_and_wait(mapping);
 
-	/* EXERCISE: Your code here */
-  //Done - Vincent.
+	down_read(&ii->ii_sem);
+	ospfs_cursor_get(filp, cur);
 
-  //Note: f_pos is casted to a uint32_t in the ospfs_inode_blockno function, and
-  //looking inside it, we see that it is just a zero offset from the beginning
-  //of the file
-  count = count < (oi->oi_size - (uint32_t) *f_pos) ? count : (oi->oi_size - (uint32_t) *f_pos);
+	// Make sure we don't read past the end of the file!
+	if (*f_pos >= oi->oi_size)
+		count = 0;
+	else if (count > oi->oi_size - *f_pos)
+		count = oi->oi_size - *f_pos;
+
+	// Inline data comes straight from the inode
+	if (ospfs_inode_inline(oi) && count > 0) {
+		ospfs_inline_inode_t *ioi = (ospfs_inline_inode_t *) oi;
+		if (copy_to_user(buffer, ioi->oi_data + *f_pos, count) != 0) {
+			retval = -EFAULT;
+			goto done;
+		}
+		amount = count;
+		*f_pos += count;
+	}
 
-	// Copy the data to user block by block
+	// Copy the data to user one contiguous run at a time
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
+		uint32_t blockno = ospfs_cursor_blockno(oi, *f_pos, cur);
 		uint32_t n;
 		char *data;
 
-		// ospfs_inode_blockno returns 0 on error
-
+		// ospfs_inode_blockno returns 0 for a hole, which reads as zeros
 		if (blockno == 0) {
-			retval = -EIO;
-			goto done;
+			n = min_t(uint32_t, OSPFS_BLKSIZE - *f_pos % OSPFS_BLKSIZE,
+				  count - amount);
+			if (clear_user(buffer, n) != 0) {
+				retval = -EFAULT;
+				goto done;
+			}
+		} else {
+			struct buffer_head *bh;
+			if (!(data = ospfs_data_get(blockno, &bh))) {
+				retval = -EIO;
+				goto done;
+			}
+			data += *f_pos % OSPFS_BLKSIZE;
+			n = ospfs_contig_bytes(oi, *f_pos, blockno, count - amount, cur);
+
+			// Copy data into user space. Return -EFAULT if unable
+			// to write into user space.
+			if (copy_to_user(buffer, data, n) != 0)
+				retval = -EFAULT;
+			ospfs_data_put(bh, 0);
+			if (retval < 0)
+				goto done;
 		}
 
-		data = ospfs_block(blockno);
-
-
-		// Figure out how much data is left in this block to read.
-		// Copy data into user space. Return -EFAULT if unable to write
-		// into user space.
-		// Use variable 'n' to track number of bytes moved.
-		/* EXERCISE: Your code here */
-    // Done - Vincent.
-
-    // Just a nice cmov so I can perform less if statement branching yay
-    n = (count - amount) > OSPFS_BLKSIZE ? OSPFS_BLKSIZE : (count - amount) ;
-
-    //Copying over the data
-    if (copy_to_user(buffer, data, n) != 0)
-      return -EFAULT; 
-
-
 		buffer += n;
 		amount += n;
 		*f_pos += n;
 	}
 
     done:
+	ospfs_cursor_put(filp, cur);
+	up_read(&ii->ii_sem);
+	ospfs_stat_add(OSPFS_STAT_READ_CALLS, 1);
+	ospfs_stat_add(OSPFS_STAT_READ_BYTES, amount);
+	ospfs_stat_time(OSPFS_HIST_READ_NS, start_time);
+	ospfs_trace_event(OSPFS_TRACE_READ, ino, *f_pos - amount,
+			  retval >= 0 ? (ssize_t) amount : retval);
 	return (retval >= 0 ? amount : retval);
 }
 
@@ -1237,80 +4928,95 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 //   Returns: Number of chars written on success, -(error code) on error.
 //
 //   This function copies the corresponding bytes from the user space ptr
-//   into the file.  Use copy_from_user() to accomplish this. Unlike read(),
-//   where you cannot read past the end of the file, it is OK to write past
-//   the end of the file; this should simply change the file's size.
-//
-//   EXERCISE: Complete this function.
+//   into the file, using one copy_from_user() call per run of physically
+//   consecutive blocks.  Unlike read(), where you cannot read past the end
+//   of the file, it is OK to write past the end of the file; this simply
+//   changes the file's size.
 
 static ssize_t
 ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	struct inode *inode = filp->f_dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
+	ospfs_inode_info_t *ii = ospfs_inode_info(inode->i_ino);
+	ospfs_bmap_cursor_t cursor, *cur = &cursor;
+	struct address_space *mapping = inode->i_mapping;
+	uint32_t old_size;
+	loff_t start;
 	int retval = 0;
-  int r = 0;
 	size_t amount = 0;
-  int init_offset;
-
-	// Support files opened with the O_APPEND flag.  To detect O_APPEND,
-	// use struct file's f_flags field and the O_APPEND bit.
-	/* EXERCISE: Your code here */
-  // Done - Vincent.
-  if ((filp->f_flags & O_APPEND) != 0) 
-    *f_pos = oi->oi_size;
+	ktime_t start_time = ktime_get();
 
-  init_offset = *f_pos % OSPFS_BLKSIZE;
+	// The page cache may hold some of these bytes: write back what mmap
+	// dirtied, then drop the overwritten pages once the blocks are updated
+	if (mapping->nrpages)
+		filemap_write_and_wait(mapping);
 
-	// If the user is writing past the end of the file, change the file's
-	// size to accomodate the request.  (Use change_size().)
-	/* EXERCISE: Your code here */
-  // Done - Vincent.
-  if (DEBUG_OSPFS_WRITE)
-    eprintk("count + *fpos: %d + %d\n", count, *f_pos);
-
-  if (DEBUG_OSPFS_WRITE)
-    eprintk("oi->size: %d\n", oi->oi_size);
+	down_write(&ii->ii_sem);
+	ospfs_cursor_get(filp, cur);
 
-  if ( (uint32_t) count + (uint32_t) *f_pos >= oi->oi_size)
-    if ((r = change_size(oi, (uint32_t) count + (uint32_t) *f_pos)) < 0)
-      return r;
+	// Support files opened with the O_APPEND flag.
+	if ((filp->f_flags & O_APPEND) != 0)
+		*f_pos = oi->oi_size;
+	start = *f_pos;
+	old_size = oi->oi_size;
 
-  if (DEBUG_OSPFS_WRITE)
-    eprintk("oi->size: %d\n", oi->oi_size);
+	// If the user is writing past the end of the file, change the file's
+	// size to accomodate the request.
+	if (*f_pos + count > OSPFS_MAXFILESIZE) {
+		retval = -EFBIG;
+		goto done;
+	}
+	// Allocate blocks for the holes we will fill, and copy shared blocks
+	// we will write.  With delayed allocation, new blocks past the end of
+	// file are not erased first.
+	if ((uint32_t) count + (uint32_t) *f_pos > oi->oi_size
+	    || needs_fill(oi, *f_pos, *f_pos + count)) {
+		uint32_t end = (uint32_t) count + (uint32_t) *f_pos;
+		if ((retval = change_size_fill(oi, max_t(uint32_t, end, oi->oi_size),
+					       *f_pos, end)) < 0)
+			goto done;
+	}
+	i_size_write(inode, oi->oi_size);
+
+	// Inline data goes straight into the inode, through the journal
+	if (ospfs_inode_inline(oi) && count > 0) {
+		ospfs_inline_inode_t *ioi = (ospfs_inline_inode_t *) oi;
+		ospfs_journal_begin(OSPFS_CREDITS_INODE);
+		ospfs_journal_dirty(oi);
+		if (copy_from_user(ioi->oi_data + *f_pos, buffer, count) != 0)
+			retval = -EFAULT;
+		else {
+			amount = count;
+			*f_pos += count;
+		}
+		ospfs_journal_end();
+	}
 
-	// Copy data block by block
+	// Copy data one contiguous run at a time
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
+		uint32_t blockno = ospfs_cursor_blockno(oi, *f_pos, cur);
 		uint32_t n;
+		struct buffer_head *bh;
 		char *data;
 
-		if (blockno == 0) {
+		if (blockno == 0 || !(data = ospfs_data_get(blockno, &bh))) {
 			retval = -EIO;
 			goto done;
 		}
 
-		data = ospfs_block(blockno);
+		data += *f_pos % OSPFS_BLKSIZE;
+		n = ospfs_contig_bytes(oi, *f_pos, blockno, count - amount, cur);
 
-		// Figure out how much data is left in this block to write.
 		// Copy data from user space. Return -EFAULT if unable to read
 		// read user space.
-		// Keep track of the number of bytes moved in 'n'.
-		/* EXERCISE: Your code here */
-    // Done - Vincent.
-    n = (count - amount) > OSPFS_BLKSIZE ? OSPFS_BLKSIZE : (count - amount) ;
-
-    if (DEBUG_OSPFS_WRITE)
-      eprintk("write: value of n %d\n", n);
-
-    if (DEBUG_OSPFS_WRITE)
-      eprintk("write: value of init_offset %d\n", init_offset);
-    if (DEBUG_OSPFS_WRITE)
-      eprintk("oi->size: %d\n", oi->oi_size);
-
-    if (copy_from_user(data + init_offset, buffer, n) != 0)
-      return -EFAULT;
-    init_offset = 0;
-    
+		if (copy_from_user(data, buffer, n) != 0) {
+			ospfs_data_put(bh, 0);
+			retval = -EFAULT;
+			goto done;
+		}
+		// (A run longer than one block only happens in array mode.)
+		ospfs_data_put(bh, 1);
 
 		buffer += n;
 		amount += n;
@@ -1318,10 +5024,219 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 	}
 
     done:
+	// Unerased blocks past what we wrote must not become readable
+	if (retval < 0 && oi->oi_size > old_size) {
+		change_size(oi, amount ? max_t(uint32_t, old_size, *f_pos) : old_size);
+		i_size_write(inode, oi->oi_size);
+	}
+	ospfs_cursor_put(filp, cur);
+	up_write(&ii->ii_sem);
+	if (amount > 0 && mapping->nrpages)
+		invalidate_inode_pages2_range(mapping, start >> PAGE_CACHE_SHIFT,
+					      (*f_pos - 1) >> PAGE_CACHE_SHIFT);
+	ospfs_stat_add(OSPFS_STAT_WRITE_CALLS, 1);
+	ospfs_stat_add(OSPFS_STAT_WRITE_BYTES, amount);
+	ospfs_stat_time(OSPFS_HIST_WRITE_NS, start_time);
+	ospfs_trace_event(OSPFS_TRACE_WRITE, inode->i_ino, start,
+			  retval >= 0 ? (ssize_t) amount : retval);
 	return (retval >= 0 ? amount : retval);
 }
 
 
+// PAGE CACHE
+//	Regular files also have address_space_operations, so Linux can cache
+//	their data in page-cache pages.  mmap(2) and its readahead use them,
+//	as do generic_file_read()/generic_file_write(), sendfile(2) and
+//	splice(2); the last two hand the pages to the pipe or socket without
+//	copying them.  Each page covers PAGE_CACHE_SIZE / OSPFS_BLKSIZE file
+//	blocks, found with ospfs_inode_blockno.  ospfs_read and ospfs_write
+//	still copy straight between user space and the blocks, which saves
+//	the page-cache copy; they write back and invalidate cached pages to
+//	stay coherent with mmap and sendfile.  ospfs_notify_change drops the
+//	pages past a new, smaller size before their blocks are freed.
+
+// ospfs_block_bytes(oi, pos)
+//	Returns how many bytes of the file block starting at byte 'pos' lie
+//	before the end of the file: OSPFS_BLKSIZE, fewer for the last block,
+//	or 0 for a block past the end.
+
+static inline uint32_t
+ospfs_block_bytes(ospfs_inode_t *oi, loff_t pos)
+{
+	if (pos >= oi->oi_size)
+		return 0;
+	else if (oi->oi_size - pos < OSPFS_BLKSIZE)
+		return oi->oi_size - pos;
+	else
+		return OSPFS_BLKSIZE;
+}
+
+
+// ospfs_fill_page(oi, page)
+//	Copies 'oi's data into the locked page 'page' and marks it up to
+//	date.  Holes, and the part of the page past the end of the file, are
+//	zeroed.
+//
+//   Returns: 0 on success, -EIO if a block can't be read (the page is
+//	      then marked with an error instead).
+
+static int
+ospfs_fill_page(ospfs_inode_t *oi, struct page *page)
+{
+	loff_t pos = (loff_t) page->index << PAGE_CACHE_SHIFT;
+	char *kaddr = kmap(page);
+	uint32_t off, n;
+	int retval = 0;
+
+	if (ospfs_inode_inline(oi)) {
+		n = pos == 0 ? oi->oi_size : 0;
+		memcpy(kaddr, ((ospfs_inline_inode_t *) oi)->oi_data, n);
+		memset(kaddr + n, 0, PAGE_CACHE_SIZE - n);
+		goto out;
+	}
+
+	for (off = 0; off < PAGE_CACHE_SIZE; off += OSPFS_BLKSIZE) {
+		if ((n = ospfs_block_bytes(oi, pos + off)) > 0) {
+			uint32_t blockno = ospfs_inode_blockno(oi, pos + off);
+			struct buffer_head *bh;
+			void *data;
+			if (blockno == 0)
+				n = 0;		// A hole
+			else if (!(data = ospfs_data_get(blockno, &bh))) {
+				retval = -EIO;
+				n = 0;
+			} else {
+				memcpy(kaddr + off, data, n);
+				ospfs_data_put(bh, 0);
+			}
+		}
+		memset(kaddr + off + n, 0, OSPFS_BLKSIZE - n);
+	}
+
+    out:
+	flush_dcache_page(page);
+	kunmap(page);
+	if (retval < 0)
+		SetPageError(page);
+	else
+		SetPageUptodate(page);
+	return retval;
+}
+
+
+// ospfs_readpage(filp, page)
+//	Linux calls this function to read a page of a regular file into the
+//	page cache.  It is the address_space_operations.readpage callback.
+//	The block pointers are read under the file's ii_sem, so a truncate
+//	can't free the blocks under the copy.
+
+static int
+ospfs_readpage(struct file *filp, struct page *page)
+{
+	ino_t ino = page->mapping->host->i_ino;
+	ospfs_inode_info_t *ii = ospfs_inode_info(ino);
+	int retval;
+
+	down_read(&ii->ii_sem);
+	retval = ospfs_fill_page(ospfs_inode(ino), page);
+	up_read(&ii->ii_sem);
+	unlock_page(page);
+	return retval;
+}
+
+
+// ospfs_writepage(page, wbc)
+//	Linux calls this function to write a dirty page-cache page back to
+//	the file's blocks.  It is the address_space_operations.writepage
+//	callback.  Bytes past the end of the file aren't written, so a page
+//	left over from a truncate writes nothing.  Holes under the page
+//	(dirtied through mmap) get their blocks here.  An inline file's page
+//	is copied back into the inode.  All this holds the file's ii_sem
+//	exclusive, so a truncate can't free the blocks under the copy.
+//	Memory reclaim may call this inside a journal handle, which must not
+//	wait for an ii_sem; the page is left dirty for later then.
+
+static int
+ospfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	ino_t ino = page->mapping->host->i_ino;
+	ospfs_inode_t *oi = ospfs_inode(ino);
+	ospfs_inode_info_t *ii = ospfs_inode_info(ino);
+	loff_t pos = (loff_t) page->index << PAGE_CACHE_SHIFT;
+	char *kaddr;
+	uint32_t off, n;
+	int retval = 0;
+
+	if (current->journal_info) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+
+	down_write(&ii->ii_sem);
+	if (ospfs_inode_inline(oi)) {
+		if (pos == 0) {
+			ospfs_journal_begin(OSPFS_CREDITS_INODE);
+			ospfs_journal_dirty(oi);
+			kaddr = kmap(page);
+			memcpy(((ospfs_inline_inode_t *) oi)->oi_data, kaddr, oi->oi_size);
+			kunmap(page);
+			ospfs_journal_end();
+		}
+		up_write(&ii->ii_sem);
+		unlock_page(page);
+		return 0;
+	}
+
+	if (needs_fill(oi, pos, pos + PAGE_CACHE_SIZE)
+	    && (retval = change_size_fill(oi, oi->oi_size, pos, pos + PAGE_CACHE_SIZE)) < 0) {
+		up_write(&ii->ii_sem);
+		SetPageError(page);
+		unlock_page(page);
+		return retval;
+	}
+
+	set_page_writeback(page);
+	kaddr = kmap(page);
+	for (off = 0; off < PAGE_CACHE_SIZE
+		     && (n = ospfs_block_bytes(oi, pos + off)) > 0;
+	     off += OSPFS_BLKSIZE) {
+		uint32_t blockno = ospfs_inode_blockno(oi, pos + off);
+		struct buffer_head *bh;
+		void *data;
+		if (blockno == 0 || !(data = ospfs_data_get(blockno, &bh))) {
+			retval = -EIO;
+			break;
+		}
+		memcpy(data, kaddr + off, n);
+		ospfs_data_put(bh, 1);
+	}
+	kunmap(page);
+	up_write(&ii->ii_sem);
+
+	if (retval < 0)
+		SetPageError(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return retval;
+}
+
+
+// ospfs_bmap(mapping, block)
+//	Returns the disk block that holds file block 'block', or 0 if there
+//	is none.  It is the address_space_operations.bmap callback (FIBMAP).
+
+static sector_t
+ospfs_bmap(struct address_space *mapping, sector_t block)
+{
+	ospfs_inode_t *oi = ospfs_inode(mapping->host->i_ino);
+
+	if (block >= ospfs_size2nblocks(oi->oi_size))
+		return 0;
+	return ospfs_inode_blockno(oi, block * OSPFS_BLKSIZE);
+}
+
+
 // find_direntry(dir_oi, name, namelen)
 //	Looks through the directory to find an entry with name 'name' (length
 //	in characters 'namelen').  Returns a pointer to the directory entry,
@@ -1331,30 +5246,83 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 //	      name    -- name to search for
 //	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
 //
-//	We have written this function for you.
+//	The search goes through the directory's hash index (see DIRECTORY
+//	INDEX above), which is built on the first lookup.
 
 static ospfs_direntry_t *
 find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 {
-	int off;
+	int off = find_direntry_off(dir_oi, name, namelen);
+	return off < 0 ? NULL : ospfs_inode_data(dir_oi, off);
+}
+
+
+// find_direntry_off(dir_oi, name, namelen)
+//	Like find_direntry, but returns the byte offset of the entry within
+//	the directory's data, or -1 if there is no such entry.
+
+static int
+find_direntry_off(ospfs_inode_t *dir_oi, const char *name, int namelen)
+{
+	ospfs_dir_index_t *di;
+	uint32_t off, probes;
+
 	if (namelen < 0)
 		namelen = strlen(name);
-	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
-		if (od->od_ino
-		    && strlen(od->od_name) == namelen
-		    && memcmp(od->od_name, name, namelen) == 0)
-			return od;
+	if (namelen > OSPFS_MAXNAMELEN)
+		return -1;
+
+	if ((di = ospfs_dir_index(dir_oi, 1)))
+		return dir_index_lookup(di, dir_oi, name, namelen);
+
+	// No index (out of memory): scan the whole directory
+	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE)
+		if (direntry_name_eq(ospfs_inode_data(dir_oi, off), name, namelen))
+			break;
+	probes = off / OSPFS_DIRENTRY_SIZE + (off < dir_oi->oi_size);
+	ospfs_stat_lookup(probes);
+	if (off >= dir_oi->oi_size) {
+		ospfs_trace_event(OSPFS_TRACE_DIRENTRY_LOOKUP, ospfs_inode_ino(dir_oi), -1, probes);
+		return -1;
 	}
-	return 0;
+	ospfs_trace_event(OSPFS_TRACE_DIRENTRY_LOOKUP, ospfs_inode_ino(dir_oi), off, probes);
+	return off;
+}
+
+
+// ospfs_fill_direntry(dir_oi, od, off, name, namelen, ino)
+//	Fills in the blank directory entry 'od', at offset 'off' in 'dir_oi'
+//	(as returned by create_blank_direntry), and adds it to the
+//	directory's index.  'namelen' must be at most OSPFS_MAXNAMELEN.
+//	Inode 'ino' must already have its oi_ftype set, since the entry
+//	caches it.
+
+static void
+ospfs_fill_direntry(ospfs_inode_t *dir_oi, ospfs_direntry_t *od, uint32_t off,
+		    const char *name, int namelen, uint32_t ino)
+{
+	ospfs_journal_dirty(od);
+	memcpy(od->od_name, name, namelen);
+	if (namelen < OSPFS_MAXNAMELEN)
+		od->od_name[namelen] = '\0';
+	smp_wmb();		// Lookups may be reading the entry
+	od->od_ino = ino;
+	// A name that fills od_name is terminated by the type byte
+	if (namelen < OSPFS_MAXNAMELEN)
+		od->od_ftype = OSPFS_DIRENTRY_FTYPE(ospfs_inode(ino)->oi_ftype);
+	else
+		od->od_ftype = OSPFS_DIRENTRY_FTYPE_UNKNOWN;
+	dir_index_add(dir_oi, off, name, namelen);
+	ospfs_trace_event(OSPFS_TRACE_DIRENTRY_CREATE, ospfs_inode_ino(dir_oi), off, ino);
 }
 
 
-// create_blank_direntry(dir_oi)
+// create_blank_direntry(dir_oi, offp)
 //	'dir_oi' is an OSP inode for a directory.
-//	Return a blank directory entry in that directory.  This might require
-//	adding a new block to the directory.  Returns an error pointer (see
-//	below) on failure.
+//	Return a blank directory entry in that directory, and set '*offp' to
+//	its byte offset in the directory (for ospfs_fill_direntry).  This might
+//	require adding a new block to the directory.  Returns an error pointer
+//	(see below) on failure.
 //
 // ERROR POINTERS: The Linux kernel uses a special convention for returning
 // error values in the form of pointers.  Here's how it works.
@@ -1379,41 +5347,52 @@ find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
 // EXERCISE: Write this function.
 
 static ospfs_direntry_t *
-create_blank_direntry(ospfs_inode_t *dir_oi)
+create_blank_direntry(ospfs_inode_t *dir_oi, uint32_t *offp)
 {
-
-
 	// Outline:
 	// 1. Check the existing directory data for an empty entry.  Return one
-	//    if you find it.
+	//    if you find it.  The directory index's hole count and first-hole
+	//    hint let us skip this step, or start it late.
 	// 2. If there's no empty entries, add a block to the directory.
 	//    Use ERR_PTR if this fails; otherwise, clear out all the directory
 	//    entries and return one of them.
+	ospfs_dir_index_t *di = ospfs_dir_index(dir_oi, 1);
+	ospfs_direntry_t *dir_entry;
+	uint32_t dir_pos = 0;
+	int r;
+
+	if (di && di->di_nholes == 0)
+		dir_pos = dir_oi->oi_size;
+	else if (di)
+		dir_pos = di->di_first_hole;
+
+	for (; dir_pos < dir_oi->oi_size; dir_pos += OSPFS_DIRENTRY_SIZE) {
+		dir_entry = ospfs_inode_data(dir_oi, dir_pos);
+
+		if (dir_entry->od_ino == 0) {
+			if (di) {
+				di->di_nholes--;
+				di->di_first_hole = dir_pos + OSPFS_DIRENTRY_SIZE;
+			}
+			*offp = dir_pos;
+			return dir_entry;
+		}
 
-	/* EXERCISE: Your code here. */
-  ospfs_direntry_t *dir_entry;
-  uint32_t dir_pos = 0;
-
-  while (ospfs_inode_blockno(dir_oi, dir_pos) != 0)  
-  {
-    dir_entry = ospfs_inode_data(dir_oi, dir_pos);
-
-    if (dir_entry->od_ino == 0)
-      return dir_entry;  
-
-    dir_pos += OSPFS_DIRENTRY_SIZE;
-
-    if (DEBUG_CREATE_BLANK_DIRENTRY)
-      eprintk("dir_pos: %d\n", dir_pos);
-  }
+	}
 
-  if (DEBUG_CREATE_BLANK_DIRENTRY)
-    eprintk("dir_oi dirsize: %d\n", dir_oi->oi_size);
+	// The hint was stale; there are no holes after all
+	if (di)
+		di->di_nholes = 0;
 
-  if (change_size(dir_oi, dir_pos + OSPFS_DIRENTRY_SIZE) < 0)
-    return ERR_PTR(-ENOSPC);
+	if ((r = change_size(dir_oi, dir_pos + OSPFS_DIRENTRY_SIZE)) < 0)
+		return ERR_PTR(r);
 
-  return ospfs_inode_data(dir_oi, dir_pos);
+	// A new block was erased through a buffer that isn't held; hold it
+	// now, as ospfs_inode_pin did the others
+	*offp = dir_pos;
+	if (!(dir_entry = ospfs_inode_data(dir_oi, dir_pos)))
+		return ERR_PTR(-EIO);
+	return dir_entry;
 }
 
 // ospfs_link(src_dentry, dir, dst_dentry
@@ -1450,37 +5429,52 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 static int
 ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dentry) {
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dir->i_ino);
 	ospfs_direntry_t *od;
 	ospfs_inode_t *src_oi = ospfs_inode(src_dentry->d_inode->i_ino);
-	int len = 0;
+	ospfs_inode_info_t *src_ii = ospfs_inode_info(src_dentry->d_inode->i_ino);
+	uint32_t off;
+	int retval = 0;
 
 	// Check name length
 	if (dst_dentry->d_name.len > OSPFS_MAXNAMELEN)
 		return -ENAMETOOLONG;
 
 	// Check if name already taken in dir
-	if (find_direntry(dir_oi, dst_dentry->d_name.name, dst_dentry->d_name.len) != NULL)
-		return -EEXIST;
+	down_write(&dir_ii->ii_sem);
+	if (find_direntry(dir_oi, dst_dentry->d_name.name, dst_dentry->d_name.len) != NULL) {
+		retval = -EEXIST;
+		goto out;
+	}
 
-	// Create entry for link
-	od = create_blank_direntry(dir_oi);
+	// Create entry for link; lock the source first, since its ii_sem
+	// may not be taken inside a journal handle
+	down_write(&src_ii->ii_sem);
+	ospfs_journal_begin(OSPFS_CREDITS_DIRENT);
+	od = create_blank_direntry(dir_oi, &off);
 	// Check for errors in creating entry
-	if (IS_ERR(od))
-		return PTR_ERR(od);
+	if (IS_ERR(od)) {
+		ospfs_journal_end();
+		up_write(&src_ii->ii_sem);
+		retval = PTR_ERR(od);
+		goto out;
+	}
 
 	// Populate direntry fields
-	while (len < dst_dentry->d_name.len) 
-	{
-		od->od_name[len] = dst_dentry->d_name.name[len];
-		len++;
-	}
-	od->od_name[len] = NULL;
-	od->od_ino = src_dentry->d_inode->i_ino;
+	ospfs_fill_direntry(dir_oi, od, off, dst_dentry->d_name.name,
+			    dst_dentry->d_name.len, src_dentry->d_inode->i_ino);
 
-	// Increment number of links for source file
+	// Increment number of links for source file, and for its Linux
+	// inode, which all its names share
+	ospfs_journal_dirty(src_oi);
 	src_oi->oi_nlink++;
-	
-	return 0;
+	src_dentry->d_inode->i_nlink++;
+	ospfs_journal_end();
+	up_write(&src_ii->ii_sem);
+
+    out:
+	up_write(&dir_ii->ii_sem);
+	return retval;
 }
 
 // ospfs_create
@@ -1507,7 +5501,8 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 //   the others.  Here's a brief outline of what you need to do:
 //   1. Check for the -EEXIST error and find an empty directory entry using the
 //	helper functions above.
-//   2. Find an empty inode.  Set the 'entry_ino' variable to its inode number.
+//   2. Find an empty inode with allocate_inode().  Set the 'entry_ino'
+//	variable to its inode number.
 //   3. Initialize the directory entry and inode.
 //
 //   EXERCISE: Complete this function.
@@ -1516,70 +5511,47 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 static int
 ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
-	/* EXERCISE: Your code here. */
-  // Done - Vincent.
-
-
-
-  uint32_t idx = 0;
-  ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-
-  uint32_t entry_ino = 2;
-  ospfs_direntry_t *dir_new_entry;
-  ospfs_inode_t *file_new_oi;
-
-
-  if (DEBUG_OSPFS_CREATE)
-    eprintk("ospfs_create function init, creating a blank direntry\n");
-
-  if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != 0)
-    return -EEXIST;
-
-  dir_new_entry = create_blank_direntry(dir_oi);
-
-
-  for (idx = 0; idx < dentry->d_name.len; idx++)
-    dir_new_entry->od_name[idx] = dentry->d_name.name[idx];
-  dir_new_entry->od_name[idx] = '\0';
-
-
-  if (DEBUG_OSPFS_CREATE)
-    eprintk("ospfs create: attempting to find free inode\n");
-
-  while (1)
-  {
-    if ((file_new_oi = ospfs_inode(entry_ino)) == 0)
-    {
-      if (DEBUG_OSPFS_CREATE)
-        eprintk("Ran out of inode entries when attempting to create a new file\n");
-      return -ENOSPC;
-    }
-    if (file_new_oi->oi_nlink == 0)
-      break;
-    entry_ino++;
-  }
-
-
-
-  if (DEBUG_OSPFS_CREATE)
-    eprintk("ospfs create: initializing the parameters of the inode\n");
-
-  file_new_oi->oi_nlink++;
-  file_new_oi->oi_mode = mode;
-  file_new_oi->oi_ftype = OSPFS_FTYPE_REG;       
-
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dir->i_ino);
+	uint32_t entry_ino;
+	ospfs_direntry_t *dir_new_entry;
+	ospfs_inode_t *file_new_oi;
+	uint32_t off;
 
-  if (dentry->d_name.len > OSPFS_MAXNAMELEN)
-    return -ENAMETOOLONG;
+	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
 
-  for (idx = 0; idx < dentry->d_name.len; idx++)
-    dir_new_entry->od_name[idx] = dentry->d_name.name[idx];
-  dir_new_entry->od_name[idx] = '\0';
+	down_write(&dir_ii->ii_sem);
+	if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != 0) {
+		up_write(&dir_ii->ii_sem);
+		return -EEXIST;
+	}
 
-  dir_new_entry->od_ino = entry_ino;
-  
+	if ((entry_ino = allocate_inode()) == 0) {
+		up_write(&dir_ii->ii_sem);
+		return -ENOSPC;
+	}
+	file_new_oi = ospfs_inode(entry_ino);
+
+	ospfs_journal_begin(OSPFS_CREDITS_CREATE);
+	dir_new_entry = create_blank_direntry(dir_oi, &off);
+	if (IS_ERR(dir_new_entry)) {
+		ospfs_journal_end();
+		release_inode(entry_ino);
+		up_write(&dir_ii->ii_sem);
+		return PTR_ERR(dir_new_entry);
+	}
 
+	ospfs_journal_dirty(file_new_oi);
+	memset(file_new_oi, 0, sizeof(ospfs_inode_t));
+	file_new_oi->oi_nlink = 1;
+	file_new_oi->oi_mode = mode | OSPFS_MODE_INLINE;
+	file_new_oi->oi_ftype = OSPFS_FTYPE_REG;
 
+	ospfs_fill_direntry(dir_oi, dir_new_entry, off, dentry->d_name.name,
+			    dentry->d_name.len, entry_ino);
+	ospfs_journal_end();
+	up_write(&dir_ii->ii_sem);
 
 	/* Execute this code after your function has successfully created the
 	   file.  Set entry_ino to the created file's inode number before
@@ -1638,38 +5610,45 @@ static int
 ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 {
 	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-	uint32_t entry_ino = 0;
+	ospfs_inode_info_t *dir_ii = ospfs_inode_info(dir->i_ino);
+	uint32_t entry_ino;
 	ospfs_symlink_inode_t *sym_oi;
  	ospfs_direntry_t *od;
  	int len = 0;
+	uint32_t off;
 
  	// Check if either name length is too long
  	while (symname[len] != NULL)
  		len++;
- 	if (len > OSPFS_MAXSYMLINKLEN || dentry->d_name.len > OSPFS_MAXSYMLINKLEN)
+ 	if (len > OSPFS_MAXSYMLINKLEN || dentry->d_name.len > OSPFS_MAXNAMELEN)
  		return -ENAMETOOLONG;
 
 	// Check if name is already taken in directory
-	if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != NULL)
+	down_write(&dir_ii->ii_sem);
+	if (find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len) != NULL) {
+		up_write(&dir_ii->ii_sem);
 		return -EEXIST;
-
-	// Find the first open inode
-	for (; entry_ino < ospfs_super->os_ninodes; entry_ino++)
-	{
-		sym_oi = (ospfs_symlink_inode_t*)ospfs_inode(entry_ino);
-		if (sym_oi->oi_nlink == 0) // Indicates free symlink inode
-			break;
 	}
-	// Check if there are no open inodes
-	if (entry_ino == ospfs_super->os_ninodes)
+
+	// Find a free inode
+	if ((entry_ino = allocate_inode()) == 0) {
+		up_write(&dir_ii->ii_sem);
 		return -ENOSPC;
+	}
+	sym_oi = (ospfs_symlink_inode_t *) ospfs_inode(entry_ino);
 
 	// Create blank direntry + error check
-	od = create_blank_direntry(dir_oi);
-	if (IS_ERR(od))
+	ospfs_journal_begin(OSPFS_CREDITS_CREATE);
+	od = create_blank_direntry(dir_oi, &off);
+	if (IS_ERR(od)) {
+		ospfs_journal_end();
+		release_inode(entry_ino);
+		up_write(&dir_ii->ii_sem);
 		return PTR_ERR(od);
+	}
 
 	// Populate symlink fields
+	ospfs_journal_dirty(sym_oi);
 	sym_oi->oi_size = len;
 	sym_oi->oi_ftype = OSPFS_FTYPE_SYMLINK;
 	sym_oi->oi_nlink = 1;
@@ -1678,10 +5657,10 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 	sym_oi->oi_symlink[len] = NULL;
 
 	// Populate direntry fields
-	for (len = 0; len < dentry->d_name.len; len++)
-		od->od_name[len] = dentry->d_name.name[len];
-	od->od_name[len] = NULL;
-	od->od_ino = entry_ino;
+	ospfs_fill_direntry(dir_oi, od, off, dentry->d_name.name,
+			    dentry->d_name.len, entry_ino);
+	ospfs_journal_end();
+	up_write(&dir_ii->ii_sem);
 
 	/* Execute this code after your function has successfully created the
 	   file.  Set entry_ino to the created file's inode number before
@@ -1773,17 +5752,31 @@ static struct file_system_type ospfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ospfs",
 	.get_sb		= ospfs_get_sb,
-	.kill_sb	= kill_anon_super
+	.kill_sb	= ospfs_kill_sb
 };
 
 static struct inode_operations ospfs_reg_inode_ops = {
-	.setattr	= ospfs_notify_change
+	.setattr	= ospfs_notify_change,
+	.getattr	= ospfs_getattr
 };
 
 static struct file_operations ospfs_reg_file_ops = {
 	.llseek		= generic_file_llseek,
 	.read		= ospfs_read,
-	.write		= ospfs_write
+	.write		= ospfs_write,
+	.mmap		= generic_file_mmap,
+	.sendfile	= generic_file_sendfile,
+	.splice_read	= generic_file_splice_read,
+	.open		= ospfs_open,
+	.release	= ospfs_release,
+	.fsync		= ospfs_fsync
+};
+
+static struct address_space_operations ospfs_aops = {
+	.readpage	= ospfs_readpage,
+	.writepage	= ospfs_writepage,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.bmap		= ospfs_bmap
 };
 
 static struct inode_operations ospfs_dir_inode_ops = {
@@ -1791,12 +5784,14 @@ static struct inode_operations ospfs_dir_inode_ops = {
 	.link		= ospfs_link,
 	.unlink		= ospfs_unlink,
 	.create		= ospfs_create,
-	.symlink	= ospfs_symlink
+	.symlink	= ospfs_symlink,
+	.getattr	= ospfs_getattr
 };
 
 static struct file_operations ospfs_dir_file_ops = {
 	.read		= generic_read_dir,
-	.readdir	= ospfs_dir_readdir
+	.readdir	= ospfs_dir_readdir,
+	.fsync		= ospfs_fsync
 };
 
 static struct inode_operations ospfs_symlink_inode_ops = {
@@ -1809,77 +5804,45 @@ static struct dentry_operations ospfs_dentry_ops = {
 };
 
 static struct super_operations ospfs_superblock_ops = {
+	.put_super	= ospfs_put_super,
+	.write_super	= ospfs_write_super,
+	.sync_fs	= ospfs_sync_fs
 };
 
 
-void replay_journal(void)
-{
-  ospfs_inode_t *journal_oi = ospfs_inode(OSPFS_JOURNAL_INODE);
-  int count = 0;
-  int amount = 0;
-  int f_pos = 0;
-
-  eprintk("journal_oi->oi_nlink = %d", journal_oi->oi_nlink);
-  eprintk("-----------------------------\n");
-  eprintk("Replaying journal:\n");
-  journal_oi->oi_nlink = 1;
-
-  count = journal_oi->oi_size;
-
-	// Copy the data to user block by block
-	while (amount < count) {
-		uint32_t blockno = ospfs_inode_blockno(journal_oi, f_pos);
-		uint32_t n;
-		char *data;
-    char *buffer;
-
-		// ospfs_inode_blockno returns 0 on error
-
-		if (blockno == 0) {
-      return;
-		}
-
-		data = ospfs_block(blockno);
-
-    n = (count - amount) > OSPFS_BLKSIZE ? OSPFS_BLKSIZE : (count - amount) ;
-
-    //Copying over the data
-    buffer = kmalloc((n + 1) * sizeof(char), 0);
-    buffer[n] = '\0';
-
-    eprintk("%s", buffer);
-
-
-		buffer += n;
-		amount += n;
-		f_pos += n;
-	}
-
-  eprintk("Finished replaying journal\n");
-  eprintk("-----------------------------\n");
-
-	return; 
-}
-
-
 // Functions used to hook the module into the kernel!
 
+static struct proc_dir_entry *ospfs_proc, *ospfs_trace_proc;
+
 static int __init init_ospfs_fs(void)
 {
-	eprintk("Loading ospfs module...\n");
-  
-  if (DESIGNPROJECT_JOURNAL)
-  {
-    eprintk("ospfs_super: %p\n", ospfs_super);
-    replay_journal();
-  }
+	int r;
 
-	return register_filesystem(&ospfs_fs_type);
+	eprintk("Loading ospfs module...\n");
+	if ((r = register_filesystem(&ospfs_fs_type)) < 0)
+		return r;
+	// Statistics and tracing are nice to have, so failing to set them
+	// up is OK
+	if ((ospfs_proc = create_proc_entry("fs/ospfs", 0444, NULL)))
+		ospfs_proc->proc_fops = &ospfs_stats_fops;
+	if ((ospfs_trace_rings = alloc_percpu(ospfs_trace_ring_t))
+	    && (ospfs_trace_proc = create_proc_entry("fs/ospfs_trace", 0444, NULL)))
+		ospfs_trace_proc->proc_fops = &ospfs_trace_fops;
+	return 0;
 }
 
 static void __exit exit_ospfs_fs(void)
 {
+	if (ospfs_proc)
+		remove_proc_entry("fs/ospfs", NULL);
+	if (ospfs_trace_proc)
+		remove_proc_entry("fs/ospfs_trace", NULL);
 	unregister_filesystem(&ospfs_fs_type);
+	// No RCU callback may run once the module's text is gone
+	rcu_barrier();
+	if (ospfs_trace_rings)
+		free_percpu(ospfs_trace_rings);
+	ospfs_sparse_destroy();
 	eprintk("Unloading ospfs module\n");
 }
 